@@ -0,0 +1,289 @@
+#include "../wart.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+// Allocation counting
+//
+// Counts every heap allocation in the process, operator new as well as the
+// malloc/realloc calls made by MemoryBuffer, libcurl and libjpeg, so that
+// benchmarks can report allocations per iteration next to ns/op. glibc lets
+// an executable interpose these and still reach its own implementation.
+// Sanitizers bring allocators of their own, which must not be bypassed, so
+// a Debug build reports no allocs/op.
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define WART_COUNT_ALLOCATIONS 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) ||     \
+    __has_feature(memory_sanitizer)
+#define WART_COUNT_ALLOCATIONS 0
+#endif
+#endif
+#ifndef WART_COUNT_ALLOCATIONS
+#define WART_COUNT_ALLOCATIONS 1
+#endif
+
+static std::atomic<size_t> allocations{0};
+
+#if WART_COUNT_ALLOCATIONS
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+namespace {
+
+// Reports allocations per iteration when it goes out of scope
+class AllocationCounter {
+public:
+  explicit AllocationCounter(benchmark::State &benchState)
+      : state(benchState), start(allocations.load()) {}
+
+  ~AllocationCounter() {
+    if (WART_COUNT_ALLOCATIONS) {
+      state.counters["allocs/op"] = benchmark::Counter(
+          static_cast<double>(allocations.load() - start - excluded),
+          benchmark::Counter::kAvgIterations);
+    }
+  }
+
+  // Run setup whose allocations should not count, like PauseTiming
+  template <typename Setup> void untimed(Setup &&setup) {
+    state.PauseTiming();
+    size_t before = allocations.load();
+    setup();
+    excluded += allocations.load() - before;
+    state.ResumeTiming();
+  }
+
+private:
+  benchmark::State &state;
+  size_t start;
+  size_t excluded = 0;
+};
+
+// Scratch directory removed at the end of a benchmark
+class TempDir {
+public:
+  TempDir() {
+    std::string pattern =
+        (fs::temp_directory_path() / "wart_bench.XXXXXX").string();
+    if (mkdtemp(pattern.data())) {
+      dir = pattern + "/";
+    }
+  }
+
+  ~TempDir() {
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+  }
+
+  const std::string &path() const { return dir; }
+
+private:
+  std::string dir;
+};
+
+// A response from the metadata API as it arrives over the wire
+const std::string biturlResponse = R"json({"start_date":"20241015",)json"
+    R"json("end_date":"20241016","url":"https://www.bing.com/th?id=OHR.)json"
+    R"json(AutumnVermont_EN-US1234567890_1920x1080.jpg","copyright":)json"
+    R"json("Autumn foliage in Vermont, USA (© Jane Doe/Getty Images)",)json"
+    R"json("copyright_link":"https://www.bing.com/search?q=Vermont)json"
+    R"json(&form=hpcapt&filters=HpDate%3a%2220241015_0700%22"})json";
+
+} // namespace
+
+// libcurl hands bodies over in chunks of up to CURL_MAX_WRITE_SIZE (16 KiB)
+static void BM_MemoryBufferAppend(benchmark::State &state) {
+  const size_t chunk = static_cast<size_t>(state.range(0));
+  const size_t total = static_cast<size_t>(state.range(1));
+  std::vector<char> data(chunk, 'x');
+
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    wart::MemoryBuffer buffer;
+    for (size_t written = 0; written < total; written += chunk) {
+      wart::writeMemoryCallback(data.data(), 1,
+                                std::min(chunk, total - written), &buffer);
+    }
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(total));
+}
+BENCHMARK(BM_MemoryBufferAppend)
+    ->Args({16384, 1024})
+    ->Args({16384, 1 << 20})
+    ->Args({16384, 8 << 20})
+    ->Args({1024, 1 << 20});
+
+static void BM_JsonParse(benchmark::State &state) {
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    std::string url = json::parse(biturlResponse)["url"];
+    benchmark::DoNotOptimize(url.data());
+  }
+}
+BENCHMARK(BM_JsonParse);
+
+static void BM_ParseMetadata(benchmark::State &state) {
+  AllocationCounter counter(state);
+  wart::WallpaperMetadata metadata;
+  std::string error;
+  for (auto _ : state) {
+    wart::parseMetadata(biturlResponse, metadata, error);
+    benchmark::DoNotOptimize(metadata.url.data());
+  }
+}
+BENCHMARK(BM_ParseMetadata);
+
+// wartrc with the given number of lines in the shape of the default one
+static void BM_LoadConfig(benchmark::State &state) {
+  TempDir tmp;
+  std::string path = tmp.path() + "wartrc";
+  {
+    std::ofstream wartrc(path);
+    static const char *lines[] = {
+        "interval 3600",
+        "skew 600",
+        "resolution 1920x1080",
+        "format jpg",
+        "# A comment about the next setting",
+        "storecount 16",
+        "x11hooks notify-send \"New wallpaper\" $WARTPAPER",
+        "hooks sh -c 'cp \"$WARTPAPER\" /tmp/last | true'",
+        "x11applier feh --bg-fill $WARTPAPER",
+        "hookjobs 4",
+    };
+    for (size_t i = 0; i < static_cast<size_t>(state.range(0)); ++i) {
+      wartrc << lines[i % std::size(lines)] << "\n";
+    }
+  }
+
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    wart::Config config;
+    benchmark::DoNotOptimize(wart::loadConfig(path, config));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_LoadConfig)->Arg(10)->Arg(1000)->Arg(100000);
+
+static void BM_ValidateConfig(benchmark::State &state) {
+  wart::Config config;
+  config.interval = 3600;
+  config.resolution = "UHD";
+  config.format = "png";
+
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(wart::validateConfig(config));
+  }
+}
+BENCHMARK(BM_ValidateConfig);
+
+// The per-command work of setWallpaper() and executeHooks() before spawning
+static void BM_SubstituteWartpaper(benchmark::State &state) {
+  static const std::string commands[] = {
+      "feh --bg-fill $WARTPAPER",
+      "swww img ${WARTPAPER} --transition-type grow",
+      "notify-send \"New wallpaper\" \"$WARTPAPER is set\"",
+  };
+  const std::string path = "/home/user/.wart/wallpaper.jpg";
+
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    for (const auto &command : commands) {
+      wart::CommandLine line = wart::tokenizeCommand(command);
+      for (auto &arg : line.args) {
+        wart::substituteWartpaper(arg, path);
+      }
+      benchmark::DoNotOptimize(line.args.data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          static_cast<int64_t>(std::size(commands)));
+}
+BENCHMARK(BM_SubstituteWartpaper);
+
+// cleanOldWallpapers() became store eviction; this covers loading a large
+// manifest and evicting half of it, with the files really on disk
+static void BM_StoreEvict(benchmark::State &state) {
+  const size_t images = static_cast<size_t>(state.range(0));
+  TempDir tmp;
+
+  auto populate = [&] {
+    json entries = json::array();
+    for (size_t i = 0; i < images; ++i) {
+      std::string hex = "00000000" + std::to_string(10000000 + i);
+      std::ofstream(tmp.path() + hex + ".jpg") << "x";
+      entries.push_back({{"hash", hex},
+                         {"ext", "jpg"},
+                         {"size", 1},
+                         {"last_used", static_cast<int64_t>(images - i)},
+                         {"url", "https://example.com/" + hex + ".jpg"}});
+    }
+    std::ofstream(tmp.path() + "manifest.json")
+        << json{{"version", 1}, {"entries", std::move(entries)}}.dump();
+  };
+
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    counter.untimed(populate);
+
+    wart::WallpaperStore store(tmp.path());
+    store.load();
+    store.evict(images / 2, 0, 0);
+    benchmark::DoNotOptimize(store.count());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StoreEvict)->Arg(1000)->Arg(5000)->Unit(benchmark::kMillisecond);
+
+// Cost to the calling thread; the writer formats into nowhere
+static void BM_LogMessage(benchmark::State &state) {
+  for (auto _ : state) {
+    wart::logMessage(wart::LogLevel::INFO,
+                     "Evicting /tmp/store/0123456789abcdef.jpg");
+  }
+}
+BENCHMARK(BM_LogMessage)->Threads(1)->Threads(4);
+
+// Keep wart's log lines (eviction logs every file) off the report
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+
+  wart::LogOptions quiet;
+  quiet.console = false;
+  wart::Logger::instance().configure(quiet);
+
+  benchmark::ConsoleReporter reporter(isatty(STDOUT_FILENO)
+                                         ? benchmark::ConsoleReporter::OO_Defaults
+                                         : benchmark::ConsoleReporter::OO_Tabular);
+  benchmark::RunSpecifiedBenchmarks(&reporter);
+  benchmark::Shutdown();
+  return 0;
+}
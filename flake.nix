@@ -1,5 +1,5 @@
 {
-  description = "C++ project using curl and nlohmann_json";
+  description = "C++ project using curl, nlohmann_json, libjpeg, libwebp, zlib and libX11";
 
   inputs = {
     nixpkgs.url = "github:NixOS/nixpkgs/nixos-unstable";
@@ -18,13 +18,13 @@
       src = ./.;
 
       nativeBuildInputs = [pkgs.gcc];
-      buildInputs = [pkgs.curl pkgs.nlohmann_json];
+      buildInputs = [pkgs.curl pkgs.nlohmann_json pkgs.libjpeg pkgs.libwebp pkgs.zlib pkgs.xorg.libX11];
 
       CXXFLAGS = ["-O3" "-march=native" "-flto" "-std=c++20" "-DNDEBUG"];
       LDFLAGS = ["-flto" "-s"];
 
       buildPhase = ''
-        g++ $CXXFLAGS -o wart wart.cc -lcurl -I${pkgs.nlohmann_json}/include $LDFLAGS
+        g++ $CXXFLAGS -DWART_HAVE_JPEG -DWART_HAVE_WEBP -DWART_HAVE_X11 -o wart main.cc wart.cc history.cc image.cc log.cc metrics.cc palette.cc provider.cc retry.cc serve.cc x11.cc -lcurl -ljpeg -lwebp -lz -lX11 -I${pkgs.nlohmann_json}/include $LDFLAGS
         strip wart
       '';
 
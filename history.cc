@@ -0,0 +1,238 @@
+#include "history.hh"
+#include "wart.hh"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+namespace wart {
+
+namespace {
+
+constexpr char HISTORY_MAGIC[8] = {'W', 'A', 'R', 'T', 'H', 'I', 'S', 'T'};
+constexpr uint32_t HISTORY_VERSION = 1;
+
+// Start of the index file, followed by the records
+struct HistoryHeader {
+  char magic[8] = {};
+  uint32_t version = 0;
+  uint32_t recordSize = 0;
+  uint64_t count = 0; // Records published so far
+  char reserved[40] = {};
+};
+
+static_assert(sizeof(HistoryHeader) == 64, "history header layout changed");
+
+bool validHeader(const HistoryHeader &header) {
+  return std::memcmp(header.magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC)) ==
+             0 &&
+         header.version == HISTORY_VERSION &&
+         header.recordSize == sizeof(HistoryRecord);
+}
+
+// Write all of size bytes at offset
+bool writeAt(int fd, const void *data, size_t size, off_t offset) {
+  const auto *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, bytes, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+} // namespace
+
+HistoryIndex::HistoryIndex(std::string filePath) : path(std::move(filePath)) {}
+
+HistoryIndex::~HistoryIndex() { unmap(); }
+
+void HistoryIndex::unmap() {
+  if (map) {
+    munmap(const_cast<unsigned char *>(map), mapSize);
+  }
+  map = nullptr;
+  mapSize = 0;
+  count = 0;
+}
+
+bool HistoryIndex::open() {
+  unmap();
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  size_t fileSize = static_cast<size_t>(st.st_size);
+  if (fileSize < sizeof(HistoryHeader)) {
+    close(fd);
+    return true; // Created but nothing published yet
+  }
+
+  void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG_ERROR("Failed to map history index");
+    return false;
+  }
+  map = static_cast<const unsigned char *>(mapped);
+  mapSize = fileSize;
+
+  HistoryHeader header;
+  std::memcpy(&header, map, sizeof(header));
+  if (!validHeader(header)) {
+    LOG_ERROR("Unrecognized history index: " + path);
+    unmap();
+    return false;
+  }
+
+  // A record past the end of the file was never completely written
+  count = std::min<size_t>(header.count, (mapSize - sizeof(HistoryHeader)) /
+                                             sizeof(HistoryRecord));
+  return true;
+}
+
+const HistoryRecord *HistoryIndex::at(size_t n) const {
+  if (n >= count) {
+    return nullptr;
+  }
+  return reinterpret_cast<const HistoryRecord *>(
+      map + sizeof(HistoryHeader) + (count - 1 - n) * sizeof(HistoryRecord));
+}
+
+bool HistoryIndex::append(const HistoryRecord &record) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open history index: " + path);
+    return false;
+  }
+
+  // Appenders take turns; readers rely on the count alone
+  flock(fd, LOCK_EX);
+
+  HistoryHeader header;
+  ssize_t read = pread(fd, &header, sizeof(header), 0);
+  if (read == 0) {
+    std::memcpy(header.magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+    header.version = HISTORY_VERSION;
+    header.recordSize = sizeof(HistoryRecord);
+    header.count = 0;
+  } else if (read != static_cast<ssize_t>(sizeof(header)) ||
+             !validHeader(header)) {
+    LOG_ERROR("Unrecognized history index: " + path);
+    close(fd);
+    return false;
+  }
+
+  // The record must be on disk before the count that makes it visible
+  off_t offset = static_cast<off_t>(sizeof(HistoryHeader) +
+                                    header.count * sizeof(HistoryRecord));
+  bool written = writeAt(fd, &record, sizeof(record), offset) &&
+                 fdatasync(fd) == 0;
+  if (written) {
+    ++header.count;
+    written = writeAt(fd, &header, sizeof(header), 0) && fdatasync(fd) == 0;
+  }
+  close(fd);
+
+  if (!written) {
+    LOG_ERROR("Failed to write history index: " + path);
+    return false;
+  }
+  return open();
+}
+
+std::string HistoryRing::pathFor(const HistorySlot &slot) const {
+  return dir + hashToHex(slot.hash) + "." + slot.ext;
+}
+
+bool HistoryRing::load() {
+  slots.clear();
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec) {
+    LOG_ERROR("Failed to create history directory: " + ec.message());
+    return false;
+  }
+
+  std::ifstream file(dir + "ring");
+  std::string hex, ext;
+  while (file >> hex >> ext) {
+    HistorySlot slot;
+    if (hexToHash(hex, slot.hash)) {
+      slot.ext = ext;
+      slots.push_back(std::move(slot));
+    }
+  }
+  return true;
+}
+
+bool HistoryRing::save() const {
+  std::string contents;
+  for (const auto &slot : slots) {
+    contents += hashToHex(slot.hash) + " " + slot.ext + "\n";
+  }
+  if (!writeFileAtomic(dir + "ring", contents)) {
+    LOG_ERROR("Failed to save wallpaper history");
+    return false;
+  }
+  return true;
+}
+
+bool HistoryRing::push(const std::string &file, uint64_t hash,
+                       const std::string &ext, size_t depth) {
+  auto same = [&](const HistorySlot &slot) {
+    return slot.hash == hash && slot.ext == ext;
+  };
+  auto it = std::find_if(slots.begin(), slots.end(), same);
+  if (it != slots.end()) {
+    std::rotate(slots.begin(), it, it + 1);
+  } else {
+    HistorySlot slot{hash, ext};
+    if (!cloneFile(file, pathFor(slot))) {
+      LOG_ERROR("Failed to back up " + file);
+      return false;
+    }
+    slots.insert(slots.begin(), std::move(slot));
+  }
+
+  while (slots.size() > depth) {
+    HistorySlot oldest = std::move(slots.back());
+    slots.pop_back();
+    discard(oldest);
+  }
+  return save();
+}
+
+HistorySlot HistoryRing::take(size_t n) {
+  HistorySlot slot = std::move(slots[n]);
+  slots.erase(slots.begin() + static_cast<std::ptrdiff_t>(n));
+  return slot;
+}
+
+void HistoryRing::discard(const HistorySlot &slot) {
+  for (const auto &kept : slots) {
+    if (kept.hash == slot.hash && kept.ext == slot.ext) {
+      return;
+    }
+  }
+  std::error_code ec;
+  fs::remove(pathFor(slot), ec);
+}
+
+} // namespace wart
@@ -0,0 +1,136 @@
+#pragma once
+
+// Standard Library
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace wart {
+
+// One applied wallpaper as recorded in the history index. Records have a
+// fixed size so that the nth one is found by offset alone; strings are
+// truncated to fit and NUL padded.
+struct HistoryRecord {
+  uint64_t hash = 0;            // Stored image that was applied
+  uint64_t source = 0;          // Original it was derived from, or 0
+  uint64_t size = 0;            // Bytes of the applied image
+  uint64_t bytesDownloaded = 0; // Over the network, 0 if already stored
+  int64_t fetchedAt = 0;        // Unix time
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t metadataMs = 0; // Metadata request
+  uint32_t downloadMs = 0; // Image download
+  uint32_t deriveMs = 0;   // Local scaling and transcoding
+  uint32_t reserved = 0;
+  char ext[8] = {};
+  char startDate[12] = {}; // YYYYMMDD
+  char endDate[12] = {};
+  char url[544] = {};
+  char copyright[384] = {};
+
+  std::string_view extView() const { return field(ext); }
+  std::string_view startDateView() const { return field(startDate); }
+  std::string_view endDateView() const { return field(endDate); }
+  std::string_view urlView() const { return field(url); }
+  std::string_view copyrightView() const { return field(copyright); }
+
+  // Copy value into one of the fields above, truncating it if needed
+  template <size_t N>
+  static void set(char (&dest)[N], std::string_view value) {
+    size_t length = std::min(value.size(), N - 1);
+    // Never cut a UTF-8 sequence in half
+    while (length < value.size() && length > 0 &&
+           (static_cast<unsigned char>(value[length]) & 0xC0) == 0x80) {
+      --length;
+    }
+    value.copy(dest, length);
+    std::fill(dest + length, dest + N, '\0');
+  }
+
+private:
+  template <size_t N> static std::string_view field(const char (&value)[N]) {
+    size_t length = 0;
+    while (length < N && value[length] != '\0') {
+      ++length;
+    }
+    return {value, length};
+  }
+};
+
+static_assert(sizeof(HistoryRecord) == 1024, "history record layout changed");
+
+// Append-only file of HistoryRecords behind a small header, read through a
+// memory map. status, history and restore look records up by position
+// without touching the store or the network.
+class HistoryIndex {
+public:
+  explicit HistoryIndex(std::string filePath);
+  ~HistoryIndex();
+
+  HistoryIndex(const HistoryIndex &) = delete;
+  HistoryIndex &operator=(const HistoryIndex &) = delete;
+
+  // Map the index for reading. A missing file is an empty index.
+  bool open();
+
+  size_t size() const { return count; }
+
+  // Record n steps back, 0 being the most recent; nullptr if out of range
+  const HistoryRecord *at(size_t n) const;
+
+  // Write a record after the last one and publish it by bumping the count
+  // in the header, so readers never see a half-written record. The map is
+  // refreshed to include it.
+  bool append(const HistoryRecord &record);
+
+private:
+  void unmap();
+
+  std::string path;
+  const unsigned char *map = nullptr;
+  size_t mapSize = 0;
+  size_t count = 0;
+};
+
+// One wallpaper kept in the history ring
+struct HistorySlot {
+  uint64_t hash = 0;
+  std::string ext;
+};
+
+// The last few wallpapers that were replaced, most recent first. Each is a
+// hard link (or reflink, or as a last resort a copy) of the stored image
+// under directory, so it outlives store eviction without its bytes being
+// copied; the order lives in a small index file next to them.
+class HistoryRing {
+public:
+  explicit HistoryRing(std::string directory) : dir(std::move(directory)) {}
+
+  bool load();
+  bool save() const;
+
+  size_t size() const { return slots.size(); }
+  const HistorySlot &at(size_t n) const { return slots[n]; }
+  std::string pathFor(const HistorySlot &slot) const;
+
+  // Put file, holding the image hash, in front and drop slots beyond depth.
+  // An image already in the ring is only moved to the front.
+  bool push(const std::string &file, uint64_t hash, const std::string &ext,
+            size_t depth);
+
+  // Take slot n out of the ring. Its file stays until discard().
+  HistorySlot take(size_t n);
+
+  // Remove a taken slot's file unless the ring still refers to it
+  void discard(const HistorySlot &slot);
+
+private:
+
+  std::string dir;
+  std::vector<HistorySlot> slots;
+};
+
+} // namespace wart
@@ -0,0 +1,912 @@
+#include "image.hh"
+#include "wart.hh"
+
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WART_X86 1
+#endif
+
+#include <zlib.h>
+
+#ifdef WART_HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#ifdef WART_HAVE_WEBP
+#include <webp/encode.h>
+#endif
+
+namespace wart {
+
+bool parseResolution(const std::string &value, int &width, int &height) {
+  size_t x = value.find('x');
+  if (x == std::string::npos) {
+    return false;
+  }
+
+  auto parse = [](std::string_view text, int &out) {
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+    return ec == std::errc() && ptr == text.data() + text.size() && out > 0;
+  };
+  std::string_view text(value);
+  return parse(text.substr(0, x), width) && parse(text.substr(x + 1), height);
+}
+
+std::string sniffImageFormat(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  unsigned char magic[12] = {};
+  if (!file.read(reinterpret_cast<char *>(magic), sizeof(magic))) {
+    return "";
+  }
+
+  if (magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+    return "jpg";
+  }
+  if (std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+    return "png";
+  }
+  if (std::memcmp(magic, "RIFF", 4) == 0 &&
+      std::memcmp(magic + 8, "WEBP", 4) == 0) {
+    return "webp";
+  }
+  return "";
+}
+
+namespace {
+
+// Run work(0) .. work(parts - 1) on their own threads
+template <typename Work> void runParts(size_t parts, Work &&work) {
+  std::vector<std::thread> workers;
+  for (size_t p = 1; p < parts; ++p) {
+    workers.emplace_back(work, p);
+  }
+  work(size_t{0});
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+uint32_t bigEndian16(const unsigned char *p) {
+  return static_cast<uint32_t>(p[0]) << 8 | p[1];
+}
+
+uint32_t bigEndian32(const unsigned char *p) {
+  return bigEndian16(p) << 16 | bigEndian16(p + 2);
+}
+
+uint32_t littleEndian24(const unsigned char *p) {
+  return static_cast<uint32_t>(p[2]) << 16 |
+         static_cast<uint32_t>(p[1]) << 8 | p[0];
+}
+
+// Walk the JPEG segments up to the first start of frame, seeking over the
+// rest (EXIF thumbnails can be tens of KiB)
+bool probeJpeg(std::ifstream &file, uint32_t &width, uint32_t &height) {
+  file.seekg(2);
+  unsigned char segment[9];
+  while (file.read(reinterpret_cast<char *>(segment), 4)) {
+    if (segment[0] != 0xFF) {
+      return false;
+    }
+    unsigned char marker = segment[1];
+    if (marker == 0xFF) { // Fill byte
+      file.seekg(-3, std::ios::cur);
+      continue;
+    }
+    uint32_t length = bigEndian16(segment + 2);
+    if (length < 2) {
+      return false;
+    }
+
+    // SOF0-SOF15, except DHT, JPG and DAC which share the range
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (!file.read(reinterpret_cast<char *>(segment + 4), 5)) {
+        return false;
+      }
+      height = bigEndian16(segment + 5);
+      width = bigEndian16(segment + 7);
+      return true;
+    }
+    if (marker == 0xD9 || marker == 0xDA) { // End of image, start of scan
+      return false;
+    }
+    file.seekg(static_cast<std::streamoff>(length) - 2, std::ios::cur);
+  }
+  return false;
+}
+
+} // namespace
+
+bool probeImageSize(const std::string &path, int &width, int &height) {
+  std::ifstream file(path, std::ios::binary);
+  unsigned char header[30] = {};
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return false;
+  }
+
+  uint32_t w = 0, h = 0;
+  if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
+    if (!probeJpeg(file, w, h)) {
+      return false;
+    }
+  } else if (std::memcmp(header, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+             std::memcmp(header + 12, "IHDR", 4) == 0) {
+    w = bigEndian32(header + 16);
+    h = bigEndian32(header + 20);
+  } else if (std::memcmp(header, "RIFF", 4) == 0 &&
+             std::memcmp(header + 8, "WEBP", 4) == 0) {
+    if (std::memcmp(header + 12, "VP8 ", 4) == 0) {
+      w = (header[26] | static_cast<uint32_t>(header[27]) << 8) & 0x3FFF;
+      h = (header[28] | static_cast<uint32_t>(header[29]) << 8) & 0x3FFF;
+    } else if (std::memcmp(header + 12, "VP8L", 4) == 0) {
+      uint32_t bits = header[21] | static_cast<uint32_t>(header[22]) << 8 |
+                      static_cast<uint32_t>(header[23]) << 16 |
+                      static_cast<uint32_t>(header[24]) << 24;
+      w = (bits & 0x3FFF) + 1;
+      h = ((bits >> 14) & 0x3FFF) + 1;
+    } else if (std::memcmp(header + 12, "VP8X", 4) == 0) {
+      w = littleEndian24(header + 24) + 1;
+      h = littleEndian24(header + 27) + 1;
+    }
+  }
+
+  if (w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX) {
+    return false;
+  }
+  width = static_cast<int>(w);
+  height = static_cast<int>(h);
+  return true;
+}
+
+// JPEG codec
+#ifdef WART_HAVE_JPEG
+bool haveJpeg() { return true; }
+
+namespace {
+
+// libjpeg reports fatal errors through error_exit, which must not return
+struct JpegError {
+  jpeg_error_mgr mgr;
+  std::jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  LOG_ERROR(std::string("JPEG: ") + message);
+  std::longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+}
+
+} // namespace
+
+bool decodeJpeg(const std::string &path, Image &image, int minWidth,
+                int minHeight) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    LOG_ERROR("Cannot open " + path);
+    return false;
+  }
+
+  jpeg_decompress_struct cinfo;
+  JpegError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpegErrorExit;
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+
+  // Let the IDCT do the bulk of a large downscale
+  if (minWidth > 0 && minHeight > 0) {
+    unsigned denom = 8;
+    while (denom > 1 && (cinfo.image_width / denom <
+                             static_cast<unsigned>(minWidth) ||
+                         cinfo.image_height / denom <
+                             static_cast<unsigned>(minHeight))) {
+      denom /= 2;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+  }
+
+  jpeg_start_decompress(&cinfo);
+  image.width = static_cast<int>(cinfo.output_width);
+  image.height = static_cast<int>(cinfo.output_height);
+  image.pixels.resize(static_cast<size_t>(image.width) *
+                      static_cast<size_t>(image.height) * 3);
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = image.row(static_cast<int>(cinfo.output_scanline));
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(fp);
+  return true;
+}
+
+namespace {
+
+// Compress rows [first, first + count) as a JPEG of their own into out.
+// With restartRows every that many MCU rows end in a restart marker.
+bool compressJpeg(const Image &image, int first, int count, int quality,
+                  bool optimize, unsigned restartRows,
+                  std::vector<uint8_t> &out) {
+  jpeg_compress_struct cinfo;
+  JpegError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpegErrorExit;
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return false;
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = static_cast<JDIMENSION>(image.width);
+  cinfo.image_height = static_cast<JDIMENSION>(count);
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.optimize_coding = optimize ? TRUE : FALSE;
+  cinfo.restart_in_rows = static_cast<int>(restartRows);
+
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(
+        image.row(first + static_cast<int>(cinfo.next_scanline)));
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  out.assign(buffer, buffer + size);
+  free(buffer);
+  return true;
+}
+
+// Offsets of the start of frame and of the entropy-coded data after the
+// start of scan header
+bool findJpegScan(const std::vector<uint8_t> &data, size_t &frame,
+                  size_t &scan) {
+  size_t pos = 2;
+  frame = 0;
+  while (pos + 4 <= data.size() && data[pos] == 0xFF) {
+    uint8_t marker = data[pos + 1];
+    size_t length = bigEndian16(&data[pos + 2]);
+    if (marker == 0xC0 || marker == 0xC1) {
+      frame = pos;
+    }
+    if (marker == 0xDA) {
+      scan = pos + 2 + length;
+      return frame != 0 && scan <= data.size();
+    }
+    pos += 2 + length;
+  }
+  return false;
+}
+
+// Entropy code a JPEG again with Huffman tables optimized for it. The
+// coefficients are copied, so this is lossless and much cheaper than the
+// transform; restart markers are dropped on the way.
+bool optimizeJpeg(std::vector<uint8_t> &data) {
+  jpeg_decompress_struct source;
+  jpeg_compress_struct dest;
+  JpegError err;
+  source.err = dest.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpegErrorExit;
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+
+  jpeg_create_decompress(&source);
+  jpeg_create_compress(&dest);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&dest);
+    jpeg_destroy_decompress(&source);
+    free(buffer);
+    return false;
+  }
+
+  jpeg_mem_src(&source, data.data(), static_cast<unsigned long>(data.size()));
+  jpeg_read_header(&source, TRUE);
+  jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&source);
+  jpeg_copy_critical_parameters(&source, &dest);
+  dest.optimize_coding = TRUE;
+  jpeg_mem_dest(&dest, &buffer, &size);
+  jpeg_write_coefficients(&dest, coefficients);
+  jpeg_finish_compress(&dest);
+  jpeg_finish_decompress(&source);
+  jpeg_destroy_compress(&dest);
+  jpeg_destroy_decompress(&source);
+
+  data.assign(buffer, buffer + size);
+  free(buffer);
+  return true;
+}
+
+// Append a strip's entropy-coded data up to its end of image, numbering
+// its restart markers on from next
+void appendJpegScan(std::vector<uint8_t> &out, const std::vector<uint8_t> &data,
+                    size_t scan, unsigned &next) {
+  size_t end = data.size() - 2;
+  for (size_t i = scan; i < end; ++i) {
+    out.push_back(data[i]);
+    if (data[i] == 0xFF && i + 1 < end) {
+      uint8_t marker = data[++i];
+      if (marker >= 0xD0 && marker <= 0xD7) {
+        marker = static_cast<uint8_t>(0xD0 + (next++ & 7));
+      }
+      out.push_back(marker);
+    }
+  }
+}
+
+} // namespace
+
+bool encodeJpeg(const Image &image, const std::string &path, int quality,
+                unsigned threads) {
+  if (image.empty()) {
+    return false;
+  }
+
+  // Strips start on a 16 row boundary, the MCU height of 4:2:0
+  const size_t rows = static_cast<size_t>(image.height);
+  const size_t parts =
+      std::clamp<size_t>(threads, 1, std::max<size_t>(1, rows / 128));
+  std::vector<int> firstRow(parts + 1);
+  for (size_t p = 0; p <= parts; ++p) {
+    size_t row = p == parts ? rows : rows * p / parts & ~size_t{15};
+    firstRow[p] = static_cast<int>(row);
+  }
+
+  // Strips share the standard Huffman tables and reset their DC
+  // prediction at a restart marker after every MCU row, so their scans
+  // join into one, which is then coded again with optimized tables
+  std::vector<std::vector<uint8_t>> strips(parts);
+  std::vector<char> failed(parts, 0);
+  runParts(parts, [&](size_t p) {
+    failed[p] = !compressJpeg(image, firstRow[p], firstRow[p + 1] - firstRow[p],
+                              quality, parts == 1, parts == 1 ? 0 : 1,
+                              strips[p]);
+  });
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+    return false;
+  }
+
+  std::vector<uint8_t> joined;
+  std::vector<uint8_t> &out = parts == 1 ? strips[0] : joined;
+  if (parts > 1) {
+    size_t frame = 0;
+    size_t scan = 0;
+    if (!findJpegScan(strips[0], frame, scan)) {
+      LOG_ERROR("JPEG strip without a baseline scan");
+      return false;
+    }
+    joined.assign(strips[0].begin(),
+                  strips[0].begin() + static_cast<std::ptrdiff_t>(scan));
+    joined[frame + 5] = static_cast<uint8_t>(rows >> 8);
+    joined[frame + 6] = static_cast<uint8_t>(rows);
+
+    unsigned next = 0;
+    for (size_t p = 0; p < parts; ++p) {
+      size_t stripFrame = 0;
+      size_t stripScan = 0;
+      if (!findJpegScan(strips[p], stripFrame, stripScan)) {
+        LOG_ERROR("JPEG strip without a baseline scan");
+        return false;
+      }
+      if (p > 0) {
+        joined.push_back(0xFF);
+        joined.push_back(static_cast<uint8_t>(0xD0 + (next++ & 7)));
+      }
+      appendJpegScan(joined, strips[p], stripScan, next);
+    }
+    joined.push_back(0xFF);
+    joined.push_back(0xD9);
+    if (!optimizeJpeg(joined)) {
+      return false;
+    }
+  }
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    LOG_ERROR("Cannot create " + path);
+    return false;
+  }
+  bool written = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  if (fclose(fp) != 0 || !written) {
+    LOG_ERROR("Failed to write " + path);
+    return false;
+  }
+  return true;
+}
+#else
+bool haveJpeg() { return false; }
+
+bool decodeJpeg(const std::string &, Image &, int, int) {
+  LOG_ERROR("Built without JPEG support");
+  return false;
+}
+
+bool encodeJpeg(const Image &, const std::string &, int, unsigned) {
+  LOG_ERROR("Built without JPEG support");
+  return false;
+}
+#endif
+
+// PNG encoder
+namespace {
+
+uint8_t paethPredictor(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  return static_cast<uint8_t>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Filter one row with whichever of the five PNG filters leaves the
+// smallest sum of absolute residuals, the heuristic the PNG specification
+// recommends. out receives the filter type byte followed by the row.
+void filterRow(const uint8_t *row, const uint8_t *prior, size_t stride,
+               uint8_t *out, std::vector<uint8_t> &scratch) {
+  uint8_t *candidates[5];
+  for (size_t f = 0; f < 5; ++f) {
+    candidates[f] = scratch.data() + f * stride;
+  }
+
+  for (size_t i = 0; i < stride; ++i) {
+    int a = i >= 3 ? row[i - 3] : 0;
+    int b = prior[i];
+    int c = i >= 3 ? prior[i - 3] : 0;
+    int x = row[i];
+    candidates[0][i] = static_cast<uint8_t>(x);
+    candidates[1][i] = static_cast<uint8_t>(x - a);
+    candidates[2][i] = static_cast<uint8_t>(x - b);
+    candidates[3][i] = static_cast<uint8_t>(x - (a + b) / 2);
+    candidates[4][i] = static_cast<uint8_t>(x - paethPredictor(a, b, c));
+  }
+
+  size_t best = 0;
+  uint64_t bestCost = UINT64_MAX;
+  for (size_t f = 0; f < 5; ++f) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < stride; ++i) {
+      cost += static_cast<uint64_t>(
+          std::abs(static_cast<int>(static_cast<int8_t>(candidates[f][i]))));
+    }
+    if (cost < bestCost) {
+      bestCost = cost;
+      best = f;
+    }
+  }
+
+  out[0] = static_cast<uint8_t>(best);
+  std::memcpy(out + 1, candidates[best], stride);
+}
+
+void appendBigEndian(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+bool writePngChunk(FILE *fp, const char *type,
+                   const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> header;
+  appendBigEndian(header, static_cast<uint32_t>(data.size()));
+  header.insert(header.end(), type, type + 4);
+
+  uLong crc = crc32(0L, reinterpret_cast<const Bytef *>(type), 4);
+  if (!data.empty()) {
+    crc = crc32(crc, data.data(), static_cast<uInt>(data.size()));
+  }
+  std::vector<uint8_t> trailer;
+  appendBigEndian(trailer, static_cast<uint32_t>(crc));
+
+  return fwrite(header.data(), 1, header.size(), fp) == header.size() &&
+         fwrite(data.data(), 1, data.size(), fp) == data.size() &&
+         fwrite(trailer.data(), 1, trailer.size(), fp) == trailer.size();
+}
+
+} // namespace
+
+bool encodePng(const Image &image, const std::string &path,
+               unsigned threads) {
+  if (image.empty()) {
+    return false;
+  }
+
+  const size_t stride = static_cast<size_t>(image.width) * 3;
+  const size_t line = stride + 1;
+  const size_t rows = static_cast<size_t>(image.height);
+  const size_t parts =
+      std::clamp<size_t>(threads, 1, std::max<size_t>(1, rows / 64));
+
+  std::vector<size_t> firstRow(parts + 1);
+  for (size_t p = 0; p <= parts; ++p) {
+    firstRow[p] = rows * p / parts;
+  }
+
+  // Filters only look at the unfiltered row above, so parts are independent
+  std::vector<uint8_t> filtered(line * rows);
+  runParts(parts, [&](size_t p) {
+    std::vector<uint8_t> scratch(stride * 5);
+    std::vector<uint8_t> zeros(stride);
+    for (size_t r = firstRow[p]; r < firstRow[p + 1]; ++r) {
+      int y = static_cast<int>(r);
+      filterRow(image.row(y), r ? image.row(y - 1) : zeros.data(), stride,
+                filtered.data() + r * line, scratch);
+    }
+  });
+
+  // Raw deflate per part. All but the last end with a sync flush, which
+  // leaves them byte aligned and not final, so they concatenate into one
+  // valid stream; the zlib header and the combined Adler-32 go around it.
+  std::vector<std::vector<uint8_t>> idat(parts);
+  std::vector<uLong> adlers(parts);
+  std::vector<char> failed(parts, 0);
+  runParts(parts, [&](size_t p) {
+    const Bytef *in = filtered.data() + firstRow[p] * line;
+    size_t length = (firstRow[p + 1] - firstRow[p]) * line;
+    bool last = p + 1 == parts;
+
+    z_stream zs{};
+    if (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      failed[p] = 1;
+      return;
+    }
+    if (p > 0) {
+      size_t dictionary = std::min<size_t>(32768, firstRow[p] * line);
+      deflateSetDictionary(&zs, in - dictionary,
+                           static_cast<uInt>(dictionary));
+    }
+
+    auto &out = idat[p];
+    size_t prefix = p == 0 ? 2 : 0;
+    out.resize(prefix + deflateBound(&zs, static_cast<uLong>(length)) + 16);
+    if (p == 0) {
+      out[0] = 0x78;
+      out[1] = 0x9C;
+    }
+
+    zs.next_in = const_cast<Bytef *>(in);
+    zs.avail_in = static_cast<uInt>(length);
+    zs.next_out = out.data() + prefix;
+    zs.avail_out = static_cast<uInt>(out.size() - prefix);
+    int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last ? ret != Z_STREAM_END : ret != Z_OK) || zs.avail_in != 0) {
+      failed[p] = 1;
+    }
+    out.resize(prefix + zs.total_out);
+    deflateEnd(&zs);
+
+    adlers[p] = adler32(adler32(0L, Z_NULL, 0), in, static_cast<uInt>(length));
+  });
+
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+    LOG_ERROR("PNG compression failed");
+    return false;
+  }
+
+  uLong adler = adlers[0];
+  for (size_t p = 1; p < parts; ++p) {
+    adler = adler32_combine(
+        adler, adlers[p],
+        static_cast<z_off_t>((firstRow[p + 1] - firstRow[p]) * line));
+  }
+  appendBigEndian(idat.back(), static_cast<uint32_t>(adler));
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    LOG_ERROR("Cannot create " + path);
+    return false;
+  }
+
+  // 8-bit RGB, no interlacing
+  std::vector<uint8_t> header;
+  appendBigEndian(header, static_cast<uint32_t>(image.width));
+  appendBigEndian(header, static_cast<uint32_t>(image.height));
+  header.insert(header.end(), {8, 2, 0, 0, 0});
+
+  static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A,
+                                      '\n'};
+  bool written = fwrite(signature, 1, sizeof(signature), fp) ==
+                     sizeof(signature) &&
+                 writePngChunk(fp, "IHDR", header);
+  for (size_t p = 0; written && p < parts; ++p) {
+    written = writePngChunk(fp, "IDAT", idat[p]);
+  }
+  written = written && writePngChunk(fp, "IEND", {});
+
+  if (fclose(fp) != 0 || !written) {
+    LOG_ERROR("Failed to write " + path);
+    return false;
+  }
+  return true;
+}
+
+// WebP encoder
+#ifdef WART_HAVE_WEBP
+bool haveWebp() { return true; }
+
+bool encodeWebp(const Image &image, const std::string &path, int quality) {
+  WebPConfig config;
+  if (!WebPConfigInit(&config)) {
+    LOG_ERROR("libwebp version mismatch");
+    return false;
+  }
+  config.quality = static_cast<float>(quality);
+  config.method = 4;
+  config.thread_level = 1; // Lets libwebp split analysis and filtering
+
+  WebPPicture picture;
+  if (!WebPPictureInit(&picture)) {
+    LOG_ERROR("libwebp version mismatch");
+    return false;
+  }
+  picture.width = image.width;
+  picture.height = image.height;
+  if (!WebPPictureImportRGB(&picture, image.pixels.data(), image.width * 3)) {
+    LOG_ERROR("Out of memory for WebP picture");
+    return false;
+  }
+
+  WebPMemoryWriter writer;
+  WebPMemoryWriterInit(&writer);
+  picture.writer = WebPMemoryWrite;
+  picture.custom_ptr = &writer;
+
+  bool encoded = WebPEncode(&config, &picture) != 0;
+  if (!encoded) {
+    LOG_ERROR("WebP encoding failed with error " +
+              std::to_string(static_cast<int>(picture.error_code)));
+  }
+  WebPPictureFree(&picture);
+
+  bool written = false;
+  if (encoded) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+      LOG_ERROR("Cannot create " + path);
+    } else {
+      written = fwrite(writer.mem, 1, writer.size, fp) == writer.size;
+      written = fclose(fp) == 0 && written;
+    }
+  }
+  WebPMemoryWriterClear(&writer);
+  return written;
+}
+#else
+bool haveWebp() { return false; }
+
+bool encodeWebp(const Image &, const std::string &, int) {
+  LOG_ERROR("Built without WebP support");
+  return false;
+}
+#endif
+
+bool encodeImage(const Image &image, const std::string &path,
+                 const std::string &format, int quality) {
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  if (format == "jpg") {
+    return encodeJpeg(image, path, quality, threads);
+  }
+  if (format == "png") {
+    return encodePng(image, path, threads);
+  }
+  if (format == "webp") {
+    return encodeWebp(image, path, quality);
+  }
+  LOG_ERROR("Cannot encode " + format);
+  return false;
+}
+
+// Resampling
+namespace {
+
+// Filter taps along one axis: output i reads count[i] inputs starting at
+// start[i], weighted by weights[i * maxTaps + k]
+struct FilterTaps {
+  std::vector<int> start;
+  std::vector<int> count;
+  std::vector<float> weights;
+  int maxTaps = 0;
+};
+
+double lanczos3(double x) {
+  x = std::abs(x);
+  if (x < 1e-8) {
+    return 1.0;
+  }
+  if (x >= 3.0) {
+    return 0.0;
+  }
+  double px = M_PI * x;
+  return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+// Map dstLen outputs onto the source span [offset, offset + length) of an
+// axis that is limit pixels long. The filter widens when shrinking so that
+// every source pixel contributes.
+FilterTaps computeTaps(double offset, double length, int dstLen, int limit) {
+  FilterTaps taps;
+  double scale = length / dstLen;
+  double filterScale = std::max(1.0, scale);
+  double support = 3.0 * filterScale;
+
+  taps.maxTaps = static_cast<int>(std::ceil(support)) * 2 + 2;
+  taps.start.resize(static_cast<size_t>(dstLen));
+  taps.count.resize(static_cast<size_t>(dstLen));
+  taps.weights.assign(static_cast<size_t>(dstLen) *
+                          static_cast<size_t>(taps.maxTaps),
+                      0.0f);
+
+  for (int i = 0; i < dstLen; ++i) {
+    double center = offset + (i + 0.5) * scale;
+    int lo = std::max(0, static_cast<int>(std::floor(center - support)));
+    int hi = std::min(limit - 1, static_cast<int>(std::ceil(center + support)));
+    hi = std::min(hi, lo + taps.maxTaps - 1);
+
+    float *w = &taps.weights[static_cast<size_t>(i) *
+                             static_cast<size_t>(taps.maxTaps)];
+    double total = 0.0;
+    for (int j = lo; j <= hi; ++j) {
+      double weight = lanczos3((j + 0.5 - center) / filterScale);
+      w[j - lo] = static_cast<float>(weight);
+      total += weight;
+    }
+    if (total != 0.0) {
+      for (int j = 0; j <= hi - lo; ++j) {
+        w[j] = static_cast<float>(static_cast<double>(w[j]) / total);
+      }
+    }
+
+    taps.start[static_cast<size_t>(i)] = lo;
+    taps.count[static_cast<size_t>(i)] = hi - lo + 1;
+  }
+
+  return taps;
+}
+
+// acc[i] += weight * src[i], the inner loop of the vertical pass
+using AccumulateFn = void (*)(float *, const uint8_t *, size_t, float);
+
+void accumulateScalar(float *acc, const uint8_t *src, size_t n, float weight) {
+  for (size_t i = 0; i < n; ++i) {
+    acc[i] += weight * static_cast<float>(src[i]);
+  }
+}
+
+#ifdef WART_X86
+__attribute__((target("sse4.1"))) void
+accumulateSse41(float *acc, const uint8_t *src, size_t n, float weight) {
+  __m128 w = _mm_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32_t packed;
+    std::memcpy(&packed, src + i, sizeof(packed));
+    __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+    _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(v, w)));
+  }
+  accumulateScalar(acc + i, src + i, n - i, weight);
+}
+
+__attribute__((target("avx2,fma"))) void
+accumulateAvx2(float *acc, const uint8_t *src, size_t n, float weight) {
+  __m256 w = _mm256_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i bytes =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i));
+    __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(v, w, _mm256_loadu_ps(acc + i)));
+  }
+  accumulateScalar(acc + i, src + i, n - i, weight);
+}
+#endif
+
+AccumulateFn selectAccumulate() {
+#ifdef WART_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return accumulateAvx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return accumulateSse41;
+  }
+#endif
+  return accumulateScalar;
+}
+
+uint8_t clampToByte(float value) {
+  return static_cast<uint8_t>(std::clamp(value + 0.5f, 0.0f, 255.0f));
+}
+
+} // namespace
+
+Image resizeToFill(const Image &src, int width, int height) {
+  static const AccumulateFn accumulate = selectAccumulate();
+
+  Image dst;
+  if (src.empty() || width <= 0 || height <= 0) {
+    return dst;
+  }
+  dst.width = width;
+  dst.height = height;
+  dst.pixels.resize(static_cast<size_t>(width) * static_cast<size_t>(height) *
+                    3);
+
+  // Centre crop of the source with the target aspect ratio
+  double cropX = 0.0, cropY = 0.0;
+  double cropW = src.width, cropH = src.height;
+  if (static_cast<double>(src.width) * height >
+      static_cast<double>(src.height) * width) {
+    cropW = static_cast<double>(src.height) * width / height;
+    cropX = (src.width - cropW) / 2.0;
+  } else {
+    cropH = static_cast<double>(src.width) * height / width;
+    cropY = (src.height - cropH) / 2.0;
+  }
+
+  FilterTaps horizontal = computeTaps(cropX, cropW, width, src.width);
+  FilterTaps vertical = computeTaps(cropY, cropH, height, src.height);
+
+  // Only the source columns the horizontal taps touch are accumulated
+  int colLo = horizontal.start.front();
+  int colHi = horizontal.start.back() + horizontal.count.back();
+  size_t span = static_cast<size_t>(colHi - colLo) * 3;
+  std::vector<float> acc(span, 0.0f);
+
+  for (int y = 0; y < height; ++y) {
+    // Vertical pass: one contiguous row of floats, vectorized
+    std::fill(acc.begin(), acc.end(), 0.0f);
+    size_t vy = static_cast<size_t>(y);
+    const float *vw = &vertical.weights[vy * static_cast<size_t>(vertical.maxTaps)];
+    for (int k = 0; k < vertical.count[vy]; ++k) {
+      const uint8_t *srcRow = src.row(vertical.start[vy] + k) +
+                              static_cast<size_t>(colLo) * 3;
+      accumulate(acc.data(), srcRow, span, vw[k]);
+    }
+
+    // Horizontal pass over the accumulated row
+    uint8_t *out = dst.row(y);
+    for (int x = 0; x < width; ++x) {
+      size_t vx = static_cast<size_t>(x);
+      const float *hw =
+          &horizontal.weights[vx * static_cast<size_t>(horizontal.maxTaps)];
+      const float *in =
+          acc.data() + static_cast<size_t>(horizontal.start[vx] - colLo) * 3;
+      float r = 0.0f, g = 0.0f, b = 0.0f;
+      for (int k = 0; k < horizontal.count[vx]; ++k) {
+        r += hw[k] * in[k * 3];
+        g += hw[k] * in[k * 3 + 1];
+        b += hw[k] * in[k * 3 + 2];
+      }
+      out[x * 3] = clampToByte(r);
+      out[x * 3 + 1] = clampToByte(g);
+      out[x * 3 + 2] = clampToByte(b);
+    }
+  }
+
+  return dst;
+}
+
+} // namespace wart
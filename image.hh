@@ -0,0 +1,75 @@
+#pragma once
+
+// Standard Library
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace wart {
+
+// Decoded 8-bit RGB image, rows packed without padding
+struct Image {
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> pixels; // width * height * 3 bytes
+
+  bool empty() const { return width <= 0 || height <= 0; }
+  uint8_t *row(int y) { return pixels.data() + rowOffset(y); }
+  const uint8_t *row(int y) const { return pixels.data() + rowOffset(y); }
+
+private:
+  size_t rowOffset(int y) const {
+    return static_cast<size_t>(y) * static_cast<size_t>(width) * 3;
+  }
+};
+
+// Parse "1920x1080" into its dimensions
+bool parseResolution(const std::string &value, int &width, int &height);
+
+// Whether JPEG decode and encode, and WebP encode, are built in
+bool haveJpeg();
+bool haveWebp();
+
+// Format of an image file from its magic bytes: "jpg", "png", "webp", or
+// empty when it is none of those
+std::string sniffImageFormat(const std::string &path);
+
+// Dimensions from the image header alone: the JPEG SOF segment, the PNG
+// IHDR chunk or the WebP frame header. Nothing is decoded.
+bool probeImageSize(const std::string &path, int &width, int &height);
+
+// Decode a JPEG file. When minWidth and minHeight are given, libjpeg is
+// allowed to shrink the image by up to 8x during the IDCT as long as the
+// result stays at least that large, which is much cheaper than scaling a
+// full decode.
+bool decodeJpeg(const std::string &path, Image &image, int minWidth = 0,
+                int minHeight = 0);
+
+// Baseline JPEG with the rows split across threads: each strip is
+// transformed and quantized on its own with a restart marker after every
+// MCU row, their scans are joined into one, and a lossless pass over the
+// coefficients codes it with optimized Huffman tables as a single thread
+// would.
+bool encodeJpeg(const Image &image, const std::string &path, int quality,
+                unsigned threads);
+
+// PNG with the rows split across threads: each part is filtered and
+// deflated on its own, primed with the previous part's last 32 KiB so the
+// ratio barely suffers, and the pieces are joined into one zlib stream.
+bool encodePng(const Image &image, const std::string &path, unsigned threads);
+
+// Lossy WebP using libwebp's own worker threads. A VP8 frame cannot be
+// split into independently coded parts, so there is no striping here.
+bool encodeWebp(const Image &image, const std::string &path, int quality);
+
+// Encode to "jpg", "png" or "webp" using all cores where the codec can
+bool encodeImage(const Image &image, const std::string &path,
+                 const std::string &format, int quality);
+
+// Scale to exactly width x height with a Lanczos-3 filter, cropping the
+// centre of the source so that the aspect ratio is kept (fill). The
+// vertical pass uses AVX2 or SSE4.1 when the CPU has them.
+Image resizeToFill(const Image &src, int width, int height);
+
+} // namespace wart
@@ -0,0 +1,279 @@
+#include "log.hh"
+
+#include <cstring>
+#include <ctime>
+
+namespace wart {
+
+namespace {
+
+constexpr const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+constexpr const char *LEVEL_KEYS[] = {"debug", "info", "warning", "error"};
+
+// Append value as the body of a JSON string
+void appendJsonEscaped(std::string &out, const std::string &value) {
+  for (char c : value) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x",
+                 static_cast<unsigned>(c));
+        out += escaped;
+      } else {
+        out += c;
+      }
+    }
+  }
+}
+
+} // namespace
+
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+  for (size_t i = 0; i < std::size(LEVEL_KEYS); ++i) {
+    if (name == LEVEL_KEYS[i]) {
+      level = static_cast<LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+Logger &Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger() : slots(std::make_unique<std::array<Slot, CAPACITY>>()) {
+  for (size_t i = 0; i < CAPACITY; ++i) {
+    (*slots)[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+Logger::~Logger() { stop(); }
+
+void Logger::configure(LogOptions newOptions) {
+  // The writer owns the options while it runs, so it is stopped for the
+  // swap and started again here rather than by whoever logs next
+  std::lock_guard<std::mutex> lock(lifecycle);
+  bool wasStarted = started.load(std::memory_order_relaxed);
+  stopWriter();
+  options = std::move(newOptions);
+  minLevel.store(static_cast<int>(options.minLevel),
+                 std::memory_order_relaxed);
+  if (wasStarted) {
+    startWriter();
+  }
+}
+
+void Logger::log(LogLevel level, std::string message) {
+  if (!enabled(level)) {
+    return;
+  }
+  if (!started.load(std::memory_order_acquire)) {
+    // Never wait on a stop or reconfigure in progress: the line is queued
+    // and written once that restarts the writer
+    std::unique_lock<std::mutex> lock(lifecycle, std::try_to_lock);
+    if (lock.owns_lock()) {
+      startWriter();
+    }
+  }
+
+  Entry entry{level, std::chrono::system_clock::now(), std::move(message)};
+  if (!push(entry)) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  wakeups.fetch_add(1, std::memory_order_release);
+  wakeups.notify_one();
+}
+
+bool Logger::push(Entry &entry) {
+  size_t pos = enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot &slot = (*slots)[pos & (CAPACITY - 1)];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+        slot.entry = std::move(entry);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // Full
+    } else {
+      pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool Logger::pop(Entry &entry) {
+  Slot &slot = (*slots)[dequeuePos & (CAPACITY - 1)];
+  size_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence != dequeuePos + 1) {
+    return false; // Empty, or the producer is still copying
+  }
+  entry = std::move(slot.entry);
+  slot.sequence.store(dequeuePos + CAPACITY, std::memory_order_release);
+  ++dequeuePos;
+  return true;
+}
+
+void Logger::startWriter() {
+  if (started.load(std::memory_order_relaxed)) {
+    return;
+  }
+  stopping.store(false, std::memory_order_relaxed);
+  writer = std::thread(&Logger::run, this);
+  started.store(true, std::memory_order_release);
+}
+
+void Logger::stop() {
+  std::lock_guard<std::mutex> lock(lifecycle);
+  stopWriter();
+}
+
+void Logger::stopWriter() {
+  if (!started.load(std::memory_order_relaxed)) {
+    return;
+  }
+  stopping.store(true, std::memory_order_release);
+  wakeups.fetch_add(1, std::memory_order_release);
+  wakeups.notify_one();
+  writer.join();
+  started.store(false, std::memory_order_release);
+
+  if (file) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+void Logger::run() {
+  Entry entry;
+  for (;;) {
+    uint32_t seen = wakeups.load(std::memory_order_acquire);
+    bool wrote = false;
+    while (pop(entry)) {
+      write(entry);
+      wrote = true;
+    }
+
+    if (size_t lost = dropped.exchange(0, std::memory_order_relaxed)) {
+      write({LogLevel::WARNING, std::chrono::system_clock::now(),
+             std::to_string(lost) + " log messages dropped"});
+      wrote = true;
+    }
+
+    if (wrote) {
+      if (options.console) {
+        fflush(stdout);
+        fflush(stderr);
+      }
+      if (file) {
+        fflush(file);
+      }
+    } else if (stopping.load(std::memory_order_acquire)) {
+      return;
+    } else {
+      wakeups.wait(seen, std::memory_order_acquire);
+    }
+  }
+}
+
+void Logger::write(const Entry &entry) {
+  auto time = std::chrono::system_clock::to_time_t(entry.time);
+  std::tm local{};
+  localtime_r(&time, &local);
+  auto level = static_cast<size_t>(entry.level);
+
+  char stamp[40];
+  line.clear();
+  if (options.json) {
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      entry.time.time_since_epoch())
+                      .count() %
+                  1000;
+    size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &local);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03d",
+             static_cast<int>(millis));
+    n = strlen(stamp);
+    std::strftime(stamp + n, sizeof(stamp) - n, "%z", &local);
+
+    line += "{\"time\":\"";
+    line += stamp;
+    line += "\",\"level\":\"";
+    line += LEVEL_KEYS[level];
+    line += "\",\"message\":\"";
+    appendJsonEscaped(line, entry.message);
+    line += "\"}\n";
+  } else {
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    line += stamp;
+    line += " [";
+    line += LEVEL_NAMES[level];
+    line += "] ";
+    line += entry.message;
+    line += '\n';
+  }
+
+  if (options.console) {
+    fwrite(line.data(), 1, line.size(),
+           entry.level >= LogLevel::WARNING ? stderr : stdout);
+  }
+  if (!options.filePath.empty()) {
+    writeFile(line);
+  }
+}
+
+void Logger::writeFile(const std::string &text) {
+  if (file && options.maxBytes > 0 &&
+      fileBytes + text.size() > options.maxBytes) {
+    rotate();
+  }
+  if (!file) {
+    file = fopen(options.filePath.c_str(), "ae");
+    if (!file) {
+      return;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fileBytes = size > 0 ? static_cast<uintmax_t>(size) : 0;
+  }
+  if (fwrite(text.data(), 1, text.size(), file) == text.size()) {
+    fileBytes += text.size();
+  }
+}
+
+// Shift path.1 .. path.(keep - 1) up by one and start a fresh file
+void Logger::rotate() {
+  fclose(file);
+  file = nullptr;
+
+  const std::string &path = options.filePath;
+  if (options.keep <= 0) {
+    std::remove(path.c_str());
+    return;
+  }
+  for (int i = options.keep - 1; i >= 1; --i) {
+    std::rename((path + "." + std::to_string(i)).c_str(),
+                (path + "." + std::to_string(i + 1)).c_str());
+  }
+  std::rename(path.c_str(), (path + ".1").c_str());
+}
+
+} // namespace wart
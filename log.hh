@@ -0,0 +1,105 @@
+#pragma once
+
+// Standard Library
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace wart {
+
+// Logging levels
+enum class LogLevel { DEBUG, INFO, WARNING, ERROR };
+
+// Parse "debug", "info", "warning" or "error"
+bool parseLogLevel(const std::string &name, LogLevel &level);
+
+// Where and how log lines are written
+struct LogOptions {
+  LogLevel minLevel = LogLevel::INFO;
+  bool json = false;     // One JSON object per line instead of plain text
+  bool console = true;   // stdout, or stderr for warnings and errors
+  std::string filePath;  // Empty for no log file
+  uintmax_t maxBytes = 1 << 20; // Rotate the file beyond this size
+  int keep = 3;                 // Rotated files kept as path.1 .. path.keep
+};
+
+// Asynchronous logger. Callers only format their message and push it onto
+// a bounded lock-free queue; a background thread timestamps, formats and
+// writes the lines. When the queue is full messages are dropped and
+// counted rather than making the caller wait.
+class Logger {
+public:
+  static Logger &instance();
+
+  ~Logger();
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  // Takes effect for lines written from now on
+  void configure(LogOptions options);
+
+  bool enabled(LogLevel level) const {
+    return static_cast<int>(level) >= minLevel.load(std::memory_order_relaxed);
+  }
+
+  void log(LogLevel level, std::string message);
+
+  // Write out everything queued and stop the writer, e.g. before fork().
+  // The next log() starts it again; lines logged while a stop is under way
+  // stay queued without blocking their callers.
+  void stop();
+
+private:
+  Logger();
+
+  struct Entry {
+    LogLevel level = LogLevel::INFO;
+    std::chrono::system_clock::time_point time;
+    std::string message;
+  };
+
+  // Vyukov's bounded queue: a slot is free for the producer whose position
+  // matches its sequence, and readable once the sequence moves past it
+  struct Slot {
+    std::atomic<size_t> sequence{0};
+    Entry entry;
+  };
+
+  static constexpr size_t CAPACITY = 4096; // Power of two
+
+  bool push(Entry &entry);
+  bool pop(Entry &entry);
+  void startWriter(); // With lifecycle held
+  void stopWriter();  // With lifecycle held
+  void run();
+  void write(const Entry &entry);
+  void writeFile(const std::string &line);
+  void rotate();
+
+  std::unique_ptr<std::array<Slot, CAPACITY>> slots;
+  alignas(64) std::atomic<size_t> enqueuePos{0};
+  alignas(64) size_t dequeuePos = 0; // Writer thread only
+  alignas(64) std::atomic<uint32_t> wakeups{0};
+  std::atomic<size_t> dropped{0};
+  std::atomic<int> minLevel{static_cast<int>(LogLevel::INFO)};
+
+  std::mutex lifecycle; // Starting, stopping and configuring
+  std::atomic<bool> started{false};
+  std::atomic<bool> stopping{false};
+  std::thread writer;
+
+  // Writer thread state, swapped in under lifecycle
+  LogOptions options;
+  FILE *file = nullptr;
+  uintmax_t fileBytes = 0;
+  std::string line;
+};
+
+} // namespace wart
@@ -0,0 +1,4 @@
+#include "wart.hh"
+
+// Entry point outside namespace
+int main(int argc, char *argv[]) { return wart::main(argc, argv); }
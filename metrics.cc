@@ -0,0 +1,184 @@
+#include "metrics.hh"
+#include "wart.hh"
+
+#include <cstdio>
+
+namespace wart {
+
+namespace {
+
+struct Family {
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+constexpr Family FAMILIES[] = {
+    {"wart_http_requests_total", "counter",
+     "Transfers by kind (metadata, image) and result"},
+    {"wart_http_phase_seconds", "histogram",
+     "Time from the start of a transfer to the end of each phase: "
+     "namelookup, connect, appconnect (TLS), starttransfer, total"},
+    {"wart_http_response_bytes_total", "counter", "Body bytes received"},
+    {"wart_http_speed_bytes_per_second", "gauge",
+     "Average download speed of the last transfer"},
+    {"wart_provider_requests_total", "counter",
+     "Metadata requests by provider and result"},
+    {"wart_provider_seconds", "histogram",
+     "Time for a provider to answer a metadata request"},
+    {"wart_provider_hedges_total", "counter",
+     "Metadata requests also sent to the next provider because the "
+     "first was slower than its p95"},
+    {"wart_command_seconds", "histogram",
+     "Wall time of appliers, hooks and previewers"},
+    {"wart_command_failures_total", "counter",
+     "Appliers, hooks and previewers that failed or timed out"},
+    {"wart_fetch_cycles_total", "counter",
+     "Update cycles by result (updated, unchanged, cached, failed)"},
+    {"wart_last_update_timestamp_seconds", "gauge",
+     "Unix time a new wallpaper was last applied"},
+    {"wart_serve_requests_total", "counter",
+     "Requests answered by 'wart serve', by status code"},
+    {"wart_serve_response_bytes_total", "counter",
+     "Body bytes sent by 'wart serve'"},
+    {"wart_store_images", "gauge", "Images in the wallpaper store"},
+    {"wart_store_bytes", "gauge", "Size of the wallpaper store"},
+};
+
+// Upper bounds of the histogram buckets, in seconds
+constexpr double BOUNDS[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+                             1,     2.5,  5,     10,   30,  60};
+
+const Family *findFamily(const std::string &name) {
+  for (const auto &family : FAMILIES) {
+    if (name == family.name) {
+      return &family;
+    }
+  }
+  return nullptr;
+}
+
+bool isHistogram(const Family &family) {
+  return std::string_view(family.type) == "histogram";
+}
+
+std::string formatValue(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.15g", value);
+  return buffer;
+}
+
+// name{labels} value, with extra appended to the labels
+void appendSample(std::string &out, const std::string &name,
+                  const std::string &labels, const std::string &extra,
+                  const std::string &value) {
+  out += name;
+  if (!labels.empty() || !extra.empty()) {
+    out += '{';
+    out += labels;
+    if (!labels.empty() && !extra.empty()) {
+      out += ',';
+    }
+    out += extra;
+    out += '}';
+  }
+  out += ' ';
+  out += value;
+  out += '\n';
+}
+
+} // namespace
+
+Metrics &Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Series *Metrics::series(const std::string &name,
+                                 const std::string &labels) {
+  const Family *family = findFamily(name);
+  if (!family) {
+    return nullptr;
+  }
+  Series &found = families[name][labels];
+  if (isHistogram(*family) && found.buckets.empty()) {
+    found.buckets.resize(std::size(BOUNDS));
+  }
+  return &found;
+}
+
+void Metrics::add(const std::string &name, const std::string &labels,
+                  double value) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (Series *s = series(name, labels)) {
+    s->value += value;
+  }
+}
+
+void Metrics::set(const std::string &name, const std::string &labels,
+                  double value) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (Series *s = series(name, labels)) {
+    s->value = value;
+  }
+}
+
+void Metrics::observe(const std::string &name, const std::string &labels,
+                      double value) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Series *s = series(name, labels);
+  if (!s || s->buckets.empty()) {
+    return;
+  }
+  s->value += value;
+  ++s->count;
+  for (size_t i = 0; i < std::size(BOUNDS); ++i) {
+    if (value <= BOUNDS[i]) {
+      ++s->buckets[i];
+    }
+  }
+}
+
+std::string Metrics::render() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string out;
+  for (const auto &family : FAMILIES) {
+    auto found = families.find(family.name);
+    if (found == families.end()) {
+      continue;
+    }
+
+    out += "# HELP " + std::string(family.name) + " " + family.help + "\n";
+    out += "# TYPE " + std::string(family.name) + " " + family.type + "\n";
+    for (const auto &[labels, s] : found->second) {
+      if (!isHistogram(family)) {
+        appendSample(out, family.name, labels, "", formatValue(s.value));
+        continue;
+      }
+
+      std::string bucket = std::string(family.name) + "_bucket";
+      for (size_t i = 0; i < std::size(BOUNDS); ++i) {
+        appendSample(out, bucket, labels,
+                     "le=\"" + formatValue(BOUNDS[i]) + "\"",
+                     std::to_string(s.buckets[i]));
+      }
+      appendSample(out, bucket, labels, "le=\"+Inf\"",
+                   std::to_string(s.count));
+      appendSample(out, std::string(family.name) + "_sum", labels, "",
+                   formatValue(s.value));
+      appendSample(out, std::string(family.name) + "_count", labels, "",
+                   std::to_string(s.count));
+    }
+  }
+  return out;
+}
+
+bool Metrics::writeTextfile(const std::string &path) const {
+  if (!writeFileAtomic(path, render())) {
+    LOG_ERROR("Failed to write metrics to " + path);
+    return false;
+  }
+  return true;
+}
+
+} // namespace wart
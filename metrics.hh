@@ -0,0 +1,45 @@
+#pragma once
+
+// Standard Library
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace wart {
+
+// Counters, gauges and histograms kept by the daemon and rendered in the
+// Prometheus text format, for node_exporter's textfile collector or
+// `wart metrics`. Only the metric families listed in metrics.cc exist;
+// labels are passed preformatted, e.g. kind="image",phase="connect".
+class Metrics {
+public:
+  static Metrics &instance();
+
+  void add(const std::string &name, const std::string &labels,
+           double value = 1);
+  void set(const std::string &name, const std::string &labels, double value);
+  void observe(const std::string &name, const std::string &labels,
+               double value);
+
+  std::string render() const;
+
+  // Write render() to path through a temporary file and a rename, so the
+  // collector never reads half a file
+  bool writeTextfile(const std::string &path) const;
+
+private:
+  struct Series {
+    double value = 0; // Counter or gauge value, histogram sum
+    uint64_t count = 0;
+    std::vector<uint64_t> buckets; // Cumulative counts at each bound
+  };
+
+  Series *series(const std::string &name, const std::string &labels);
+
+  mutable std::mutex mutex;
+  std::map<std::string, std::map<std::string, Series>> families;
+};
+
+} // namespace wart
@@ -0,0 +1,210 @@
+#include "palette.hh"
+#include "wart.hh"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WART_X86 1
+#endif
+
+namespace wart {
+
+std::string Color::hex() const {
+  char buffer[8];
+  snprintf(buffer, sizeof(buffer), "#%02x%02x%02x", r, g, b);
+  return buffer;
+}
+
+namespace {
+
+// Pixels as separate channel arrays so eight can be loaded at once
+struct Samples {
+  std::vector<float> r, g, b;
+
+  size_t size() const { return r.size(); }
+};
+
+// Up to about maxSamples pixels on a regular grid
+Samples sampleImage(const Image &image, size_t maxSamples) {
+  size_t total =
+      static_cast<size_t>(image.width) * static_cast<size_t>(image.height);
+  int step = 1;
+  while (total / static_cast<size_t>(step * step) > maxSamples) {
+    ++step;
+  }
+
+  Samples samples;
+  for (int y = step / 2; y < image.height; y += step) {
+    const uint8_t *row = image.row(y);
+    for (int x = step / 2; x < image.width; x += step) {
+      samples.r.push_back(row[x * 3]);
+      samples.g.push_back(row[x * 3 + 1]);
+      samples.b.push_back(row[x * 3 + 2]);
+    }
+  }
+  return samples;
+}
+
+// Centroids laid out like the samples
+struct Centroids {
+  std::vector<float> r, g, b;
+};
+
+// Label every sample with its nearest centroid
+using AssignFn = void (*)(const Samples &, const Centroids &, size_t, size_t,
+                          uint8_t *);
+
+void assignScalar(const Samples &samples, const Centroids &centroids,
+                  size_t begin, size_t end, uint8_t *labels) {
+  size_t k = centroids.r.size();
+  for (size_t i = begin; i < end; ++i) {
+    float best = FLT_MAX;
+    size_t bestIndex = 0;
+    for (size_t c = 0; c < k; ++c) {
+      float dr = samples.r[i] - centroids.r[c];
+      float dg = samples.g[i] - centroids.g[c];
+      float db = samples.b[i] - centroids.b[c];
+      float distance = dr * dr + dg * dg + db * db;
+      if (distance < best) {
+        best = distance;
+        bestIndex = c;
+      }
+    }
+    labels[i] = static_cast<uint8_t>(bestIndex);
+  }
+}
+
+#ifdef WART_X86
+__attribute__((target("avx2,fma"))) void
+assignAvx2(const Samples &samples, const Centroids &centroids, size_t begin,
+           size_t end, uint8_t *labels) {
+  size_t k = centroids.r.size();
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 r = _mm256_loadu_ps(samples.r.data() + i);
+    __m256 g = _mm256_loadu_ps(samples.g.data() + i);
+    __m256 b = _mm256_loadu_ps(samples.b.data() + i);
+    __m256 best = _mm256_set1_ps(FLT_MAX);
+    __m256 bestIndex = _mm256_setzero_ps();
+
+    for (size_t c = 0; c < k; ++c) {
+      __m256 dr = _mm256_sub_ps(r, _mm256_set1_ps(centroids.r[c]));
+      __m256 dg = _mm256_sub_ps(g, _mm256_set1_ps(centroids.g[c]));
+      __m256 db = _mm256_sub_ps(b, _mm256_set1_ps(centroids.b[c]));
+      __m256 distance = _mm256_fmadd_ps(
+          dr, dr, _mm256_fmadd_ps(dg, dg, _mm256_mul_ps(db, db)));
+      // Strictly closer, so ties keep the lower index like the scalar path
+      __m256 closer = _mm256_cmp_ps(distance, best, _CMP_LT_OQ);
+      best = _mm256_min_ps(distance, best);
+      bestIndex = _mm256_blendv_ps(
+          bestIndex, _mm256_set1_ps(static_cast<float>(c)), closer);
+    }
+
+    alignas(32) int32_t indices[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices),
+                       _mm256_cvtps_epi32(bestIndex));
+    for (size_t j = 0; j < 8; ++j) {
+      labels[i + j] = static_cast<uint8_t>(indices[j]);
+    }
+  }
+  assignScalar(samples, centroids, i, end, labels);
+}
+#endif
+
+AssignFn selectAssign() {
+#ifdef WART_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return assignAvx2;
+  }
+#endif
+  return assignScalar;
+}
+
+float luminance(float r, float g, float b) {
+  return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+} // namespace
+
+std::vector<Color> extractPalette(const Image &image, size_t count) {
+  static const AssignFn assign = selectAssign();
+
+  count = std::clamp<size_t>(count, 1, 256); // Labels are bytes
+  Samples samples = sampleImage(image, 16384);
+  size_t n = samples.size();
+  if (n == 0) {
+    return {};
+  }
+
+  // Deterministic start: samples at evenly spaced brightness quantiles
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return luminance(samples.r[a], samples.g[a], samples.b[a]) <
+           luminance(samples.r[b], samples.g[b], samples.b[b]);
+  });
+
+  Centroids centroids;
+  for (size_t c = 0; c < count; ++c) {
+    size_t index = order[(2 * c + 1) * n / (2 * count)];
+    centroids.r.push_back(samples.r[index]);
+    centroids.g.push_back(samples.g[index]);
+    centroids.b.push_back(samples.b[index]);
+  }
+
+  std::vector<uint8_t> labels(n, 0), previous;
+  std::vector<double> sumR(count), sumG(count), sumB(count);
+  std::vector<size_t> members(count);
+
+  for (int iteration = 0; iteration < 16; ++iteration) {
+    assign(samples, centroids, 0, n, labels.data());
+    if (labels == previous) {
+      break;
+    }
+
+    std::fill(sumR.begin(), sumR.end(), 0.0);
+    std::fill(sumG.begin(), sumG.end(), 0.0);
+    std::fill(sumB.begin(), sumB.end(), 0.0);
+    std::fill(members.begin(), members.end(), 0);
+    for (size_t i = 0; i < n; ++i) {
+      sumR[labels[i]] += static_cast<double>(samples.r[i]);
+      sumG[labels[i]] += static_cast<double>(samples.g[i]);
+      sumB[labels[i]] += static_cast<double>(samples.b[i]);
+      ++members[labels[i]];
+    }
+
+    // A cluster that lost all its members keeps its old centre
+    for (size_t c = 0; c < count; ++c) {
+      if (members[c] > 0) {
+        double size = static_cast<double>(members[c]);
+        centroids.r[c] = static_cast<float>(sumR[c] / size);
+        centroids.g[c] = static_cast<float>(sumG[c] / size);
+        centroids.b[c] = static_cast<float>(sumB[c] / size);
+      }
+    }
+    previous.swap(labels);
+    labels.resize(n);
+  }
+
+  std::vector<Color> colors;
+  for (size_t c = 0; c < count; ++c) {
+    auto channel = [](float value) {
+      return static_cast<uint8_t>(std::clamp(std::lround(value), 0L, 255L));
+    };
+    colors.push_back(
+        {channel(centroids.r[c]), channel(centroids.g[c]),
+         channel(centroids.b[c])});
+  }
+  std::sort(colors.begin(), colors.end(), [](const Color &a, const Color &b) {
+    return luminance(a.r, a.g, a.b) < luminance(b.r, b.g, b.b);
+  });
+  return colors;
+}
+
+} // namespace wart
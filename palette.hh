@@ -0,0 +1,26 @@
+#pragma once
+
+#include "image.hh"
+
+// Standard Library
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace wart {
+
+struct Color {
+  uint8_t r = 0;
+  uint8_t g = 0;
+  uint8_t b = 0;
+
+  std::string hex() const; // "#rrggbb"
+};
+
+// Dominant colours of an image by k-means over a subsample of its pixels,
+// sorted from dark to light. The nearest-centroid search, which is nearly
+// all of the work, uses AVX2 when the CPU has it. Always returns count
+// colours for a non-empty image, repeating some if it has fewer.
+std::vector<Color> extractPalette(const Image &image, size_t count = 16);
+
+} // namespace wart
@@ -0,0 +1,101 @@
+#include "provider.hh"
+#include "wart.hh"
+
+namespace wart {
+
+namespace {
+
+// Hedging bounds: never pile on a healthy provider within a few round
+// trips, never wait longer than this for a stalled one
+constexpr std::chrono::milliseconds MIN_HEDGE(100);
+constexpr std::chrono::milliseconds MAX_HEDGE(10000);
+constexpr std::chrono::milliseconds INITIAL_HEDGE(1500);
+
+} // namespace
+
+void LatencyStats::record(std::chrono::milliseconds elapsed, bool success) {
+  if (!success) {
+    ++failed;
+    ++streak;
+    return;
+  }
+  ++ok;
+  streak = 0;
+  samples[next] = static_cast<uint32_t>(
+      std::clamp<int64_t>(elapsed.count(), 0, UINT32_MAX));
+  next = (next + 1) % WINDOW;
+  filled = std::min(filled + 1, WINDOW);
+}
+
+std::optional<std::chrono::milliseconds>
+LatencyStats::percentile(double fraction) const {
+  if (filled < MIN_SAMPLES) {
+    return std::nullopt;
+  }
+  std::array<uint32_t, WINDOW> sorted = samples;
+  auto end = sorted.begin() + static_cast<std::ptrdiff_t>(filled);
+  auto rank = static_cast<std::ptrdiff_t>(
+      std::min<double>(fraction * static_cast<double>(filled),
+                       static_cast<double>(filled - 1)));
+  std::nth_element(sorted.begin(), sorted.begin() + rank, end);
+  return std::chrono::milliseconds(sorted[static_cast<size_t>(rank)]);
+}
+
+BiturlProvider::BiturlProvider(std::string baseUrl)
+    : Provider(baseUrl), base(std::move(baseUrl)) {
+  if (!base.empty() && base.back() != '/') {
+    base += '/';
+  }
+}
+
+std::string BiturlProvider::metadataUrl(const std::string &resolution,
+                                        int index,
+                                        const std::string &market) const {
+  return base + "?resolution=" + resolution +
+         "&format=json&index=" + std::to_string(index) + "&mkt=" + market;
+}
+
+bool BiturlProvider::parseMetadata(std::string_view body,
+                                   WallpaperMetadata &metadata,
+                                   std::string &error) const {
+  return wart::parseMetadata(body, metadata, error);
+}
+
+void ProviderSet::configure(const Config &config) {
+  std::vector<std::unique_ptr<Provider>> configured;
+  std::istringstream list(config.mirrors);
+  std::string url;
+  while (std::getline(list, url, ',')) {
+    if (url.empty()) {
+      continue;
+    }
+    auto kept = std::find_if(providers.begin(), providers.end(),
+                             [&](const std::unique_ptr<Provider> &provider) {
+                               return provider && provider->name() == url;
+                             });
+    if (kept != providers.end()) {
+      configured.push_back(std::move(*kept));
+    } else {
+      configured.push_back(std::make_unique<BiturlProvider>(url));
+    }
+  }
+  providers = std::move(configured);
+}
+
+std::vector<Provider *> ProviderSet::ranked() const {
+  std::vector<Provider *> order;
+  for (const auto &provider : providers) {
+    order.push_back(provider.get());
+  }
+  std::stable_partition(order.begin(), order.end(), [](const Provider *p) {
+    return p->stats().failingStreak() == 0;
+  });
+  return order;
+}
+
+std::chrono::milliseconds ProviderSet::hedgeDelay(const Provider &provider) {
+  auto p95 = provider.stats().percentile(0.95);
+  return std::clamp(p95.value_or(INITIAL_HEDGE), MIN_HEDGE, MAX_HEDGE);
+}
+
+} // namespace wart
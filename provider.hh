@@ -0,0 +1,105 @@
+#pragma once
+
+// Standard Library
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace wart {
+
+struct Config;
+struct WallpaperMetadata;
+
+// Response times of the recent successful requests to one provider, and
+// how many failed
+class LatencyStats {
+public:
+  void record(std::chrono::milliseconds elapsed, bool ok);
+
+  // Time within which that fraction of the recent requests finished,
+  // nothing until there are enough of them to tell
+  std::optional<std::chrono::milliseconds> percentile(double fraction) const;
+
+  uint64_t successes() const { return ok; }
+  uint64_t failures() const { return failed; }
+  int failingStreak() const { return streak; }
+
+private:
+  static constexpr size_t WINDOW = 64;
+  static constexpr size_t MIN_SAMPLES = 8;
+
+  std::array<uint32_t, WINDOW> samples{}; // Milliseconds, a ring
+  size_t next = 0;
+  size_t filled = 0;
+  uint64_t ok = 0;
+  uint64_t failed = 0;
+  int streak = 0; // Failures since the last success
+};
+
+// A source of wallpaper metadata. Providers only differ in where they are
+// asked and how their answer reads; transfers are left to the caller.
+class Provider {
+public:
+  explicit Provider(std::string providerName) : id(std::move(providerName)) {}
+  virtual ~Provider() = default;
+
+  const std::string &name() const { return id; }
+
+  // Request for the image index days back in market, at resolution
+  virtual std::string metadataUrl(const std::string &resolution, int index,
+                                  const std::string &market) const = 0;
+  virtual bool parseMetadata(std::string_view body, WallpaperMetadata &metadata,
+                             std::string &error) const = 0;
+
+  LatencyStats &stats() { return latency; }
+  const LatencyStats &stats() const { return latency; }
+
+private:
+  std::string id;
+  LatencyStats latency;
+};
+
+// The bing.biturl.top JSON API, or any mirror or local stand-in serving
+// the same at another base URL
+class BiturlProvider : public Provider {
+public:
+  explicit BiturlProvider(std::string baseUrl);
+
+  std::string metadataUrl(const std::string &resolution, int index,
+                          const std::string &market) const override;
+  bool parseMetadata(std::string_view body, WallpaperMetadata &metadata,
+                     std::string &error) const override;
+
+private:
+  std::string base;
+};
+
+// The configured providers, from the comma separated 'mirrors' key. The
+// first one that is not failing is asked first; slow answers are hedged
+// by asking the next one as well.
+class ProviderSet {
+public:
+  // Rebuild from config, keeping the stats of mirrors still listed
+  void configure(const Config &config);
+
+  // In order of preference: as configured, failing ones last
+  std::vector<Provider *> ranked() const;
+
+  // How long to wait for provider before hedging: its p95, or a guess
+  // until it has a history
+  static std::chrono::milliseconds hedgeDelay(const Provider &provider);
+
+  const std::vector<std::unique_ptr<Provider>> &all() const {
+    return providers;
+  }
+
+private:
+  std::vector<std::unique_ptr<Provider>> providers;
+};
+
+} // namespace wart
@@ -0,0 +1,66 @@
+#include "retry.hh"
+#include "wart.hh"
+
+namespace wart {
+
+Backoff::Backoff(std::chrono::milliseconds baseDelay,
+                 std::chrono::milliseconds maxDelay)
+    : base(baseDelay), cap(maxDelay), rng(std::random_device{}()) {}
+
+std::chrono::milliseconds Backoff::next() {
+  // Stop doubling before it overflows, the cap has long been reached
+  auto window = base * (int64_t{1} << std::min(attempt, 30));
+  window = std::min(window, cap);
+  if (attempt < 30) {
+    ++attempt;
+  }
+
+  std::uniform_int_distribution<int64_t> jitter(0, window.count());
+  return std::chrono::milliseconds(jitter(rng));
+}
+
+bool CircuitBreaker::allow(Clock::time_point now) {
+  if (current == State::Open && now >= openUntil) {
+    current = State::HalfOpen;
+  }
+  return current != State::Open;
+}
+
+void CircuitBreaker::success() {
+  current = State::Closed;
+  failures = 0;
+}
+
+void CircuitBreaker::failure(std::chrono::seconds retryAfter,
+                             Clock::time_point now) {
+  ++failures;
+  if (current == State::HalfOpen || failures >= threshold) {
+    current = State::Open;
+    openUntil = now + std::max(cooldown, retryAfter);
+  } else if (retryAfter.count() > 0) {
+    // Asked to come back later, which is no reason to give up for longer
+    current = State::Open;
+    openUntil = now + retryAfter;
+  }
+}
+
+std::chrono::seconds hostPhase(std::chrono::seconds period) {
+  if (period.count() <= 0) {
+    return std::chrono::seconds(0);
+  }
+
+  std::string id;
+  std::ifstream machineId("/etc/machine-id");
+  if (!(machineId >> id)) {
+    char name[256] = {};
+    gethostname(name, sizeof(name) - 1);
+    id = name;
+  }
+
+  ContentHash hash;
+  hash.update(id.data(), id.size());
+  return std::chrono::seconds(
+      static_cast<int64_t>(hash.value() % static_cast<uint64_t>(period.count())));
+}
+
+} // namespace wart
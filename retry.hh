@@ -0,0 +1,72 @@
+#pragma once
+
+// Standard Library
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+namespace wart {
+
+// Exponential backoff with full jitter: the nth retry waits a uniformly
+// random time between zero and min(cap, base * 2^n), so clients that
+// failed together do not come back together.
+class Backoff {
+public:
+  Backoff(std::chrono::milliseconds base, std::chrono::milliseconds cap);
+
+  // Delay before the next retry, growing the window for the one after
+  std::chrono::milliseconds next();
+  void reset() { attempt = 0; }
+
+private:
+  std::chrono::milliseconds base;
+  std::chrono::milliseconds cap;
+  int attempt = 0;
+  std::mt19937_64 rng;
+};
+
+// Stops calling a failing upstream. After threshold consecutive failures
+// the circuit opens and allow() refuses for the cooldown; then a single
+// probe is let through, which closes it again or reopens it.
+class CircuitBreaker {
+public:
+  using Clock = std::chrono::steady_clock;
+  enum class State { Closed, Open, HalfOpen };
+
+  CircuitBreaker(int failureThreshold, std::chrono::seconds openFor)
+      : threshold(failureThreshold), cooldown(openFor) {}
+
+  // Whether a request may go out now. Moves an open circuit to half-open
+  // once its cooldown is over.
+  bool allow(Clock::time_point now = Clock::now());
+
+  void success();
+
+  // A Retry-After from the upstream opens the circuit for at least as
+  // long as it asked for, even below the threshold
+  void failure(std::chrono::seconds retryAfter = {},
+               Clock::time_point now = Clock::now());
+
+  // Runtime tuning, takes effect from the next failure
+  void configure(int failureThreshold, std::chrono::seconds openFor) {
+    threshold = failureThreshold;
+    cooldown = openFor;
+  }
+
+  State state() const { return current; }
+  Clock::time_point reopensAt() const { return openUntil; }
+
+private:
+  int threshold;
+  std::chrono::seconds cooldown;
+  State current = State::Closed;
+  int failures = 0;
+  Clock::time_point openUntil;
+};
+
+// Fixed offset in [0, period) for this machine, derived from
+// /etc/machine-id or the host name, so that a fleet spreads its requests
+// over the period instead of sending them all at the same moment
+std::chrono::seconds hostPhase(std::chrono::seconds period);
+
+} // namespace wart
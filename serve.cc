@@ -0,0 +1,671 @@
+#include "serve.hh"
+#include "metrics.hh"
+#include "wart.hh"
+
+#include <cctype>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace wart {
+
+namespace {
+
+// Requests are a line and a few headers; anything bigger is not for us
+constexpr size_t MAX_REQUEST = 16 * 1024;
+constexpr size_t MAX_CONNECTIONS = 256;
+
+const char *reasonPhrase(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 206:
+    return "Partial Content";
+  case 304:
+    return "Not Modified";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 416:
+    return "Range Not Satisfiable";
+  case 431:
+    return "Request Header Fields Too Large";
+  case 502:
+    return "Bad Gateway";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+HttpResponse errorResponse(int status) {
+  HttpResponse response;
+  response.status = status;
+  response.contentType = "text/plain";
+  response.body = std::string(reasonPhrase(status)) + "\n";
+  return response;
+}
+
+std::string toLower(std::string text) {
+  std::transform(text.begin(), text.end(), text.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return text;
+}
+
+std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t' ||
+                           text.back() == '\r')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+// %XX escapes, and '+' for a space in form encoded queries
+std::string percentDecode(std::string_view text, bool form = false) {
+  std::string out;
+  out.reserve(text.size());
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (form && text[i] == '+') {
+      out += ' ';
+    } else if (text[i] == '%' && i + 2 < text.size() &&
+               std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+               std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+      out += static_cast<char>(
+          std::stoi(std::string(text.substr(i + 1, 2)), nullptr, 16));
+      i += 2;
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+// Request line and headers, up to but without the blank line
+bool parseRequest(std::string_view head, HttpRequest &request,
+                  std::string &version) {
+  size_t eol = head.find("\r\n");
+  std::string_view line = head.substr(0, eol);
+  size_t first = line.find(' ');
+  size_t last = line.rfind(' ');
+  if (first == std::string_view::npos || last == first) {
+    return false;
+  }
+  request.method = std::string(line.substr(0, first));
+  std::string_view target = line.substr(first + 1, last - first - 1);
+  version = std::string(line.substr(last + 1));
+  if (target.empty() || target[0] != '/' || version.rfind("HTTP/1.", 0) != 0) {
+    return false;
+  }
+  size_t question = target.find('?');
+  request.path = percentDecode(target.substr(0, question));
+  if (question != std::string_view::npos) {
+    request.query = std::string(target.substr(question + 1));
+  }
+
+  while (eol != std::string_view::npos) {
+    head.remove_prefix(eol + 2);
+    eol = head.find("\r\n");
+    std::string_view header = head.substr(0, eol);
+    size_t colon = header.find(':');
+    if (colon == std::string_view::npos || colon == 0) {
+      return false;
+    }
+    request.headers[toLower(std::string(header.substr(0, colon)))] =
+        std::string(trim(header.substr(colon + 1)));
+  }
+  return true;
+}
+
+// Whether an If-None-Match list names etag. Weak comparison, as RFC 9110
+// asks for this header.
+bool etagMatches(std::string_view list, const std::string &etag) {
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    std::string_view candidate = trim(list.substr(0, comma));
+    if (candidate.rfind("W/", 0) == 0) {
+      candidate.remove_prefix(2);
+    }
+    if (candidate == "*" || candidate == etag) {
+      return true;
+    }
+    if (comma == std::string_view::npos) {
+      break;
+    }
+    list.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+enum class RangeResult { Whole, Partial, Unsatisfiable };
+
+// A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+// Multiple ranges and other units are answered with the whole file.
+RangeResult parseRange(std::string_view value, off_t size, off_t &first,
+                       off_t &last) {
+  value = trim(value);
+  if (value.rfind("bytes=", 0) != 0 ||
+      value.find(',') != std::string_view::npos) {
+    return RangeResult::Whole;
+  }
+  value.remove_prefix(6);
+  size_t dash = value.find('-');
+  if (dash == std::string_view::npos) {
+    return RangeResult::Whole;
+  }
+
+  auto number = [](std::string_view text, off_t &out) {
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+    return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+  };
+  std::string_view from = trim(value.substr(0, dash));
+  std::string_view to = trim(value.substr(dash + 1));
+  off_t a = 0;
+  off_t b = 0;
+  if (from.empty()) {
+    if (!number(to, b)) {
+      return RangeResult::Whole;
+    }
+    if (b == 0 || size == 0) {
+      return RangeResult::Unsatisfiable;
+    }
+    first = size - std::min(b, size);
+    last = size - 1;
+    return RangeResult::Partial;
+  }
+  if (!number(from, a) || (!to.empty() && (!number(to, b) || b < a))) {
+    return RangeResult::Whole;
+  }
+  if (a >= size) {
+    return RangeResult::Unsatisfiable;
+  }
+  first = a;
+  last = to.empty() ? size - 1 : std::min(b, size - 1);
+  return RangeResult::Partial;
+}
+
+std::string httpDate() {
+  char buffer[64];
+  time_t now = time(nullptr);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buffer;
+}
+
+} // namespace
+
+std::string HttpRequest::header(const std::string &name) const {
+  auto it = headers.find(name);
+  return it == headers.end() ? "" : it->second;
+}
+
+std::string HttpRequest::param(const std::string &name,
+                               const std::string &fallback) const {
+  std::string_view rest = query;
+  while (!rest.empty()) {
+    size_t amp = rest.find('&');
+    std::string_view pair = rest.substr(0, amp);
+    size_t eq = pair.find('=');
+    if (percentDecode(pair.substr(0, eq), true) == name) {
+      return eq == std::string_view::npos
+                 ? ""
+                 : percentDecode(pair.substr(eq + 1), true);
+    }
+    if (amp == std::string_view::npos) {
+      break;
+    }
+    rest.remove_prefix(amp + 1);
+  }
+  return fallback;
+}
+
+bool parseListenAddress(const std::string &address, std::string &host,
+                        std::string &port) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    host.clear();
+    port = address;
+  } else {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+  }
+  int number = 0;
+  auto [end, ec] = std::from_chars(port.data(), port.data() + port.size(), number);
+  return ec == std::errc() && end == port.data() + port.size() &&
+         number > 0 && number < 65536;
+}
+
+// One client connection: the request bytes read so far, then the response
+// still to be sent
+struct HttpServer::Connection {
+  int fd = -1;
+  std::string input;
+  std::string output;
+  size_t sent = 0;
+  int file = -1;
+  off_t fileOffset = 0;
+  off_t fileEnd = 0;
+  bool close = false;   // After this response
+  bool eof = false;     // Client half-closed, serve what it sent and close
+  bool waiting = false; // For the handler's reply, unwatched meanwhile
+  bool handling = false; // Inside the handler, a reply needs no resume
+  uint64_t request = 0; // Id of the request being answered
+  bool writing = false; // Parked until the socket is writable
+  std::chrono::steady_clock::time_point lastActive;
+
+  ~Connection() {
+    if (file >= 0)
+      ::close(file);
+  }
+};
+
+HttpServer::HttpServer(EventLoop &eventLoop, Handler onRequest)
+    : loop(eventLoop), handler(std::move(onRequest)) {}
+
+HttpServer::~HttpServer() {
+  while (!clients.empty()) {
+    closeConnection(clients.begin()->first);
+  }
+  if (listenFd >= 0) {
+    loop.unwatch(listenFd);
+    close(listenFd);
+  }
+}
+
+bool HttpServer::listen(const std::string &address) {
+  std::string host;
+  std::string port;
+  if (!parseListenAddress(address, host, port)) {
+    LOG_ERROR("Invalid listen address: " + address);
+    return false;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *found = nullptr;
+  int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                       &hints, &found);
+  if (rc != 0) {
+    LOG_ERROR("Cannot resolve " + address + ": " + gai_strerror(rc));
+    return false;
+  }
+
+  for (addrinfo *ai = found; ai && listenFd < 0; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        ::listen(fd, SOMAXCONN) == 0) {
+      listenFd = fd;
+    } else {
+      close(fd);
+    }
+  }
+  freeaddrinfo(found);
+
+  if (listenFd < 0) {
+    LOG_ERROR("Cannot listen on " + address + ": " + strerror(errno));
+    return false;
+  }
+  loop.watch(listenFd, [this] { onAccept(); });
+  return true;
+}
+
+void HttpServer::onAccept() {
+  while (true) {
+    int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return; // EAGAIN, or out of descriptors until some close
+    }
+    if (clients.size() >= MAX_CONNECTIONS) {
+      close(fd);
+      continue;
+    }
+
+    // Responses go out in one write and one sendfile; do not let the
+    // last segment of a small one wait for the previous ACK
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto connection = std::make_unique<Connection>();
+    connection->fd = fd;
+    connection->lastActive = std::chrono::steady_clock::now();
+    clients[fd] = std::move(connection);
+    loop.watch(fd, [this, fd] { onReadable(fd); });
+  }
+}
+
+void HttpServer::onReadable(int fd) {
+  auto it = clients.find(fd);
+  if (it == clients.end()) {
+    return;
+  }
+  Connection &connection = *it->second;
+  connection.lastActive = std::chrono::steady_clock::now();
+
+  if (connection.writing) {
+    if (!flush(connection)) {
+      return;
+    }
+  } else {
+    char buffer[4096];
+    while (connection.input.size() <= MAX_REQUEST) {
+      ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n > 0) {
+        connection.input.append(buffer, static_cast<size_t>(n));
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (n == 0 && !connection.input.empty()) {
+        // Requests sent before a half-close still get their answers
+        connection.eof = true;
+        break;
+      }
+      closeConnection(fd); // Closed by the client, or reset
+      return;
+    }
+  }
+
+  serve(connection);
+}
+
+// Serve every complete request, pipelined ones included, until one has to
+// wait for the socket or for its handler
+void HttpServer::serve(Connection &connection) {
+  int fd = connection.fd;
+  while (!connection.writing && !connection.waiting) {
+    size_t end = connection.input.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      if (connection.eof) {
+        closeConnection(fd); // Nothing more will complete
+        return;
+      }
+      if (connection.input.size() > MAX_REQUEST) {
+        connection.input.clear();
+        connection.close = true;
+        respond(connection, "");
+        flush(connection);
+      }
+      return;
+    }
+    std::string head = connection.input.substr(0, end);
+    connection.input.erase(0, end + 4);
+    respond(connection, head);
+    if (connection.waiting || !flush(connection)) {
+      return;
+    }
+  }
+}
+
+void HttpServer::respond(Connection &connection, const std::string &head) {
+  HttpRequest request;
+  std::string version;
+  if (head.empty()) {
+    answer(connection, request, errorResponse(431));
+    return;
+  }
+  if (!parseRequest(head, request, version)) {
+    connection.close = true;
+    answer(connection, request, errorResponse(400));
+    return;
+  }
+  std::string keepAlive = toLower(request.header("connection"));
+  connection.close = version == "HTTP/1.0" ? keepAlive != "keep-alive"
+                                           : keepAlive == "close";
+  if (request.method != "GET" && request.method != "HEAD") {
+    HttpResponse response = errorResponse(405);
+    response.headers.emplace_back("Allow", "GET, HEAD");
+    answer(connection, request, std::move(response));
+    return;
+  }
+
+  int fd = connection.fd;
+  uint64_t id = ++requests;
+  connection.request = id;
+  connection.waiting = true;
+  connection.handling = true;
+  handler(request, [this, fd, id, request](HttpResponse response) {
+    auto it = clients.find(fd);
+    if (it == clients.end() || it->second->request != id ||
+        !it->second->waiting) {
+      return;
+    }
+    Connection &parked = *it->second;
+    parked.waiting = false;
+    answer(parked, request, std::move(response));
+    if (!parked.handling) {
+      // Answered later: listen again and carry on where serve() stopped
+      parked.lastActive = std::chrono::steady_clock::now();
+      loop.watch(fd, [this, fd] { onReadable(fd); });
+      if (flush(parked)) {
+        serve(parked);
+      }
+    }
+  });
+  connection.handling = false;
+
+  // Nothing is read until the reply comes, which also keeps a half-closed
+  // socket from waking the loop over and over
+  if (connection.waiting) {
+    loop.unwatch(fd);
+  }
+}
+
+void HttpServer::answer(Connection &connection, const HttpRequest &request,
+                        HttpResponse response) {
+  // Files are opened now, so that one evicted meanwhile is a 404 and not
+  // a connection cut short
+  int file = -1;
+  off_t size = static_cast<off_t>(response.body.size());
+  if (!response.file.empty()) {
+    struct stat st;
+    file = open(response.file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0 || fstat(file, &st) != 0) {
+      if (file >= 0)
+        close(file);
+      file = -1;
+      response = errorResponse(404);
+      size = static_cast<off_t>(response.body.size());
+    } else {
+      size = st.st_size;
+    }
+  }
+
+  off_t first = 0;
+  off_t length = size;
+  std::string contentRange;
+  if (response.status == 200 && !response.etag.empty() &&
+      etagMatches(request.header("if-none-match"), response.etag)) {
+    response.status = 304;
+    length = 0;
+  } else if (response.status == 200 && file >= 0 &&
+             !request.header("range").empty()) {
+    // A range of a different version than the client has is no use to it
+    std::string ifRange = request.header("if-range");
+    off_t last = 0;
+    switch (ifRange.empty() || ifRange == response.etag
+                ? parseRange(request.header("range"), size, first, last)
+                : RangeResult::Whole) {
+    case RangeResult::Whole:
+      break;
+    case RangeResult::Partial:
+      response.status = 206;
+      length = last - first + 1;
+      contentRange = "bytes " + std::to_string(first) + "-" +
+                     std::to_string(last) + "/" + std::to_string(size);
+      break;
+    case RangeResult::Unsatisfiable:
+      response.status = 416;
+      length = 0;
+      contentRange = "bytes */" + std::to_string(size);
+      break;
+    }
+  }
+
+  std::string &out = connection.output;
+  out = "HTTP/1.1 " + std::to_string(response.status) + " " +
+        reasonPhrase(response.status) + "\r\n";
+  out += "Server: wart/" + std::string(VERSION) + "\r\n";
+  out += "Date: " + httpDate() + "\r\n";
+  if (response.status != 304) {
+    out += "Content-Type: " + response.contentType + "\r\n";
+    out += "Content-Length: " + std::to_string(length) + "\r\n";
+  }
+  if (!response.etag.empty()) {
+    out += "ETag: " + response.etag + "\r\n";
+  }
+  if (file >= 0) {
+    out += "Accept-Ranges: bytes\r\n";
+  }
+  if (!contentRange.empty()) {
+    out += "Content-Range: " + contentRange + "\r\n";
+  }
+  for (const auto &[name, value] : response.headers) {
+    out += name + ": " + value + "\r\n";
+  }
+  if (connection.close) {
+    out += "Connection: close\r\n";
+  }
+  out += "\r\n";
+  connection.sent = 0;
+
+  bool sendBody = request.method != "HEAD" && length > 0;
+  if (file >= 0 && sendBody) {
+    connection.file = file;
+    connection.fileOffset = first;
+    connection.fileEnd = first + length;
+  } else {
+    if (file >= 0)
+      close(file);
+    if (sendBody) {
+      out += response.body;
+    }
+  }
+
+  logMessage(LogLevel::DEBUG, request.method + " " + request.path + " " +
+                                  std::to_string(response.status));
+  Metrics::instance().add("wart_serve_requests_total",
+                          "code=\"" + std::to_string(response.status) + "\"");
+  if (sendBody) {
+    Metrics::instance().add("wart_serve_response_bytes_total", "",
+                            static_cast<double>(length));
+  }
+}
+
+// Send what is pending. False if the connection is gone, or parked until
+// the socket takes more.
+bool HttpServer::flush(Connection &connection) {
+  int fd = connection.fd;
+  auto park = [&] {
+    if (!connection.writing) {
+      connection.writing = true;
+      loop.setWriting(fd, true);
+    }
+    return false;
+  };
+
+  while (connection.sent < connection.output.size()) {
+    ssize_t n = send(fd, connection.output.data() + connection.sent,
+                     connection.output.size() - connection.sent, MSG_NOSIGNAL);
+    if (n >= 0) {
+      connection.sent += static_cast<size_t>(n);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return park();
+    } else if (errno != EINTR) {
+      closeConnection(fd);
+      return false;
+    }
+  }
+
+  while (connection.file >= 0 && connection.fileOffset < connection.fileEnd) {
+    size_t chunk =
+        static_cast<size_t>(connection.fileEnd - connection.fileOffset);
+#ifdef __linux__
+    // Straight from the page cache to the socket
+    ssize_t n = sendfile(fd, connection.file, &connection.fileOffset, chunk);
+#else
+    char buffer[65536];
+    ssize_t n = pread(connection.file, buffer,
+                      std::min(chunk, sizeof(buffer)), connection.fileOffset);
+    if (n > 0) {
+      n = send(fd, buffer, static_cast<size_t>(n), MSG_NOSIGNAL);
+      if (n > 0)
+        connection.fileOffset += n;
+    }
+#endif
+    if (n > 0) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return park();
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    // Truncated under us or a broken connection: the length we promised
+    // cannot be kept
+    closeConnection(fd);
+    return false;
+  }
+
+  if (connection.file >= 0) {
+    close(connection.file);
+    connection.file = -1;
+  }
+  connection.output.clear();
+  connection.sent = 0;
+  if (connection.writing) {
+    connection.writing = false;
+    loop.setWriting(fd, false);
+  }
+  if (connection.close) {
+    closeConnection(fd);
+    return false;
+  }
+  return true;
+}
+
+void HttpServer::closeConnection(int fd) {
+  loop.unwatch(fd);
+  close(fd);
+  clients.erase(fd);
+}
+
+void HttpServer::closeIdle(std::chrono::seconds idle) {
+  auto cutoff = std::chrono::steady_clock::now() - idle;
+  std::vector<int> stale;
+  for (const auto &[fd, connection] : clients) {
+    if (!connection->waiting && connection->lastActive < cutoff) {
+      stale.push_back(fd);
+    }
+  }
+  for (int fd : stale) {
+    closeConnection(fd);
+  }
+}
+
+} // namespace wart
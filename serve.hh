@@ -0,0 +1,92 @@
+#pragma once
+
+// Standard Library
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace wart {
+
+class EventLoop;
+
+struct HttpRequest {
+  std::string method;
+  std::string path; // Without the query
+  std::string query;
+  std::unordered_map<std::string, std::string> headers; // Lowercase names
+
+  std::string header(const std::string &name) const;
+
+  // Decoded value of a query parameter, fallback if absent
+  std::string param(const std::string &name,
+                    const std::string &fallback = "") const;
+};
+
+// What to answer: either a small body held in memory or a file, which is
+// sent with sendfile and may be asked for in ranges
+struct HttpResponse {
+  int status = 200;
+  std::string contentType = "application/json";
+  std::string body;
+  std::string file;
+  std::string etag; // Quoted strong validator, enables 304 and If-Range
+  std::vector<std::pair<std::string, std::string>> headers;
+};
+
+// Minimal HTTP/1.1 server running on the daemon's event loop. Connections
+// are non-blocking and kept alive; a response that does not fit in the
+// socket buffer parks its connection until it is writable again. Only GET
+// and HEAD are served, conditional and single range requests are handled
+// here so that handlers only have to say what to send.
+class HttpServer {
+public:
+  // A handler answers through reply, either at once or later from the
+  // loop's thread once it has what it needs. Its connection is parked
+  // meanwhile, requests pipelined behind it included; a reply for a
+  // connection closed in between is dropped.
+  using Reply = std::function<void(HttpResponse)>;
+  using Handler = std::function<void(const HttpRequest &, Reply)>;
+
+  HttpServer(EventLoop &loop, Handler handler);
+  ~HttpServer();
+
+  HttpServer(const HttpServer &) = delete;
+  HttpServer &operator=(const HttpServer &) = delete;
+
+  // Start accepting on host:port, an empty host meaning every address
+  bool listen(const std::string &address);
+
+  // Drop connections that have been quiet for longer than idle
+  void closeIdle(std::chrono::seconds idle);
+
+  size_t connections() const { return clients.size(); }
+
+private:
+  struct Connection;
+
+  void onAccept();
+  void onReadable(int fd);
+  void serve(Connection &connection);
+  void respond(Connection &connection, const std::string &head);
+  void answer(Connection &connection, const HttpRequest &request,
+              HttpResponse response);
+  bool flush(Connection &connection);
+  void closeConnection(int fd);
+
+  EventLoop &loop;
+  Handler handler;
+  int listenFd = -1;
+  uint64_t requests = 0; // Ids matching late replies to their request
+  std::unordered_map<int, std::unique_ptr<Connection>> clients;
+};
+
+// Split host:port, [v6]:port or a bare port
+bool parseListenAddress(const std::string &address, std::string &host,
+                        std::string &port);
+
+} // namespace wart
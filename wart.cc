@@ -1,31 +1,50 @@
 #include "wart.hh"
+#include "history.hh"
+#include "image.hh"
+#include "metrics.hh"
+#include "palette.hh"
+#include "provider.hh"
+#include "retry.hh"
+#include "serve.hh"
+#include "x11.hh"
 
 using namespace std;
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
+extern char **environ;
+
 namespace wart {
 
 // Global state
 std::atomic<bool> running{true};
 
-void logMessage(LogLevel level, const std::string &message) {
-  static const std::unordered_map<LogLevel, std::string> levelStrings = {
-      {LogLevel::DEBUG, "DEBUG"},
-      {LogLevel::INFO, "INFO"},
-      {LogLevel::WARNING, "WARNING"},
-      {LogLevel::ERROR, "ERROR"}};
+bool daemonized = false; // Standard streams lead to /dev/null
 
-  auto now = std::chrono::system_clock::now();
-  auto time = std::chrono::system_clock::to_time_t(now);
+// Hand the message to the logger's writer thread, never blocks
+void logMessage(LogLevel level, std::string message) {
+  Logger::instance().log(level, std::move(message));
+}
 
-  std::cout << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << " ["
-            << levelStrings.at(level) << "] " << message << std::endl;
+// Apply the log settings of a configuration. Only the process running the
+// update loop writes WART_LOG, so that commands run meanwhile do not race
+// its rotation.
+void configureLogging(const Config &config, bool withFile) {
+  LogOptions options;
+  parseLogLevel(config.loglevel, options.minLevel);
+  options.json = config.logformat == "json";
+  options.console = !daemonized;
+  int size = config.logsize;
+  if (withFile && size > 0) {
+    options.filePath = WART_LOG;
+    options.maxBytes = static_cast<uintmax_t>(size) << 20;
+  }
+  Logger::instance().configure(std::move(options));
 }
 
 // CURL callback function
-static size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
-                                  void *userp) {
+size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
+                           void *userp) {
   size_t realsize = size * nmemb;
   auto *mem = static_cast<MemoryBuffer *>(userp);
 
@@ -37,6 +56,178 @@ static size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
   return realsize;
 }
 
+// Cache validators from the most recent response. When body is set, it is
+// sized from Content-Length before the first byte arrives.
+struct ResponseHeaders {
+  std::string etag;
+  std::string lastModified;
+  MemoryBuffer *body = nullptr;
+};
+
+// Largest Content-Length trusted for reserving a buffer up front
+constexpr curl_off_t MAX_RESERVE = 64 << 20;
+
+// Images up to this size are received in memory and written out once
+constexpr curl_off_t MAX_MEMORY_IMAGE = 16 << 20;
+
+// CURL header callback collecting ETag and Last-Modified
+static size_t headerCallback(char *buffer, size_t size, size_t nitems,
+                             void *userp) {
+  size_t realsize = size * nitems;
+  auto *headers = static_cast<ResponseHeaders *>(userp);
+  std::string_view line(buffer, realsize);
+
+  // A new status line starts a new response, e.g. after a redirect
+  if (line.starts_with("HTTP/")) {
+    headers->etag.clear();
+    headers->lastModified.clear();
+    return realsize;
+  }
+
+  size_t colon = line.find(':');
+  if (colon == std::string_view::npos) {
+    return realsize;
+  }
+
+  std::string name(line.substr(0, colon));
+  std::transform(name.begin(), name.end(), name.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  std::string_view value = line.substr(colon + 1);
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    value.remove_prefix(1);
+  while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back())))
+    value.remove_suffix(1);
+
+  if (name == "etag") {
+    headers->etag = value;
+  } else if (name == "last-modified") {
+    headers->lastModified = value;
+  } else if (name == "content-length" && headers->body) {
+    curl_off_t length = 0;
+    auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), length);
+    if (ec == std::errc() && length > 0 && length <= MAX_RESERVE) {
+      headers->body->reserve(static_cast<size_t>(length));
+    }
+  }
+
+  return realsize;
+}
+
+// Image download staged in a .part file in the store. When resuming, the
+// file is already open for appending and the hash covers the bytes on disk.
+// A fresh download of known, modest size is held in memory instead and
+// written to the .part file in one go by finish().
+struct ImageSink {
+  std::string path;
+  FILE *fp = nullptr;
+  MemoryBuffer memory;
+  bool inMemory = false;
+  ContentHash hash;
+  CURL *curl = nullptr;
+  curl_off_t offset = 0;
+  bool started = false;
+
+  ~ImageSink() {
+    if (fp)
+      fclose(fp);
+  }
+
+  // Leave everything received so far in path, synced to disk if durable.
+  // Partial bodies are kept too, for the next attempt to resume.
+  bool finish(bool durable);
+};
+
+bool ImageSink::finish(bool durable) {
+  if (inMemory) {
+    inMemory = false;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+
+    bool written = true;
+    std::string_view rest = memory.view();
+    while (!rest.empty()) {
+      ssize_t n = write(fd, rest.data(), rest.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        written = false;
+        break;
+      }
+      rest.remove_prefix(static_cast<size_t>(n));
+    }
+    if (written && durable && fsync(fd) != 0) {
+      written = false;
+    }
+    if (close(fd) != 0) {
+      written = false;
+    }
+    memory = MemoryBuffer{};
+    return written;
+  }
+
+  if (!fp) {
+    return false;
+  }
+  bool written = fflush(fp) == 0 && (!durable || fsync(fileno(fp)) == 0);
+  if (fclose(fp) != 0) {
+    written = false;
+  }
+  fp = nullptr;
+  return written;
+}
+
+// CURL callback streaming the image to disk while hashing it
+static size_t writeImageCallback(void *contents, size_t size, size_t nmemb,
+                                 void *userp) {
+  size_t realsize = size * nmemb;
+  auto *sink = static_cast<ImageSink *>(userp);
+
+  if (!sink->started) {
+    sink->started = true;
+
+    // Anything but 206 Partial Content is the whole image from byte zero
+    long responseCode = 0;
+    curl_easy_getinfo(sink->curl, CURLINFO_RESPONSE_CODE, &responseCode);
+    if (sink->offset > 0 && responseCode != 206) {
+      logMessage(LogLevel::WARNING, "Server ignored resume, restarting");
+      if (sink->fp) {
+        fclose(sink->fp);
+        sink->fp = nullptr;
+      }
+      sink->offset = 0;
+      sink->hash = ContentHash{};
+    }
+
+    // Small enough to keep in memory until it is complete
+    curl_off_t length = -1;
+    curl_easy_getinfo(sink->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (sink->offset == 0 && length > 0 && length <= MAX_MEMORY_IMAGE &&
+        sink->memory.reserve(static_cast<size_t>(length))) {
+      sink->inMemory = true;
+    }
+  }
+
+  sink->hash.update(contents, realsize);
+  if (sink->inMemory) {
+    return sink->memory.append(contents, realsize) ? realsize : 0;
+  }
+
+  if (!sink->fp) {
+    sink->fp = fopen(sink->path.c_str(), "wb");
+    if (!sink->fp) {
+      LOG_ERROR("Failed to create image file");
+      return 0;
+    }
+  }
+
+  return fwrite(contents, 1, realsize, sink->fp) == realsize ? realsize : 0;
+}
+
 // Configuration validation functions
 bool validateInterval(const std::string &value) {
   try {
@@ -56,15 +247,185 @@ bool validateResolution(const std::string &value) {
          validResolutions.end();
 }
 
-bool validateFormat(std::string_view value) {
+bool validateFormat(const std::string &value) {
   return value == "jpg" || value == "webp" || value == "png";
 }
 
+bool validateCount(const std::string &value) {
+  try {
+    return std::stoi(value) >= 0;
+  } catch (...) {
+    return false;
+  }
+}
+
+bool validateQuality(const std::string &value) {
+  try {
+    int quality = std::stoi(value);
+    return quality >= 1 && quality <= 100;
+  } catch (...) {
+    return false;
+  }
+}
+
+bool validateLogLevel(const std::string &value) {
+  LogLevel level;
+  return parseLogLevel(value, level);
+}
+
+bool validateLogFormat(const std::string &value) {
+  return value == "text" || value == "json";
+}
+
+bool validateMirrors(const std::string &value) {
+  std::istringstream list(value);
+  std::string url;
+  size_t count = 0;
+  while (std::getline(list, url, ',')) {
+    if (!url.starts_with("http://") && !url.starts_with("https://")) {
+      return false;
+    }
+    ++count;
+  }
+  return count > 0;
+}
+
+bool validateListen(const std::string &value) {
+  std::string host;
+  std::string port;
+  return parseListenAddress(value, host, port);
+}
+
+bool validateSchedule(const std::string &value) {
+  return value == "interval" || value == "enddate";
+}
+
+// HH:MM, 24 hour clock
+static bool parseClockTime(std::string_view value, int &minutes) {
+  int hours = 0, mins = 0;
+  if (value.size() != 5 || value[2] != ':') {
+    return false;
+  }
+  auto [hp, he] = std::from_chars(value.data(), value.data() + 2, hours);
+  auto [mp, me] = std::from_chars(value.data() + 3, value.data() + 5, mins);
+  if (he != std::errc() || me != std::errc() || hp != value.data() + 2 ||
+      mp != value.data() + 5 || hours > 23 || mins > 59) {
+    return false;
+  }
+  minutes = hours * 60 + mins;
+  return true;
+}
+
+bool validatePublishTime(const std::string &value) {
+  int minutes;
+  return parseClockTime(value, minutes);
+}
+
 bool validateBoolean(const std::string &value) {
   return value == "0" || value == "1" || value == "true" || value == "false" ||
          value == "yes" || value == "no";
 }
 
+bool validateText(const std::string &) { return true; }
+
+// One scalar wartrc key, generated from WART_SETTINGS
+struct Setting {
+  std::string_view key;
+  std::string_view fallback; // The default as a wartrc writes it
+  bool (*validate)(const std::string &);
+  std::string_view expected;
+  std::string_view initial;
+  std::string_view doc;
+  std::variant<int Config::*, bool Config::*, std::string Config::*> field;
+};
+
+// Stringized defaults keep the quotes of string literals
+static constexpr std::string_view unquote(std::string_view text) {
+  if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+    return text.substr(1, text.size() - 2);
+  }
+  return text;
+}
+
+static constexpr Setting SETTINGS[] = {
+#define WART_SETTING_ROW(key, type, fallback, validator, expected, initial,   \
+                         doc)                                                  \
+  {#key, unquote(#fallback), validator, expected, initial, doc, &Config::key},
+    WART_SETTINGS(WART_SETTING_ROW)
+#undef WART_SETTING_ROW
+};
+
+static const Setting *findSetting(std::string_view key) {
+  for (const auto &setting : SETTINGS) {
+    if (setting.key == key) {
+      return &setting;
+    }
+  }
+  return nullptr;
+}
+
+// Store an already validated value into its field
+static void assignSetting(Config &config, const Setting &setting,
+                          const std::string &value) {
+  std::visit(
+      [&](auto member) {
+        auto &field = config.*member;
+        using Field = std::decay_t<decltype(field)>;
+        if constexpr (std::is_same_v<Field, int>) {
+          std::from_chars(value.data(), value.data() + value.size(), field);
+        } else if constexpr (std::is_same_v<Field, bool>) {
+          field = value == "1" || value == "true" || value == "yes";
+        } else {
+          field = value;
+        }
+      },
+      setting.field);
+}
+
+static std::string settingText(const Config &config, const Setting &setting) {
+  return std::visit(
+      [&](auto member) -> std::string {
+        const auto &field = config.*member;
+        using Field = std::decay_t<decltype(field)>;
+        if constexpr (std::is_same_v<Field, int>) {
+          return std::to_string(field);
+        } else if constexpr (std::is_same_v<Field, bool>) {
+          return field ? "1" : "0";
+        } else {
+          return field;
+        }
+      },
+      setting.field);
+}
+
+static bool checkSetting(const Setting &setting, const std::string &value) {
+  if (!setting.validate(value)) {
+    LOG_ERROR("'" + std::string(setting.key) + "' must be " +
+              std::string(setting.expected));
+    return false;
+  }
+  return true;
+}
+
+// Directives taking a whole command line, and the sessions they apply to
+struct CommandDirective {
+  std::string_view key;
+  std::vector<std::string> SessionCommands::*list;
+  std::optional<SessionType> session; // Empty for every session
+};
+
+static const CommandDirective commandDirectives[] = {
+    {"applier", &SessionCommands::appliers, std::nullopt},
+    {"x11applier", &SessionCommands::appliers, SessionType::X11},
+    {"waylandapplier", &SessionCommands::appliers, SessionType::Wayland},
+    {"hooks", &SessionCommands::hooks, std::nullopt},
+    {"x11hooks", &SessionCommands::hooks, SessionType::X11},
+    {"waylandhooks", &SessionCommands::hooks, SessionType::Wayland},
+    {"previewer", &SessionCommands::previewers, std::nullopt},
+    {"x11previewer", &SessionCommands::previewers, SessionType::X11},
+    {"waylandpreviewer", &SessionCommands::previewers, SessionType::Wayland},
+};
+
 // Load configuration from file
 bool loadConfig(const std::string &filepath, Config &config) {
   std::ifstream file(filepath);
@@ -73,7 +434,8 @@ bool loadConfig(const std::string &filepath, Config &config) {
     return false;
   }
 
-  config.values.clear();
+  config = Config();
+  bool valid = true;
   std::string line;
 
   while (std::getline(file, line)) {
@@ -84,42 +446,87 @@ bool loadConfig(const std::string &filepath, Config &config) {
     std::istringstream iss(line);
     std::string key, value;
 
-    if (!(iss >> key >> value)) {
+    // Commands keep the rest of the line, arguments and all
+    iss >> key;
+    auto directive =
+        std::find_if(std::begin(commandDirectives), std::end(commandDirectives),
+                     [&](const CommandDirective &d) { return d.key == key; });
+    if (directive != std::end(commandDirectives)) {
+      std::string command;
+      std::getline(iss >> std::ws, command);
+      while (!command.empty() &&
+             std::isspace(static_cast<unsigned char>(command.back())))
+        command.pop_back();
+      if (command.empty()) {
+        LOG_ERROR("Malformed line in config file: " + line);
+        continue;
+      }
+
+      for (size_t i = 0; i < config.commands.size(); ++i) {
+        if (!directive->session ||
+            static_cast<size_t>(*directive->session) == i) {
+          (config.commands[i].*directive->list).push_back(command);
+        }
+      }
+      continue;
+    }
+
+    if (!(iss >> value)) {
       LOG_ERROR("Malformed line in config file: " + line);
       continue; // Skip malformed lines but continue processing
     }
 
-    config.values[key] = value;
+    const Setting *setting = findSetting(key);
+    if (!setting) {
+      // 'clean' is retired: the store budget now always applies
+      if (key != "clean") {
+        logMessage(LogLevel::WARNING, "Unknown key in config file: " + key);
+      }
+    } else if (checkSetting(*setting, value)) {
+      assignSetting(config, *setting, value);
+    } else {
+      valid = false;
+    }
   }
 
-  return validateConfig(config);
+  return valid;
 }
 
-// Validate configuration values
-bool validateConfig(const Config &config) {
-  bool valid = true;
-
-  if (!validateInterval(config.get("interval", "3600"))) {
-    LOG_ERROR("'interval' must be an integer > 0");
-    valid = false;
+// Load the config file again and swap it in if it is valid
+bool reloadConfig(ConfigHandle &handle) {
+  auto config = std::make_shared<Config>();
+  if (!loadConfig(WART_CONFIG, *config)) {
+    LOG_ERROR("Invalid config, keeping the current one");
+    return false;
   }
 
-  if (!validateBoolean(config.get("clean", "1"))) {
-    LOG_ERROR("'clean' must be 0 or 1");
-    valid = false;
-  }
+  configureLogging(*config, true);
+  handle.set(std::move(config));
+  logMessage(LogLevel::INFO, "Configuration reloaded");
+  return true;
+}
 
-  if (!validateResolution(config.get("resolution", "1920x1080"))) {
-    LOG_ERROR("'resolution' must be a valid resolution");
-    valid = false;
+// Validate configuration values, e.g. of one built in code
+bool validateConfig(const Config &config) {
+  bool valid = true;
+  for (const auto &setting : SETTINGS) {
+    valid = checkSetting(setting, settingText(config, setting)) && valid;
   }
+  return valid;
+}
 
-  if (!validateFormat(config.get("format", "jpg"))) {
-    LOG_ERROR("'format' must be jpg, webp, or png");
-    valid = false;
+// The settings of a new wartrc, each after its comment
+static void writeDefaultConfig(std::ostream &out) {
+  for (const auto &setting : SETTINGS) {
+    out << "# " << setting.doc << "\n";
+    if (setting.initial.starts_with("# ")) {
+      out << "# " << setting.key << " " << setting.initial.substr(2) << "\n";
+    } else {
+      out << setting.key << " "
+          << (setting.initial.empty() ? setting.fallback : setting.initial)
+          << "\n";
+    }
   }
-
-  return valid;
 }
 
 // Create and initialize wart configuration
@@ -143,15 +550,13 @@ bool initializeWart() {
     }
 
     // Write default configuration
-    wartrc << "interval 3600\n"
-           << "clean 1\n"
-           << "resolution 1920x1080\n"
-           << "format jpg\n"
-           << "# Hook examples:\n"
+    writeDefaultConfig(wartrc);
+    wartrc << "# Hook examples:\n"
            << "# x11hooks wal -i $WARTPAPER\n"
            << "# waylandhooks swww img $WARTPAPER\n"
            << "# hooks notify-send \"New wallpaper set\"\n"
            << "# Applier examples:\n"
+           << "# x11applier builtin\n"
            << "# x11applier feh --bg-fill $WARTPAPER\n"
            << "# waylandapplier swww img $WARTPAPER\n"
            << "# applier custom-wallpaper-script $WARTPAPER\n"
@@ -167,12 +572,9 @@ bool initializeWart() {
   Config config;
   if (loadConfig(WART_CONFIG, config)) {
     std::cout << "Config is valid!" << std::endl;
-    std::cout << "Interval: " << config.get("interval") << " seconds"
-              << std::endl;
-    std::cout << "Clean: " << (config.getBool("clean") ? "Enabled" : "Disabled")
-              << std::endl;
-    std::cout << "Resolution: " << config.get("resolution") << std::endl;
-    std::cout << "Format: " << config.get("format") << std::endl;
+    std::cout << "Interval: " << config.interval << " seconds" << std::endl;
+    std::cout << "Resolution: " << config.resolution << std::endl;
+    std::cout << "Format: " << config.format << std::endl;
     std::cout << "Wart is healthy." << std::endl;
     return true;
   } else {
@@ -182,471 +584,3928 @@ bool initializeWart() {
 }
 
 // Process lock file management
-bool createLockFile() {
-  if (fs::exists(WART_LOCK)) {
-    // Check if the process is still running
-    std::ifstream lock(WART_LOCK);
-    pid_t pid;
-    lock >> pid;
-
-    if (kill(pid, 0) == 0) {
-      LOG_ERROR("Another instance is already running");
-      return false;
-    }
+// The lock is an flock held for the life of the process, so it goes away
+// with the process however it ends. The pid in the file is informational.
+static int lockFd = -1;
 
-    // Remove stale lockfile
-    fs::remove(WART_LOCK);
+bool createLockFile(const std::string &path = WART_LOCK) {
+  lockFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lockFd < 0) {
+    LOG_ERROR("Cannot open lock file " + path);
+    return false;
+  }
+  if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+    LOG_ERROR("Another instance is already running");
+    close(lockFd);
+    lockFd = -1;
+    return false;
   }
 
-  std::ofstream lock(WART_LOCK);
-  lock << getpid();
+  std::string pid = std::to_string(getpid()) + "\n";
+  if (ftruncate(lockFd, 0) != 0 ||
+      pwrite(lockFd, pid.data(), pid.size(), 0) < 0) {
+    logMessage(LogLevel::WARNING, "Cannot write pid to lock file");
+  }
   return true;
 }
 
+// The file stays; unlinking it could let a second instance lock a new
+// file while a third still holds the old one
 void removeLockFile() {
-  if (fs::exists(WART_LOCK)) {
-    fs::remove(WART_LOCK);
+  if (lockFd >= 0) {
+    close(lockFd);
+    lockFd = -1;
   }
 }
 
-// Clean old wallpapers
-void cleanOldWallpapers(const std::string &format) {
-  const std::string ext = "." + format;
-  try {
-    for (const auto &entry : fs::directory_iterator(WART_HOME)) {
-      // Only remove wallpaper files, not previous or special files
-      if (entry.path().extension() == ext &&
-          entry.path().filename().string().find("wallpaper") !=
-              std::string::npos &&
-          entry.path().filename().string() != ("wallpaper" + ext) &&
-          entry.path().filename().string() != ("previous" + ext)) {
-        fs::remove(entry.path());
-      }
+// Format a content hash as a fixed-width hex key
+std::string hashToHex(uint64_t hash) {
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx",
+                static_cast<unsigned long long>(hash));
+  return buf;
+}
+
+bool hexToHash(const std::string &hex, uint64_t &hash) {
+  auto [ptr, ec] = std::from_chars(hex.data(), hex.data() + hex.size(), hash, 16);
+  return ec == std::errc() && ptr == hex.data() + hex.size();
+}
+
+// Feed an existing file into a hash the same way downloads are hashed
+bool hashFile(const std::string &path, ContentHash &contentHash) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  char buf[65536];
+  while (file.read(buf, sizeof(buf)) || file.gcount() > 0) {
+    contentHash.update(buf, static_cast<size_t>(file.gcount()));
+  }
+  return true;
+}
+
+bool hashFile(const std::string &path, uint64_t &hash) {
+  ContentHash contentHash;
+  if (!hashFile(path, contentHash)) {
+    return false;
+  }
+  hash = contentHash.value();
+  return true;
+}
+
+// Replace a file atomically by writing a temporary and renaming it
+bool writeFileAtomic(const std::string &path, const std::string &contents) {
+  std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file || !file.write(contents.data(),
+                             static_cast<std::streamsize>(contents.size()))) {
+      return false;
     }
-  } catch (const fs::filesystem_error &e) {
-    logMessage(LogLevel::ERROR,
-               std::string("Error cleaning wallpapers: ") + e.what());
   }
+
+  std::error_code ec;
+  fs::rename(tmpPath, path, ec);
+  return !ec;
 }
 
-// Backup current wallpaper
-void backupWallpaper(const std::string &currentWallpaper) {
-  std::string backupPath =
-      WART_HOME + "previous." +
-      fs::path(currentWallpaper).extension().string().substr(1);
-  try {
-    if (fs::exists(currentWallpaper)) {
-      fs::copy_file(currentWallpaper, backupPath,
-                    fs::copy_options::overwrite_existing);
+// Make dest another name for src's bytes: a hard link where possible, a
+// reflink on copy-on-write filesystems across directories that cannot be
+// linked, and a plain copy only when neither works
+bool cloneFile(const std::string &src, const std::string &dest) {
+  std::error_code ec;
+  fs::remove(dest, ec);
+  if (link(src.c_str(), dest.c_str()) == 0) {
+    return true;
+  }
+
+#ifdef FICLONE
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in >= 0) {
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) {
+      close(out);
     }
-  } catch (const fs::filesystem_error &e) {
-    logMessage(LogLevel::ERROR,
-               std::string("Failed to backup wallpaper: ") + e.what());
+    close(in);
+    if (cloned) {
+      return true;
+    }
+    fs::remove(dest, ec);
   }
+#endif
+
+  fs::copy_file(src, dest, fs::copy_options::overwrite_existing, ec);
+  return !ec;
 }
 
-// Restore previous wallpaper
-bool restorePreviousWallpaper(const Config &config) {
-  std::string previousPath = WART_HOME + "previous." + config.get("format");
-  if (!fs::exists(previousPath)) {
-    LOG_ERROR("No previous wallpaper found");
+// Wallpaper store
+bool WallpaperStore::load() {
+  entries.clear();
+  byHash.clear();
+  byUrl.clear();
+  byVariant.clear();
+  totalBytes = 0;
+
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec) {
+    LOG_ERROR("Failed to create store " + dir + ": " + ec.message());
     return false;
   }
 
-  std::string currentPath = WART_HOME + "wallpaper." + config.get("format");
+  std::ifstream file(dir + "manifest.json");
+  if (!file) {
+    return true; // Empty store
+  }
+
   try {
-    fs::copy_file(previousPath, currentPath,
-                  fs::copy_options::overwrite_existing);
-    return setWallpaper(currentPath);
-  } catch (const fs::filesystem_error &e) {
-    LOG_ERROR(std::string("Failed to restore previous wallpaper: ") + e.what());
-    return false;
+    json manifest = json::parse(file);
+    for (const auto &item : manifest.at("entries")) {
+      StoreEntry entry;
+      if (!hexToHash(item.at("hash").get<std::string>(), entry.hash) ||
+          byHash.count(entry.hash)) {
+        continue;
+      }
+      entry.ext = item.at("ext").get<std::string>();
+      entry.size = item.value("size", uintmax_t{0});
+      entry.lastUsed = item.value("last_used", int64_t{0});
+      entry.url = item.value("url", "");
+      if (item.contains("source") &&
+          !hexToHash(item["source"].get<std::string>(), entry.source)) {
+        continue;
+      }
+      entry.variant = item.value("variant", "");
+
+      // Entries are saved most recently used first
+      auto it = entries.insert(entries.end(), std::move(entry));
+      byHash[it->hash] = it;
+      if (!it->url.empty()) {
+        byUrl[it->url] = it->hash;
+      }
+      if (!it->variant.empty()) {
+        byVariant[variantKey(it->source, it->variant)] = it->hash;
+      }
+      totalBytes += it->size;
+    }
+  } catch (const json::exception &e) {
+    logMessage(LogLevel::WARNING,
+               std::string("Ignoring corrupt store manifest: ") + e.what());
   }
+
+  return true;
 }
 
-// Fetch wallpaper from API
-bool fetchWallpaper(const Config &config) {
-  CURL *curl = curl_easy_init();
-  if (!curl) {
-    LOG_ERROR("Failed to initialize CURL");
+bool WallpaperStore::save() const {
+  json list = json::array();
+  for (const auto &entry : entries) {
+    json item = {{"hash", hashToHex(entry.hash)},
+                 {"ext", entry.ext},
+                 {"size", entry.size},
+                 {"last_used", entry.lastUsed},
+                 {"url", entry.url}};
+    if (!entry.variant.empty()) {
+      item["source"] = hashToHex(entry.source);
+      item["variant"] = entry.variant;
+    }
+    list.push_back(std::move(item));
+  }
+
+  json manifest = {{"version", 1}, {"entries", std::move(list)}};
+  if (!writeFileAtomic(dir + "manifest.json", manifest.dump(1) + "\n")) {
+    LOG_ERROR("Failed to save store manifest");
     return false;
   }
+  return true;
+}
+
+std::string WallpaperStore::pathFor(const StoreEntry &entry) const {
+  return dir + hashToHex(entry.hash) + "." + entry.ext;
+}
 
-  // Construct URL with parameters
-  std::string url =
-      "https://bing.biturl.top/?resolution=" + config.get("resolution") +
-      "&format=json&index=0&mkt=en-US";
+const StoreEntry *WallpaperStore::find(uint64_t hash) const {
+  auto it = byHash.find(hash);
+  return it != byHash.end() ? &*it->second : nullptr;
+}
 
-  logMessage(LogLevel::INFO, "Fetching from URL: " + url);
+const StoreEntry *WallpaperStore::findUrl(const std::string &url) const {
+  auto it = byUrl.find(url);
+  return it != byUrl.end() ? find(it->second) : nullptr;
+}
 
-  MemoryBuffer chunk;
+const StoreEntry *WallpaperStore::findVariant(uint64_t source,
+                                              const std::string &variant) const {
+  auto it = byVariant.find(variantKey(source, variant));
+  return it != byVariant.end() ? find(it->second) : nullptr;
+}
 
-  // Set curl options
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, static_cast<void *>(&chunk));
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(curl, CURLOPT_USERAGENT,
-                   ("Mozilla/5.0 Wart/" + std::string(VERSION)).c_str());
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L); // Set timeout to 30 seconds
+std::string WallpaperStore::variantKey(uint64_t source,
+                                       const std::string &variant) {
+  return hashToHex(source) + "/" + variant;
+}
 
-  CURLcode res = curl_easy_perform(curl);
+const StoreEntry *WallpaperStore::ingest(const std::string &file,
+                                         uint64_t hash, const std::string &ext,
+                                         const std::string &url, bool move) {
+  auto now = std::chrono::system_clock::now();
+  int64_t nowSeconds = std::chrono::duration_cast<std::chrono::seconds>(
+                           now.time_since_epoch())
+                           .count();
+  std::error_code ec;
 
-  if (res != CURLE_OK) {
-    LOG_ERROR(std::string("Failed to fetch wallpaper data: ") +
-              curl_easy_strerror(res));
-    curl_easy_cleanup(curl);
-    return false;
+  auto existing = byHash.find(hash);
+  if (existing != byHash.end() && existing->second->ext == ext &&
+      fs::exists(pathFor(*existing->second))) {
+    // Same image already stored, only refresh its position
+    if (move) {
+      fs::remove(file, ec);
+    }
+    entries.splice(entries.begin(), entries, existing->second);
+    existing->second->lastUsed = nowSeconds;
+    if (!url.empty()) {
+      existing->second->url = url;
+      byUrl[url] = hash;
+    }
+    return &*existing->second;
   }
 
-  try {
-    // Parse JSON response
-    json response = json::parse(chunk.data());
+  StoreEntry entry;
+  entry.hash = hash;
+  entry.ext = ext;
+  entry.url = url;
+  entry.lastUsed = nowSeconds;
 
-    // Extract image URL
-    std::string imageUrl = response["url"];
-    logMessage(LogLevel::INFO, "Image URL: " + imageUrl);
+  std::string target = pathFor(entry);
+  if (move) {
+    fs::rename(file, target, ec);
+  } else if (!cloneFile(file, target)) {
+    ec = std::make_error_code(std::errc::io_error);
+  }
+  if (ec) {
+    LOG_ERROR("Failed to add " + file + " to store: " + ec.message());
+    return nullptr;
+  }
 
-    // Create a new CURL handle for downloading the image
-    CURL *imgCurl = curl_easy_init();
-    if (!imgCurl) {
-      LOG_ERROR("Failed to initialize CURL for image download");
-      curl_easy_cleanup(curl);
-      return false;
+  // Only drop a stale entry for this hash once its replacement is in
+  // place, along with its file when that was stored under another ext
+  if (existing != byHash.end()) {
+    std::string stale = pathFor(*existing->second);
+    if (stale != target) {
+      fs::remove(stale, ec);
     }
+    erase(existing->second);
+  }
 
-    // Construct image filename
-    std::string filename = WART_HOME + "wallpaper." + config.get("format");
-    FILE *fp = fopen(filename.c_str(), "wb");
-    if (!fp) {
-      LOG_ERROR("Failed to create image file");
-      curl_easy_cleanup(curl);
-      curl_easy_cleanup(imgCurl);
-      return false;
-    }
+  entry.size = fs::file_size(target, ec);
+  if (ec) {
+    entry.size = 0;
+  }
 
-    // Download image
-    curl_easy_setopt(imgCurl, CURLOPT_URL, imageUrl.c_str());
-    curl_easy_setopt(imgCurl, CURLOPT_WRITEFUNCTION, nullptr);
-    curl_easy_setopt(imgCurl, CURLOPT_WRITEDATA, fp);
-    curl_easy_setopt(imgCurl, CURLOPT_TIMEOUT,
-                     60L); // Set timeout to 60 seconds
+  auto it = entries.insert(entries.begin(), std::move(entry));
+  byHash[hash] = it;
+  if (!url.empty()) {
+    byUrl[url] = hash;
+  }
+  totalBytes += it->size;
+  return &*it;
+}
 
-    res = curl_easy_perform(imgCurl);
-    fclose(fp);
+const StoreEntry *WallpaperStore::ingestVariant(const std::string &file,
+                                                uint64_t hash,
+                                                const std::string &ext,
+                                                uint64_t source,
+                                                const std::string &variant) {
+  const StoreEntry *stored = ingest(file, hash, ext, "");
+  if (!stored) {
+    return nullptr;
+  }
 
-    if (res != CURLE_OK) {
-      LOG_ERROR(std::string("Failed to download image: ") +
-                curl_easy_strerror(res));
-      curl_easy_cleanup(curl);
-      curl_easy_cleanup(imgCurl);
-      return false;
+  auto it = byHash.find(hash)->second;
+  it->source = source;
+  it->variant = variant;
+  byVariant[variantKey(source, variant)] = hash;
+  return stored;
+}
+
+bool WallpaperStore::link(uint64_t hash, const std::string &dest) {
+  auto it = byHash.find(hash);
+  if (it == byHash.end()) {
+    return false;
+  }
+
+  // Relative target so the home directory can be moved around
+  fs::path target = fs::path(pathFor(*it->second))
+                        .lexically_relative(fs::path(dest).parent_path());
+  std::string tmpPath = dest + ".tmp";
+  std::error_code ec;
+  fs::remove(tmpPath, ec);
+  fs::create_symlink(target, tmpPath, ec);
+  if (!ec) {
+    fs::rename(tmpPath, dest, ec);
+  }
+  if (ec) {
+    LOG_ERROR("Failed to link " + dest + ": " + ec.message());
+    return false;
+  }
+
+  touch(hash);
+  return true;
+}
+
+void WallpaperStore::touch(uint64_t hash) {
+  auto it = byHash.find(hash);
+  if (it == byHash.end()) {
+    return;
+  }
+  entries.splice(entries.begin(), entries, it->second);
+  it->second->lastUsed = std::chrono::duration_cast<std::chrono::seconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+}
+
+void WallpaperStore::evict(size_t maxCount, uintmax_t maxBytes,
+                           uint64_t pinned, std::chrono::seconds keepRecent) {
+  auto overBudget = [&] {
+    return (maxCount > 0 && entries.size() > maxCount) ||
+           (maxBytes > 0 && totalBytes > maxBytes);
+  };
+  int64_t recent = std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::system_clock::now().time_since_epoch() -
+                       keepRecent)
+                       .count();
+
+  // Walk from the least recently used end
+  auto it = entries.end();
+  while (overBudget() && it != entries.begin()) {
+    --it;
+    if (it->hash == pinned ||
+        (keepRecent.count() > 0 && it->lastUsed > recent)) {
+      continue;
+    }
+
+    logMessage(LogLevel::INFO, "Evicting " + pathFor(*it));
+    std::error_code ec;
+    fs::remove(pathFor(*it), ec);
+    if (ec) {
+      logMessage(LogLevel::ERROR, "Failed to evict " + pathFor(*it) + ": " +
+                                      ec.message());
+    }
+    auto victim = it++;
+    erase(victim);
+  }
+}
+
+void WallpaperStore::erase(Iterator it) {
+  auto url = byUrl.find(it->url);
+  if (url != byUrl.end() && url->second == it->hash) {
+    byUrl.erase(url);
+  }
+  if (!it->variant.empty()) {
+    auto variant = byVariant.find(variantKey(it->source, it->variant));
+    if (variant != byVariant.end() && variant->second == it->hash) {
+      byVariant.erase(variant);
+    }
+  }
+  byHash.erase(it->hash);
+  totalBytes -= std::min(totalBytes, it->size);
+  entries.erase(it);
+}
+
+// Enforce the configured store budget, keeping the current wallpaper
+void cleanStore(const Config &config, WallpaperStore &store,
+                uint64_t current) {
+  store.evict(static_cast<size_t>(config.storecount),
+              static_cast<uintmax_t>(config.storesize) << 20,
+              current);
+  store.save();
+}
+
+// Stored image a wallpaper link points to, with its hash and extension.
+// Images outside the store, e.g. from before it existed, are hashed.
+static bool resolveWallpaper(const std::string &path, std::string &image,
+                             uint64_t &hash, std::string &ext) {
+  std::error_code ec;
+  fs::path target = fs::canonical(path, ec);
+  if (ec || !target.has_extension()) {
+    return false;
+  }
+
+  fs::path storeDir = fs::canonical(fs::path(WART_STORE).parent_path(), ec);
+  bool stored = !ec && target.parent_path() == storeDir &&
+                hexToHash(target.stem().string(), hash);
+  if (!stored && !hashFile(target.string(), hash)) {
+    return false;
+  }
+  image = target.string();
+  ext = target.extension().string().substr(1);
+  return true;
+}
+
+// Keep the wallpaper about to be replaced in the history ring. It is
+// linked rather than copied, so this costs no image I/O.
+void backupWallpaper(const Config &config,
+                     const std::string &currentWallpaper) {
+  size_t depth = static_cast<size_t>(config.historydepth);
+  std::string image, ext;
+  uint64_t hash = 0;
+  if (depth == 0 || !resolveWallpaper(currentWallpaper, image, hash, ext)) {
+    return;
+  }
+
+  HistoryRing ring(WART_PREVIOUS);
+  if (!ring.load() || !ring.push(image, hash, ext, depth)) {
+    logMessage(LogLevel::ERROR, "Failed to backup wallpaper " + image);
+  }
+}
+
+// Go back steps wallpapers in the history ring. The current one takes the
+// most recent place in the ring, so restoring twice swaps back.
+bool restorePreviousWallpaper(const Config &config, WallpaperStore &store,
+                              size_t steps) {
+  size_t depth = static_cast<size_t>(config.historydepth);
+  HistoryRing ring(WART_PREVIOUS);
+  if (!ring.load()) {
+    LOG_ERROR("Failed to read wallpaper history");
+    return false;
+  }
+
+  // Single backup copy left by older versions
+  std::string legacyPath = WART_HOME + "previous." + config.format;
+  uint64_t legacyHash = 0;
+  if (ring.size() == 0 && fs::exists(legacyPath) &&
+      hashFile(legacyPath, legacyHash) &&
+      ring.push(legacyPath, legacyHash, config.format,
+                std::max<size_t>(depth, 1))) {
+    std::error_code ec;
+    fs::remove(legacyPath, ec);
+  }
+
+  if (ring.size() == 0) {
+    LOG_ERROR("No previous wallpaper found");
+    return false;
+  }
+  if (steps == 0 || steps > ring.size()) {
+    LOG_ERROR("Can go back 1 to " + std::to_string(ring.size()) +
+              " steps, not " + std::to_string(steps));
+    return false;
+  }
+
+  std::string currentPath = WART_HOME + "wallpaper." + config.format;
+  std::string currentImage, currentExt;
+  uint64_t currentHash = 0;
+  bool haveCurrent =
+      resolveWallpaper(currentPath, currentImage, currentHash, currentExt);
+
+  // Relinking is all it takes while the store still has the image;
+  // otherwise it goes back in from the ring's link
+  HistorySlot slot = ring.take(steps - 1);
+  const StoreEntry *entry = store.find(slot.hash);
+  if (!entry || entry->ext != slot.ext || !fs::exists(store.pathFor(*entry))) {
+    entry = store.ingest(ring.pathFor(slot), slot.hash, slot.ext, "", false);
+  }
+  if (entry && entry->ext != config.format) {
+    currentPath = WART_HOME + "wallpaper." + entry->ext;
+  }
+  if (!entry || !store.link(slot.hash, currentPath)) {
+    LOG_ERROR("Failed to restore previous wallpaper");
+    return false;
+  }
+  store.save();
+
+  if (haveCurrent && depth > 0) {
+    ring.push(currentImage, currentHash, currentExt, depth);
+  }
+  ring.discard(slot);
+  ring.save();
+  return setWallpaper(config, currentPath,
+                      originalImage(store, slot.hash, currentPath));
+}
+
+// Apply the image that was current n fetches ago, straight from the store
+bool restoreFromHistory(const Config &config, WallpaperStore &store,
+                        size_t n) {
+  HistoryIndex history(WART_HISTORY);
+  if (!history.open()) {
+    return false;
+  }
+  const HistoryRecord *record = history.at(n);
+  if (!record) {
+    LOG_ERROR("No wallpaper " + std::to_string(n) + " in history, it has " +
+              std::to_string(history.size()));
+    return false;
+  }
+
+  const StoreEntry *entry = store.find(record->hash);
+  if (!entry || !fs::exists(store.pathFor(*entry))) {
+    LOG_ERROR("Wallpaper " + std::to_string(n) + " is no longer in the store");
+    return false;
+  }
+
+  std::string currentPath = WART_HOME + "wallpaper." + config.format;
+  backupWallpaper(config, currentPath);
+  if (entry->ext != config.format) {
+    currentPath = WART_HOME + "wallpaper." + entry->ext;
+  }
+  if (!store.link(entry->hash, currentPath)) {
+    LOG_ERROR("Failed to restore wallpaper " + std::to_string(n));
+    return false;
+  }
+  store.save();
+  return setWallpaper(config, currentPath,
+                      originalImage(store, record->hash, currentPath));
+}
+
+// Fetch client with persistent connections
+FetchClient::FetchClient() : share(curl_share_init()), easy(curl_easy_init()) {
+  if (!valid()) {
+    LOG_ERROR("Failed to initialize CURL");
+    return;
+  }
+
+  // Share DNS lookups, TLS sessions and live connections between the
+  // metadata and image hosts for the lifetime of the client
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+FetchClient::~FetchClient() {
+  // The easy handle must let go of the share before it can be cleaned up
+  if (easy)
+    curl_easy_cleanup(easy);
+  if (share)
+    curl_share_cleanup(share);
+}
+
+void FetchClient::configure(CURL *handle, const std::string &url,
+                            long timeoutSeconds) {
+  curl_easy_setopt(handle, CURLOPT_SHARE, share);
+  curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(handle, CURLOPT_USERAGENT,
+                   ("Mozilla/5.0 Wart/" + std::string(VERSION)).c_str());
+  curl_easy_setopt(handle, CURLOPT_TIMEOUT, timeoutSeconds);
+  curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+}
+
+CURL *FetchClient::prepare(const std::string &url, long timeoutSeconds) {
+  // Reset keeps live connections and caches, only options are cleared
+  curl_easy_reset(easy);
+  configure(easy, url, timeoutSeconds);
+  return easy;
+}
+
+CURLcode FetchClient::perform() {
+  CURLcode res = curl_easy_perform(easy);
+  account(easy, res);
+  return res;
+}
+
+CURL *FetchClient::createHandle(const std::string &url, long timeoutSeconds) {
+  CURL *handle = curl_easy_init();
+  if (handle) {
+    configure(handle, url, timeoutSeconds);
+  }
+  return handle;
+}
+
+void FetchClient::account(CURL *handle, CURLcode res) {
+  // NUM_CONNECTS is the number of connections opened for this transfer,
+  // zero means an existing one from the pool was used
+  long connects = 0;
+  if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects) ==
+      CURLE_OK) {
+    if (connects > 0) {
+      fresh += static_cast<size_t>(connects);
+    } else if (res == CURLE_OK) {
+      ++reused;
+    }
+  }
+
+  // Parsed by libcurl from a 429 or 503, as seconds or as a date
+  curl_off_t retryAfter = 0;
+  if (curl_easy_getinfo(handle, CURLINFO_RETRY_AFTER, &retryAfter) !=
+      CURLE_OK) {
+    retryAfter = 0;
+  }
+  lastRetryAfter = std::chrono::seconds(std::max<curl_off_t>(retryAfter, 0));
+}
+
+// Load the state of the last fetch, a missing file is an empty state
+bool loadFetchState(const std::string &path, FetchState &state) {
+  state = FetchState{};
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+
+  try {
+    json j = json::parse(file);
+    state.metadataUrl = j.value("metadata_url", "");
+    state.metadataEtag = j.value("metadata_etag", "");
+    state.metadataLastModified = j.value("metadata_last_modified", "");
+    state.imageUrl = j.value("image_url", "");
+    state.imagePath = j.value("image_path", "");
+    state.imageHash = j.value("image_hash", uint64_t{0});
+    state.startDate = j.value("start_date", "");
+    state.endDate = j.value("end_date", "");
+    state.copyright = j.value("copyright", "");
+    state.partialUrl = j.value("partial_url", "");
+    state.partialEtag = j.value("partial_etag", "");
+    state.partialLastModified = j.value("partial_last_modified", "");
+  } catch (const json::exception &e) {
+    logMessage(LogLevel::WARNING,
+               std::string("Ignoring corrupt fetch state: ") + e.what());
+    state = FetchState{};
+    return false;
+  }
+
+  return true;
+}
+
+// Persist the fetch state, written to a temporary file and renamed
+bool saveFetchState(const std::string &path, const FetchState &state) {
+  json j = {{"metadata_url", state.metadataUrl},
+            {"metadata_etag", state.metadataEtag},
+            {"metadata_last_modified", state.metadataLastModified},
+            {"image_url", state.imageUrl},
+            {"image_path", state.imagePath},
+            {"image_hash", state.imageHash},
+            {"start_date", state.startDate},
+            {"end_date", state.endDate},
+            {"copyright", state.copyright},
+            {"partial_url", state.partialUrl},
+            {"partial_etag", state.partialEtag},
+            {"partial_last_modified", state.partialLastModified}};
+
+  if (!writeFileAtomic(path, j.dump(2) + "\n")) {
+    LOG_ERROR("Failed to save fetch state");
+    return false;
+  }
+  return true;
+}
+
+// Whether the configured resolution is scaled locally from the UHD original
+bool deriveEnabled(const Config &config) {
+  return config.derive && haveJpeg() && config.resolution != "UHD";
+}
+
+// Resolution to ask the providers for
+static std::string requestResolution(const Config &config) {
+  return deriveEnabled(config) ? "UHD" : config.resolution;
+}
+
+namespace {
+
+// SAX handler picking the few top-level strings wart needs out of a
+// metadata response, without building a DOM of the whole document
+class MetadataHandler : public nlohmann::json_sax<json> {
+public:
+  explicit MetadataHandler(WallpaperMetadata &out) : metadata(out) {}
+
+  bool null() override { return true; }
+  bool boolean(bool) override { return true; }
+  bool number_integer(number_integer_t) override { return true; }
+  bool number_unsigned(number_unsigned_t) override { return true; }
+  bool number_float(number_float_t, const string_t &) override { return true; }
+  bool binary(binary_t &) override { return true; }
+
+  bool string(string_t &value) override {
+    if (target) {
+      target->assign(value); // Keeps the capacity of a reused metadata
+      target = nullptr;
+    }
+    return true;
+  }
+
+  bool key(string_t &name) override {
+    target = nullptr;
+    if (depth != 1) {
+      return true;
+    }
+    if (name == "url") {
+      target = &metadata.url;
+    } else if (name == "start_date") {
+      target = &metadata.startDate;
+    } else if (name == "end_date") {
+      target = &metadata.endDate;
+    } else if (name == "copyright") {
+      target = &metadata.copyright;
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) override { return enter(); }
+  bool end_object() override { return leave(); }
+  bool start_array(std::size_t) override { return enter(); }
+  bool end_array() override { return leave(); }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &e) override {
+    error = e.what();
+    return false;
+  }
+
+  std::string error;
+
+private:
+  bool enter() {
+    ++depth;
+    target = nullptr;
+    return true;
+  }
+
+  bool leave() {
+    --depth;
+    target = nullptr;
+    return true;
+  }
+
+  WallpaperMetadata &metadata;
+  std::string *target = nullptr; // Field the next string value belongs to
+  int depth = 0;
+};
+
+} // namespace
+
+// Pull the metadata fields out of an API response body in one pass
+bool parseMetadata(std::string_view body, WallpaperMetadata &metadata,
+                   std::string &error) {
+  metadata.url.clear();
+  metadata.startDate.clear();
+  metadata.endDate.clear();
+  metadata.copyright.clear();
+  MetadataHandler handler(metadata);
+  if (!json::sax_parse(body.begin(), body.end(), &handler)) {
+    error = handler.error.empty() ? "invalid metadata" : handler.error;
+    return false;
+  }
+  return true;
+}
+
+// Store variant name for an original scaled to resolution (empty keeps
+// its size) and encoded as format
+std::string variantName(const std::string &resolution,
+                        const std::string &format) {
+  return resolution.empty() ? format : resolution + "." + format;
+}
+
+// Whether a stored image is what the configuration asks for
+bool matchesVariant(const StoreEntry &entry, const std::string &resolution,
+                    const std::string &format) {
+  if (entry.ext != format) {
+    return false;
+  }
+  return entry.variant.empty() ? resolution.empty()
+                               : entry.variant == variantName(resolution,
+                                                              format);
+}
+
+// Scale and transcode a stored original, or reuse an earlier result. Each
+// source hash is converted at most once per resolution and format.
+const StoreEntry *deriveVariant(WallpaperStore &store,
+                                const StoreEntry &original,
+                                const std::string &resolution,
+                                const std::string &format, int quality) {
+  std::string variant = variantName(resolution, format);
+  if (const StoreEntry *cached = store.findVariant(original.hash, variant);
+      cached && fs::exists(store.pathFor(*cached))) {
+    return cached;
+  }
+
+  int width = 0, height = 0;
+  if (!resolution.empty() && !parseResolution(resolution, width, height)) {
+    LOG_ERROR("Cannot derive resolution " + resolution);
+    return nullptr;
+  }
+
+  // Older stores named originals after the configured format
+  std::string sourcePath = store.pathFor(original);
+  std::string sourceFormat = sniffImageFormat(sourcePath);
+  if (sourceFormat != "jpg") {
+    LOG_ERROR("Cannot decode " + sourcePath + " (" +
+              (sourceFormat.empty() ? "unknown" : sourceFormat) + ")");
+    return nullptr;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  Image image;
+  if (!decodeJpeg(sourcePath, image, width, height)) {
+    return nullptr;
+  }
+  if (!resolution.empty()) {
+    image = resizeToFill(image, width, height);
+  }
+
+  std::string tmpPath = store.directory() + "derive." + format + ".tmp";
+  uint64_t hash = 0;
+  if (!encodeImage(image, tmpPath, format, quality) ||
+      !hashFile(tmpPath, hash)) {
+    std::error_code ec;
+    fs::remove(tmpPath, ec);
+    return nullptr;
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::error_code ec;
+  logMessage(LogLevel::INFO,
+             "Derived " + variant + " in " + std::to_string(elapsed.count()) +
+                 " ms (" + std::to_string(original.size >> 10) + " KiB to " +
+                 std::to_string(fs::file_size(tmpPath, ec) >> 10) + " KiB)");
+
+  return store.ingestVariant(tmpPath, hash, format, original.hash, variant);
+}
+
+// Total time of a finished transfer
+static uint32_t transferMs(CURL *handle) {
+  curl_off_t micros = 0;
+  curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &micros);
+  return static_cast<uint32_t>(micros / 1000);
+}
+
+// Phase timings and size of a finished transfer, so that slow cycles can
+// be pinned on DNS, TLS, the API or the image CDN
+static void recordTransfer(CURL *handle, const std::string &kind,
+                           CURLcode res) {
+  static const std::pair<const char *, CURLINFO> phases[] = {
+      {"namelookup", CURLINFO_NAMELOOKUP_TIME_T},
+      {"connect", CURLINFO_CONNECT_TIME_T},
+      {"appconnect", CURLINFO_APPCONNECT_TIME_T},
+      {"starttransfer", CURLINFO_STARTTRANSFER_TIME_T},
+      {"total", CURLINFO_TOTAL_TIME_T},
+  };
+
+  Metrics &metrics = Metrics::instance();
+  std::string labels = "kind=\"" + kind + "\"";
+  metrics.add("wart_http_requests_total",
+              labels + ",result=\"" + (res == CURLE_OK ? "ok" : "error") +
+                  "\"");
+
+  for (const auto &[phase, info] : phases) {
+    curl_off_t micros = 0;
+    if (curl_easy_getinfo(handle, info, &micros) == CURLE_OK) {
+      metrics.observe("wart_http_phase_seconds",
+                      labels + ",phase=\"" + phase + "\"",
+                      static_cast<double>(micros) / 1e6);
+    }
+  }
+
+  curl_off_t bytes = 0, speed = 0;
+  curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+  curl_easy_getinfo(handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+  metrics.add("wart_http_response_bytes_total", labels,
+              static_cast<double>(bytes));
+  metrics.set("wart_http_speed_bytes_per_second", labels,
+              static_cast<double>(speed));
+}
+
+// Add the image just applied, with what the API said about it, to the
+// history index. Failing to do so is not worth failing the fetch for.
+static void recordHistory(HistoryRecord &record, const StoreEntry &entry,
+                          const WallpaperStore &store,
+                          const FetchState &state) {
+  record.hash = entry.hash;
+  record.source = entry.source;
+  record.size = entry.size;
+  record.fetchedAt = std::chrono::duration_cast<std::chrono::seconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+  int width = 0, height = 0;
+  if (probeImageSize(store.pathFor(entry), width, height)) {
+    record.width = static_cast<uint32_t>(width);
+    record.height = static_cast<uint32_t>(height);
+  }
+  HistoryRecord::set(record.ext, entry.ext);
+  HistoryRecord::set(record.startDate, state.startDate);
+  HistoryRecord::set(record.endDate, state.endDate);
+  HistoryRecord::set(record.url, state.imageUrl);
+  HistoryRecord::set(record.copyright, state.copyright);
+
+  HistoryIndex history(WART_HISTORY);
+  history.append(record);
+}
+
+// One metadata request of a possibly hedged fetch
+struct MetadataAttempt {
+  Provider *provider = nullptr;
+  std::string url;
+  CURL *curl = nullptr;
+  struct curl_slist *conditions = nullptr;
+  MemoryBuffer body;
+  ResponseHeaders headers;
+  std::chrono::steady_clock::time_point started;
+  bool running = false;
+  CURLcode res = CURLE_OK;
+  long responseCode = 0;
+
+  ~MetadataAttempt() {
+    if (curl)
+      curl_easy_cleanup(curl);
+    curl_slist_free_all(conditions);
+  }
+};
+
+// Ask the providers for the metadata of the image index days back in
+// market, today's by default. The preferred one is asked first; when it
+// has not answered within its usual p95, the next one is asked as well and
+// whichever answers first wins. A provider that fails hands over to the
+// next one at once. Nothing if none of them answered.
+static std::unique_ptr<MetadataAttempt>
+requestMetadata(const Config &config, FetchClient &client,
+                ProviderSet &providers, const FetchState &state,
+                int index = 0, const std::string &market = "en-US") {
+  std::vector<Provider *> ranked = providers.ranked();
+  if (ranked.empty()) {
+    LOG_ERROR("No wallpaper providers configured");
+    return nullptr;
+  }
+
+  CURLM *multi = curl_multi_init();
+  if (!multi) {
+    LOG_ERROR("Failed to initialize CURL multi handle");
+    return nullptr;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  const std::string resolution = requestResolution(config);
+  const bool hedge = config.hedge;
+  std::vector<std::unique_ptr<MetadataAttempt>> attempts;
+  std::unique_ptr<MetadataAttempt> winner;
+  size_t nextProvider = 0;
+  size_t inFlight = 0;
+  Clock::time_point hedgeAt = Clock::time_point::max();
+
+  // Start the next provider in line, if any is left
+  auto launchNext = [&] {
+    while (nextProvider < ranked.size()) {
+      auto attempt = std::make_unique<MetadataAttempt>();
+      attempt->provider = ranked[nextProvider++];
+      attempt->url = attempt->provider->metadataUrl(resolution, index, market);
+      attempt->curl = client.createHandle(attempt->url, 30L);
+      if (!attempt->curl) {
+        continue;
+      }
+      logMessage(LogLevel::INFO, "Fetching from URL: " + attempt->url);
+
+      CURL *curl = attempt->curl;
+      attempt->headers.body = &attempt->body;
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA,
+                       static_cast<void *>(&attempt->body));
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerCallback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA,
+                       static_cast<void *>(&attempt->headers));
+
+      // Revalidate the metadata we already have instead of fetching it
+      // again; validators only mean something to whoever issued them
+      if (state.metadataUrl == attempt->url && !state.imageUrl.empty()) {
+        if (!state.metadataEtag.empty()) {
+          attempt->conditions = curl_slist_append(
+              attempt->conditions,
+              ("If-None-Match: " + state.metadataEtag).c_str());
+        }
+        if (!state.metadataLastModified.empty()) {
+          attempt->conditions = curl_slist_append(
+              attempt->conditions,
+              ("If-Modified-Since: " + state.metadataLastModified).c_str());
+        }
+      }
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, attempt->conditions);
+
+      attempt->started = Clock::now();
+      attempt->running = true;
+      curl_multi_add_handle(multi, curl);
+      ++inFlight;
+      hedgeAt = hedge ? attempt->started +
+                            ProviderSet::hedgeDelay(*attempt->provider)
+                      : Clock::time_point::max();
+      attempts.push_back(std::move(attempt));
+      return;
+    }
+  };
+
+  launchNext();
+  while (!winner && inFlight > 0) {
+    int stillRunning = 0;
+    CURLMcode mres = curl_multi_perform(multi, &stillRunning);
+    if (mres != CURLM_OK) {
+      LOG_ERROR(std::string("Metadata request failed: ") +
+                curl_multi_strerror(mres));
+      break;
+    }
+
+    int queued = 0;
+    while (CURLMsg *msg = curl_multi_info_read(multi, &queued)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      auto it = std::find_if(
+          attempts.begin(), attempts.end(),
+          [&](const auto &attempt) { return attempt->curl == msg->easy_handle; });
+      MetadataAttempt &attempt = **it;
+      attempt.res = msg->data.result;
+      curl_multi_remove_handle(multi, attempt.curl);
+      attempt.running = false;
+      --inFlight;
+
+      curl_easy_getinfo(attempt.curl, CURLINFO_RESPONSE_CODE,
+                        &attempt.responseCode);
+      client.account(attempt.curl, attempt.res);
+      recordTransfer(attempt.curl, "metadata", attempt.res);
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - attempt.started);
+      bool ok = attempt.res == CURLE_OK && attempt.responseCode < 400;
+      attempt.provider->stats().record(elapsed, ok);
+      Metrics::instance().add("wart_provider_requests_total",
+                              "provider=\"" + attempt.provider->name() +
+                                  "\",result=\"" + (ok ? "ok" : "error") +
+                                  "\"");
+      if (ok) {
+        Metrics::instance().observe(
+            "wart_provider_seconds",
+            "provider=\"" + attempt.provider->name() + "\"",
+            static_cast<double>(elapsed.count()) / 1000);
+        winner = std::move(*it);
+        break;
+      }
+
+      logMessage(LogLevel::WARNING,
+                 "No wallpaper data from " + attempt.provider->name() + ": " +
+                     (attempt.res != CURLE_OK
+                          ? std::string(curl_easy_strerror(attempt.res))
+                          : "HTTP " + std::to_string(attempt.responseCode)));
+      if (inFlight == 0) {
+        launchNext();
+      }
+    }
+    if (winner) {
+      break;
+    }
+
+    // Slower than usual, ask the next provider too
+    if (inFlight > 0 && Clock::now() >= hedgeAt &&
+        nextProvider < ranked.size()) {
+      logMessage(LogLevel::INFO, "No answer from " +
+                                     attempts.back()->provider->name() +
+                                     " yet, also asking " +
+                                     ranked[nextProvider]->name());
+      Metrics::instance().add("wart_provider_hedges_total", "");
+      launchNext();
+    }
+
+    int timeoutMs = 1000;
+    if (hedgeAt != Clock::time_point::max() && nextProvider < ranked.size()) {
+      auto untilHedge = std::chrono::duration_cast<std::chrono::milliseconds>(
+          hedgeAt - Clock::now());
+      timeoutMs = static_cast<int>(
+          std::clamp<int64_t>(untilHedge.count(), 0, timeoutMs));
+    }
+    curl_multi_poll(multi, nullptr, 0, timeoutMs, nullptr);
+  }
+
+  // Losers are cancelled; their time so far says nothing about them
+  for (auto &attempt : attempts) {
+    if (attempt && attempt->running) {
+      curl_multi_remove_handle(multi, attempt->curl);
+    }
+  }
+  curl_multi_cleanup(multi);
+  return winner;
+}
+
+// What a provider said about the image. It only goes into the state once
+// the image is stored: validators saved for an image that failed to
+// download would turn the next request into a 304 for the old one.
+struct MetadataUpdate {
+  bool present = false; // Nothing new on a 304
+  std::string url;      // Of the request, which the validators belong to
+  std::string etag;
+  std::string lastModified;
+  std::string startDate;
+  std::string endDate;
+  std::string copyright;
+};
+
+static void applyMetadata(FetchState &state, const MetadataUpdate &metadata) {
+  if (!metadata.present) {
+    return;
+  }
+  if (!metadata.url.empty()) {
+    state.metadataUrl = metadata.url;
+    state.metadataEtag = metadata.etag;
+    state.metadataLastModified = metadata.lastModified;
+  }
+  state.startDate = metadata.startDate;
+  state.endDate = metadata.endDate;
+  state.copyright = metadata.copyright;
+}
+
+// Link a stored image as the wallpaper, backing up the one it replaces,
+// and record it
+static FetchResult installWallpaper(const Config &config,
+                                    WallpaperStore &store, FetchState &state,
+                                    HistoryRecord &record,
+                                    const MetadataUpdate &metadata,
+                                    const std::string &imageUrl,
+                                    const StoreEntry &entry,
+                                    const std::string &filename) {
+  // A new URL can still carry the exact same picture
+  uint64_t hash = entry.hash;
+  bool unchanged = hash == state.imageHash && filename == state.imagePath &&
+                   fs::exists(filename);
+
+  if (!unchanged) {
+    if (fs::exists(filename)) {
+      backupWallpaper(config, filename);
+    }
+    if (!store.link(hash, filename)) {
+      return FetchResult::Failed;
+    }
+  }
+  store.save();
+
+  applyMetadata(state, metadata);
+  state.imageUrl = imageUrl;
+  state.imagePath = filename;
+  state.imageHash = hash;
+  saveFetchState(WART_STATE, state);
+
+  if (unchanged) {
+    logMessage(LogLevel::INFO, "Downloaded image is identical to current");
+    return FetchResult::Unchanged;
+  }
+
+  recordHistory(record, entry, store, state);
+  return FetchResult::Updated;
+}
+
+// Take today's image from the system daemon's shared cache rather than
+// from the network. Nothing when no system daemon is running or it does
+// not answer, so that the caller can fetch it itself.
+static std::optional<FetchResult> fetchShared(const Config &config,
+                                              FetchState &state,
+                                              WallpaperStore &store) {
+  std::string format = config.format;
+  ControlReply reply;
+  auto start = std::chrono::steady_clock::now();
+  if (!sendControlRequest({"image", config.resolution, format}, reply,
+                          WART_SYSTEM_SOCKET)) {
+    logMessage(LogLevel::WARNING,
+               "No system daemon at " + WART_SYSTEM_SOCKET +
+                   ", fetching directly");
+    return std::nullopt;
+  }
+  // Only an error it reports is the daemon's word on today's image; one
+  // that hung or went away is as good as none
+  if (!reply.answered) {
+    logMessage(LogLevel::WARNING,
+               "No answer from the system daemon, fetching directly");
+    return std::nullopt;
+  }
+  if (!reply.ok) {
+    LOG_ERROR("System daemon: " + reply.body);
+    return FetchResult::Failed;
+  }
+
+  // One "key value" pair per line
+  std::unordered_map<std::string, std::string> image;
+  std::istringstream lines(reply.body);
+  for (std::string line; std::getline(lines, line);) {
+    size_t space = line.find(' ');
+    if (space != std::string::npos) {
+      image[line.substr(0, space)] = line.substr(space + 1);
+    }
+  }
+  uint64_t hash = 0;
+  const std::string &path = image["path"];
+  if (path.empty() || image["url"].empty() || image["ext"].empty() ||
+      !hexToHash(image["hash"], hash)) {
+    LOG_ERROR("Malformed answer from the system daemon");
+    return FetchResult::Failed;
+  }
+  logMessage(LogLevel::INFO, "Image URL: " + image["url"] + " (shared)");
+
+  MetadataUpdate metadata;
+  metadata.present = true;
+  metadata.startDate = image["startdate"];
+  metadata.endDate = image["enddate"];
+  metadata.copyright = image["copyright"];
+
+  HistoryRecord record;
+  record.metadataMs = static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+
+  // Variants are stored without a URL so they are never taken for the
+  // original of that URL
+  const StoreEntry *entry = store.find(hash);
+  if (!entry || !fs::exists(store.pathFor(*entry))) {
+    entry = store.ingest(path, hash, image["ext"],
+                         image["original"] == "1" ? image["url"] : "", false);
+    if (!entry) {
+      return FetchResult::Failed;
+    }
+  }
+  return installWallpaper(config, store, state, record, metadata,
+                          image["url"], *entry,
+                          WART_HOME + "wallpaper." + format);
+}
+
+// Fetch wallpaper from API
+FetchResult fetchWallpaper(const Config &config, FetchClient &client,
+                           ProviderSet &providers, FetchState &state,
+                           WallpaperStore &store) {
+  if (config.shared) {
+    if (auto result = fetchShared(config, state, store)) {
+      return *result;
+    }
+  }
+
+  if (!client.valid()) {
+    LOG_ERROR("Failed to initialize CURL");
+    return FetchResult::Failed;
+  }
+
+  std::unique_ptr<MetadataAttempt> response =
+      requestMetadata(config, client, providers, state);
+  if (!response) {
+    LOG_ERROR("Failed to fetch wallpaper data from any provider");
+    return FetchResult::Failed;
+  }
+
+  HistoryRecord record;
+  record.metadataMs = transferMs(response->curl);
+
+  std::string imageUrl;
+  MetadataUpdate update;
+  if (response->responseCode == 304) {
+    logMessage(LogLevel::INFO, "Wallpaper data not modified");
+    imageUrl = state.imageUrl;
+  } else {
+    WallpaperMetadata metadata;
+    std::string error;
+    if (!response->provider->parseMetadata(response->body.view(), metadata,
+                                           error)) {
+      LOG_ERROR("JSON parsing failed: " + error);
+      return FetchResult::Failed;
+    }
+    imageUrl = std::move(metadata.url);
+    update.present = true;
+    update.url = response->url;
+    update.etag = response->headers.etag;
+    update.lastModified = response->headers.lastModified;
+    update.startDate = std::move(metadata.startDate);
+    update.endDate = std::move(metadata.endDate);
+    update.copyright = std::move(metadata.copyright);
+  }
+
+  if (imageUrl.empty()) {
+    LOG_ERROR("No image URL in wallpaper data");
+    return FetchResult::Failed;
+  }
+
+  logMessage(LogLevel::INFO, "Image URL: " + imageUrl);
+
+  // Construct image filename
+  std::string format = config.format;
+  std::string filename = WART_HOME + "wallpaper." + format;
+
+  // Same picture as last time and still linked, nothing to download
+  std::string resolution =
+      deriveEnabled(config) ? config.resolution : "";
+  const StoreEntry *current = store.find(state.imageHash);
+  if (imageUrl == state.imageUrl && filename == state.imagePath && current &&
+      matchesVariant(*current, resolution, format) && fs::exists(filename)) {
+    logMessage(LogLevel::INFO, "Wallpaper unchanged, skipping download");
+    applyMetadata(state, update);
+    saveFetchState(WART_STATE, state);
+    return FetchResult::Unchanged;
+  }
+
+  const StoreEntry *entry = store.findUrl(imageUrl);
+  if (entry && fs::exists(store.pathFor(*entry))) {
+    logMessage(LogLevel::INFO, "Wallpaper found in store, skipping download");
+  } else {
+    // Download image over the same handle, reusing its connections
+    ImageSink sink;
+    sink.path = WART_STORE + "download." + format + ".part";
+    std::error_code ec;
+
+    // Pick up where an interrupted attempt of the same image stopped
+    struct curl_slist *rangeConditions = nullptr;
+    if (state.partialUrl == imageUrl && fs::exists(sink.path) &&
+        hashFile(sink.path, sink.hash)) {
+      sink.offset = static_cast<curl_off_t>(fs::file_size(sink.path, ec));
+      sink.fp = ec ? nullptr : fopen(sink.path.c_str(), "ab");
+    }
+    if (sink.fp && sink.offset > 0) {
+      logMessage(LogLevel::INFO, "Resuming download at byte " +
+                                     std::to_string(sink.offset));
+
+      // If-Range makes the server send the full image if it has changed;
+      // weak ETags are not allowed there
+      if (!state.partialEtag.empty() && !state.partialEtag.starts_with("W/")) {
+        rangeConditions = curl_slist_append(
+            rangeConditions, ("If-Range: " + state.partialEtag).c_str());
+      } else if (!state.partialLastModified.empty()) {
+        rangeConditions = curl_slist_append(
+            rangeConditions,
+            ("If-Range: " + state.partialLastModified).c_str());
+      }
+    } else {
+      if (sink.fp) {
+        fclose(sink.fp);
+        sink.fp = nullptr;
+      }
+      sink.offset = 0;
+      sink.hash = ContentHash{};
+      fs::remove(sink.path, ec);
+    }
+
+    ResponseHeaders headers;
+    CURL *curl = client.prepare(imageUrl, 60L); // Set timeout to 60 seconds
+    sink.curl = curl;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeImageCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, static_cast<void *>(&sink));
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, static_cast<void *>(&headers));
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    // A plain Range rather than RESUME_FROM, which fails outright when the
+    // server answers 200; the sink restarts from zero in that case
+    std::string range = std::to_string(sink.offset) + "-";
+    if (sink.offset > 0) {
+      curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, rangeConditions);
+
+    // Give up on stalled transfers early, the next attempt resumes them
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 15L);
+
+    CURLcode res = client.perform();
+    long responseCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
+    curl_slist_free_all(rangeConditions);
+
+    curl_off_t downloaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    record.downloadMs = transferMs(curl);
+    recordTransfer(curl, "image", res);
+    record.bytesDownloaded = static_cast<uint64_t>(downloaded);
+
+    // Flush to disk before the file is renamed into the store
+    bool written = sink.finish(true);
+
+    if (res != CURLE_OK || !written) {
+      LOG_ERROR(std::string("Failed to download image: ") +
+                curl_easy_strerror(res));
+
+      // Keep the received bytes for the next attempt unless the range
+      // itself was refused
+      if (responseCode == 416 || !fs::exists(sink.path)) {
+        fs::remove(sink.path, ec);
+        state.partialUrl.clear();
+      } else {
+        state.partialUrl = imageUrl;
+        if (!headers.etag.empty() || !headers.lastModified.empty()) {
+          state.partialEtag = headers.etag;
+          state.partialLastModified = headers.lastModified;
+        }
+      }
+      saveFetchState(WART_STATE, state);
+      return FetchResult::Failed;
+    }
+
+    state.partialUrl.clear();
+    state.partialEtag.clear();
+    state.partialLastModified.clear();
+
+    // Originals are stored as what they are, whatever format is set
+    std::string ext = sniffImageFormat(sink.path);
+    entry = store.ingest(sink.path, sink.hash.value(),
+                         ext.empty() ? format : ext, imageUrl);
+    if (!entry) {
+      return FetchResult::Failed;
+    }
+  }
+
+  // The original stays in the store for other resolutions and formats to
+  // derive from
+  if (!resolution.empty() ||
+      sniffImageFormat(store.pathFor(*entry)) != format) {
+    auto deriveStart = std::chrono::steady_clock::now();
+    const StoreEntry *derived = deriveVariant(
+        store, *entry, resolution, format, config.quality);
+    record.deriveMs = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - deriveStart)
+            .count());
+    if (derived) {
+      entry = derived;
+    } else {
+      logMessage(LogLevel::WARNING,
+                 "Failed to derive " + variantName(resolution, format) +
+                     ", using the original");
+    }
+  }
+
+  return installWallpaper(config, store, state, record, update, imageUrl,
+                          *entry, filename);
+}
+
+// One transfer of a prefetch batch
+struct PrefetchTransfer {
+  enum class Kind { Metadata, Image };
+
+  Kind kind = Kind::Metadata;
+  std::string url;
+  std::string label; // Market and day, for log messages
+  CURL *curl = nullptr;
+  MemoryBuffer body;
+  ResponseHeaders headers; // Only to size body
+  ImageSink sink;
+
+  ~PrefetchTransfer() {
+    if (curl)
+      curl_easy_cleanup(curl);
+  }
+};
+
+// Warm the store with several days and markets at once. All transfers run
+// concurrently on one multi handle, at most jobs at a time.
+bool prefetchWallpapers(const Config &config, FetchClient &client,
+                        WallpaperStore &store, int days,
+                        const std::vector<std::string> &markets, size_t jobs) {
+  if (!client.valid()) {
+    LOG_ERROR("Failed to initialize CURL");
+    return false;
+  }
+
+  CURLM *multi = curl_multi_init();
+  if (!multi) {
+    LOG_ERROR("Failed to initialize CURL multi handle");
+    return false;
+  }
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    static_cast<long>(jobs));
+
+  // Batches go to the preferred provider only, there is no single slow
+  // request worth hedging
+  ProviderSet providers;
+  providers.configure(config);
+  std::vector<Provider *> ranked = providers.ranked();
+  if (ranked.empty()) {
+    LOG_ERROR("No wallpaper providers configured");
+    curl_multi_cleanup(multi);
+    return false;
+  }
+  const Provider &provider = *ranked.front();
+  const std::string resolution = requestResolution(config);
+
+  const std::string format = config.format;
+  std::deque<std::unique_ptr<PrefetchTransfer>> pending;
+  std::unordered_map<CURL *, std::unique_ptr<PrefetchTransfer>> active;
+  std::unordered_set<std::string> seenUrls;
+  size_t downloaded = 0, stored = 0, duplicates = 0, failed = 0;
+  size_t nextPart = 0;
+
+  for (int day = 0; day < days; ++day) {
+    for (const auto &market : markets) {
+      auto transfer = std::make_unique<PrefetchTransfer>();
+      transfer->url = provider.metadataUrl(resolution, day, market);
+      transfer->label = market + " day " + std::to_string(day);
+      pending.push_back(std::move(transfer));
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  // Keep up to jobs transfers in flight
+  auto startMore = [&] {
+    while (active.size() < jobs && !pending.empty()) {
+      auto transfer = std::move(pending.front());
+      pending.pop_front();
+
+      bool image = transfer->kind == PrefetchTransfer::Kind::Image;
+      transfer->curl = client.createHandle(transfer->url, image ? 60L : 30L);
+      if (!transfer->curl) {
+        ++failed;
+        continue;
+      }
+
+      if (image) {
+        transfer->sink.path = WART_STORE + "prefetch-" +
+                              std::to_string(nextPart++) + "." + format +
+                              ".part";
+        transfer->sink.curl = transfer->curl;
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION,
+                         writeImageCallback);
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA,
+                         static_cast<void *>(&transfer->sink));
+        curl_easy_setopt(transfer->curl, CURLOPT_FAILONERROR, 1L);
+      } else {
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION,
+                         writeMemoryCallback);
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA,
+                         static_cast<void *>(&transfer->body));
+        transfer->headers.body = &transfer->body;
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION,
+                         headerCallback);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA,
+                         static_cast<void *>(&transfer->headers));
+      }
+
+      CURL *handle = transfer->curl;
+      curl_multi_add_handle(multi, handle);
+      active.emplace(handle, std::move(transfer));
+    }
+  };
+
+  // Turn a finished metadata transfer into an image transfer, or finish
+  // an image transfer by moving it into the store
+  auto complete = [&](PrefetchTransfer &transfer, CURLcode res) {
+    client.account(transfer.curl, res);
+    recordTransfer(transfer.curl,
+                   transfer.kind == PrefetchTransfer::Kind::Metadata ? "metadata"
+                                                                     : "image",
+                   res);
+
+    if (transfer.kind == PrefetchTransfer::Kind::Metadata) {
+      if (res != CURLE_OK) {
+        LOG_ERROR("Failed to fetch " + transfer.label + ": " +
+                  curl_easy_strerror(res));
+        ++failed;
+        return;
+      }
+
+      WallpaperMetadata metadata;
+      std::string error;
+      if (!provider.parseMetadata(transfer.body.view(), metadata, error) ||
+          metadata.url.empty()) {
+        LOG_ERROR("JSON parsing failed for " + transfer.label + ": " +
+                  (error.empty() ? "no url" : error));
+        ++failed;
+        return;
+      }
+      std::string imageUrl = std::move(metadata.url);
+
+      // Markets often share the same picture
+      if (!seenUrls.insert(imageUrl).second) {
+        ++duplicates;
+        return;
+      }
+      const StoreEntry *entry = store.findUrl(imageUrl);
+      if (entry && fs::exists(store.pathFor(*entry))) {
+        ++stored;
+        return;
+      }
+
+      auto image = std::make_unique<PrefetchTransfer>();
+      image->kind = PrefetchTransfer::Kind::Image;
+      image->url = imageUrl;
+      image->label = transfer.label;
+      pending.push_back(std::move(image));
+      return;
+    }
+
+    // Prefetched files need not survive a crash, so no fsync
+    bool written = res == CURLE_OK && transfer.sink.finish(false);
+    std::error_code ec;
+    if (res != CURLE_OK || !written) {
+      LOG_ERROR("Failed to download " + transfer.label + ": " +
+                curl_easy_strerror(res));
+      fs::remove(transfer.sink.path, ec);
+      ++failed;
+      return;
+    }
+
+    // Identical bytes under another URL are dropped by the store
+    uint64_t hash = transfer.sink.hash.value();
+    if (store.find(hash)) {
+      ++duplicates;
+    } else {
+      ++downloaded;
+    }
+    std::string ext = sniffImageFormat(transfer.sink.path);
+    if (!store.ingest(transfer.sink.path, hash, ext.empty() ? format : ext,
+                      transfer.url)) {
+      fs::remove(transfer.sink.path, ec);
+      ++failed;
+    }
+  };
+
+  while (!active.empty() || !pending.empty()) {
+    startMore();
+
+    int stillRunning = 0;
+    CURLMcode mres = curl_multi_perform(multi, &stillRunning);
+    if (mres != CURLM_OK) {
+      LOG_ERROR(std::string("Prefetch failed: ") + curl_multi_strerror(mres));
+      break;
+    }
+
+    int queued = 0;
+    while (CURLMsg *msg = curl_multi_info_read(multi, &queued)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+
+      CURL *handle = msg->easy_handle;
+      CURLcode res = msg->data.result;
+      curl_multi_remove_handle(multi, handle);
+
+      auto it = active.find(handle);
+      if (it != active.end()) {
+        auto transfer = std::move(it->second);
+        active.erase(it);
+        complete(*transfer, res);
+      }
+    }
+
+    if (stillRunning > 0) {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  }
+
+  // Anything left over after an error is still attached to the multi handle
+  for (auto &[handle, transfer] : active) {
+    curl_multi_remove_handle(multi, handle);
+    std::error_code ec;
+    fs::remove(transfer->sink.path, ec);
+  }
+  active.clear();
+  curl_multi_cleanup(multi);
+  store.save();
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  logMessage(LogLevel::INFO,
+             "Prefetch done in " + std::to_string(elapsed.count()) + " ms: " +
+                 std::to_string(downloaded) + " downloaded, " +
+                 std::to_string(stored) + " already stored, " +
+                 std::to_string(duplicates) + " duplicates, " +
+                 std::to_string(failed) + " failed");
+
+  size_t budget = static_cast<size_t>(config.storecount);
+  if (budget > 0 && store.count() > budget) {
+    logMessage(LogLevel::WARNING,
+               "Store holds " + std::to_string(store.count()) +
+                   " images, more than storecount " + std::to_string(budget) +
+                   "; the daemon will evict the oldest");
+  }
+
+  return failed == 0;
+}
+
+// Whether text at pos is a $WARTPAPER or ${WARTPAPER} reference
+static size_t wartpaperRef(const std::string &text, size_t pos) {
+  std::string_view rest = std::string_view(text).substr(pos);
+  if (rest.starts_with("$WARTPAPER"))
+    return 10;
+  if (rest.starts_with("${WARTPAPER}"))
+    return 12;
+  return 0;
+}
+
+// Split a command the way sh would for simple commands: whitespace
+// separates arguments, quotes and backslashes group them
+CommandLine tokenizeCommand(const std::string &command) {
+  CommandLine line;
+  std::string current;
+  bool inWord = false;
+  bool quoted = false; // Current word has quotes or escapes
+  char quote = 0;
+
+  for (size_t i = 0; i < command.size(); ++i) {
+    char c = command[i];
+
+    if (quote == '\'') {
+      if (c == '\'')
+        quote = 0;
+      else
+        current += c;
+      continue;
+    }
+
+    if (c == '\\' && i + 1 < command.size() &&
+        (!quote || std::string_view("\"\\$`").find(command[i + 1]) !=
+                       std::string_view::npos)) {
+      current += command[++i];
+      inWord = true;
+      quoted = true;
+      continue;
+    }
+
+    if (c == '$') {
+      size_t len = wartpaperRef(command, i);
+      if (len == 0)
+        line.needsShell = true;
+      current.append(command, i, len ? len : 1);
+      i += len ? len - 1 : 0;
+      inWord = true;
+      continue;
+    }
+
+    if (quote == '"') {
+      if (c == '"')
+        quote = 0;
+      else if (c == '`')
+        line.needsShell = true;
+      else
+        current += c;
+      continue;
+    }
+
+    if (c == '\'' || c == '"') {
+      quote = c;
+      inWord = true;
+      quoted = true;
+    } else if (std::isspace(static_cast<unsigned char>(c))) {
+      if (inWord) {
+        line.args.push_back(std::move(current));
+        current.clear();
+        inWord = false;
+        quoted = false;
+      }
+    } else {
+      // Operators, globs, brace groups, history and comments, and a
+      // leading VAR=value assignment
+      if (std::string_view("|&;<>()`*?[!{}").find(c) !=
+              std::string_view::npos ||
+          ((c == '~' || c == '#') && !inWord) ||
+          (c == '=' && line.args.empty() && !quoted)) {
+        line.needsShell = true;
+      }
+      current += c;
+      inWord = true;
+    }
+  }
+
+  if (quote) {
+    line.needsShell = true; // Let the shell report the error
+  }
+  if (inWord) {
+    line.args.push_back(std::move(current));
+  }
+  return line;
+}
+
+// Replace every $WARTPAPER reference in an argument
+bool substituteWartpaper(std::string &arg, const std::string &path) {
+  bool found = false;
+  for (size_t pos = arg.find('$'); pos != std::string::npos;
+       pos = arg.find('$', pos)) {
+    size_t len = wartpaperRef(arg, pos);
+    if (len == 0) {
+      ++pos;
+      continue;
+    }
+    arg.replace(pos, len, path);
+    pos += path.size();
+    found = true;
+  }
+  return found;
+}
+
+// Locate an executable in PATH, like which(1)
+std::string findExecutable(const std::string &name) {
+  const char *path = getenv("PATH");
+  std::istringstream dirs(path ? path : "/usr/bin:/bin");
+  std::string dir;
+  while (std::getline(dirs, dir, ':')) {
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+    if (access(candidate.c_str(), X_OK) == 0) {
+      return candidate;
+    }
+  }
+  return "";
+}
+
+void ProcessExecutor::setEnv(const std::string &name,
+                             const std::string &value) {
+  for (auto &[key, val] : env) {
+    if (key == name) {
+      val = value;
+      return;
+    }
+  }
+  env.emplace_back(name, value);
+}
+
+std::vector<ProcessResult>
+ProcessExecutor::run(const std::vector<std::string> &commands,
+                     const std::string &wallpaperPath, bool appendPath) {
+  using Clock = std::chrono::steady_clock;
+
+  struct Child {
+    size_t index;
+    pid_t pid;
+    int pidfd;
+    Clock::time_point started;
+    Clock::time_point deadline; // Clock::time_point::max() for none
+    bool terminated = false;
+  };
+
+  std::vector<ProcessResult> results(commands.size());
+  std::vector<Child> children;
+
+  // Environment shared by all children, the variables we set win
+  std::vector<std::string> envStrings;
+  for (char **var = environ; *var; ++var) {
+    std::string_view entry(*var);
+    std::string_view name = entry.substr(0, entry.find('='));
+    if (name != "WARTPAPER" &&
+        std::none_of(env.begin(), env.end(),
+                     [&](const auto &kv) { return kv.first == name; })) {
+      envStrings.emplace_back(entry);
+    }
+  }
+  envStrings.push_back("WARTPAPER=" + wallpaperPath);
+  for (const auto &[name, value] : env) {
+    envStrings.push_back(name + "=" + value);
+  }
+  std::vector<char *> envp;
+  for (auto &entry : envStrings) {
+    envp.push_back(entry.data());
+  }
+  envp.push_back(nullptr);
+
+  // Children start with default signal handling in their own process
+  // group, so a timeout can take down everything a hook started
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t none, defaults;
+  sigemptyset(&none);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGTERM);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                      POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETPGROUP);
+
+  auto spawn = [&](size_t index) {
+    const std::string &command = commands[index];
+    results[index].command = command;
+
+    CommandLine line = tokenizeCommand(command);
+    std::vector<std::string> args;
+    if (line.needsShell) {
+      // The shell expands $WARTPAPER itself from the environment
+      std::string script = command;
+      if (appendPath && script.find("WARTPAPER") == std::string::npos) {
+        script += " \"$WARTPAPER\"";
+      }
+      args = {"/bin/sh", "-c", script};
+    } else {
+      bool found = false;
+      for (auto &arg : line.args) {
+        found |= substituteWartpaper(arg, wallpaperPath);
+      }
+      if (appendPath && !found) {
+        line.args.push_back(wallpaperPath);
+      }
+      args = std::move(line.args);
+    }
+
+    if (args.empty()) {
+      LOG_ERROR("Empty command");
+      return;
+    }
+
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    Child child{index, -1, -1, Clock::now(), Clock::time_point::max()};
+    int err = posix_spawnp(&child.pid, argv[0], nullptr, &attr, argv.data(),
+                           envp.data());
+    if (err != 0) {
+      LOG_ERROR("Failed to run " + command + ": " + std::strerror(err));
+      return;
+    }
+
+#ifdef SYS_pidfd_open
+    child.pidfd = static_cast<int>(syscall(SYS_pidfd_open, child.pid, 0));
+#endif
+    if (timeout.count() > 0) {
+      child.deadline = child.started + timeout;
+    }
+    children.push_back(child);
+  };
+
+  size_t next = 0;
+  while (next < commands.size() || !children.empty()) {
+    while (children.size() < jobs && next < commands.size()) {
+      spawn(next++);
+    }
+    if (children.empty()) {
+      continue;
+    }
+
+    // Sleep until a child exits or the nearest deadline; without pidfds
+    // fall back to polling waitpid
+    auto now = Clock::now();
+    auto wake = Clock::time_point::max();
+    bool allPidfds = true;
+    std::vector<pollfd> fds;
+    for (const auto &child : children) {
+      wake = std::min(wake, child.deadline);
+      if (child.pidfd >= 0) {
+        fds.push_back({child.pidfd, POLLIN, 0});
+      } else {
+        allPidfds = false;
+      }
+    }
+
+    int waitMs = -1;
+    if (wake != Clock::time_point::max()) {
+      waitMs = static_cast<int>(std::max<long long>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now)
+                     .count() +
+                 1));
+    }
+    if (!allPidfds) {
+      waitMs = waitMs < 0 ? 50 : std::min(waitMs, 50);
+    }
+    poll(fds.data(), fds.size(), waitMs);
+
+    now = Clock::now();
+    for (auto it = children.begin(); it != children.end();) {
+      int status = 0;
+      pid_t done = waitpid(it->pid, &status, WNOHANG);
+      if (done == it->pid || (done < 0 && errno == ECHILD)) {
+        ProcessResult &result = results[it->index];
+        result.wallTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - it->started);
+        if (done == it->pid && WIFEXITED(status)) {
+          result.exitCode = WEXITSTATUS(status);
+        }
+        if (it->pidfd >= 0) {
+          close(it->pidfd);
+        }
+        it = children.erase(it);
+        continue;
+      }
+
+      if (now >= it->deadline) {
+        // Ask nicely first, then give it two seconds before SIGKILL
+        results[it->index].timedOut = true;
+        if (!it->terminated) {
+          kill(-it->pid, SIGTERM);
+          it->terminated = true;
+          it->deadline = now + std::chrono::seconds(2);
+        } else {
+          kill(-it->pid, SIGKILL);
+          it->deadline = Clock::time_point::max();
+        }
+      }
+      ++it;
+    }
+  }
+
+  posix_spawnattr_destroy(&attr);
+  return results;
+}
+
+// Log how a command went and whether it succeeded
+static bool reportResult(const std::string &what, const ProcessResult &result) {
+  std::string kind = "kind=\"" + what + "\"";
+  std::transform(kind.begin(), kind.end(), kind.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  Metrics::instance().observe(
+      "wart_command_seconds", kind,
+      std::chrono::duration<double>(result.wallTime).count());
+  if (result.timedOut || result.exitCode != 0) {
+    Metrics::instance().add("wart_command_failures_total", kind);
+  }
+
+  std::string took = " (" + std::to_string(result.wallTime.count()) + " ms)";
+  if (result.timedOut) {
+    logMessage(LogLevel::ERROR, what + " timed out" + took + ": " +
+                                    result.command);
+    return false;
+  }
+  if (result.exitCode != 0) {
+    logMessage(LogLevel::ERROR,
+               what + " failed with " + std::to_string(result.exitCode) +
+                   took + ": " + result.command);
+    return false;
+  }
+  logMessage(LogLevel::INFO, what + " finished" + took + ": " + result.command);
+  return true;
+}
+
+// Session type from XDG_SESSION_TYPE, empty when it is not set
+std::optional<SessionType> detectSession() {
+  const char *sessionType = getenv("XDG_SESSION_TYPE");
+  if (!sessionType) {
+    LOG_ERROR("Could not detect session type");
+    return std::nullopt;
+  }
+
+  std::string_view session(sessionType);
+  if (session == "x11") {
+    return SessionType::X11;
+  }
+  if (session == "wayland") {
+    return SessionType::Wayland;
+  }
+  return SessionType::Other;
+}
+
+// Executor for appliers and hooks as configured
+static ProcessExecutor makeExecutor(const Config &config, size_t jobs) {
+  return ProcessExecutor(jobs,
+                         std::chrono::seconds(config.hooktimeout));
+}
+
+// Set wallpaper using configured applier
+// The downloaded original behind a stored image, which is what the JPEG
+// decoders can read; transcoded variants may be PNG or WebP
+std::string originalImage(const WallpaperStore &store, uint64_t hash,
+                          const std::string &fallback) {
+  const StoreEntry *entry = store.find(hash);
+  if (entry && entry->source) {
+    if (const StoreEntry *original = store.find(entry->source)) {
+      return store.pathFor(*original);
+    }
+  }
+  return fallback;
+}
+
+bool setWallpaper(const Config &config, const std::string &path,
+                  const std::string &original) {
+  std::optional<SessionType> session = detectSession();
+  if (!session) {
+    return false;
+  }
+
+  // First configured applier for this session
+  const auto &appliers = config.commandsFor(*session).appliers;
+  std::string applierCmd = appliers.empty() ? "" : appliers.front();
+
+  // $WARTPAPER is replaced by the path, or the path is appended
+  std::string absPath = fs::absolute(path).string();
+
+  // The built-in applier only decodes JPEG; a PNG or WebP wallpaper is
+  // drawn from its original when there is one
+  std::string decodable = absPath;
+  if (sniffImageFormat(decodable) != "jpg" && !original.empty() &&
+      sniffImageFormat(original) == "jpg") {
+    decodable = original;
+  }
+
+  // Built-in root window applier, the default on X11 when compiled in. By
+  // default an image it cannot read goes to the fallback without an error.
+  bool builtinReads = sniffImageFormat(decodable) == "jpg";
+  if (*session == SessionType::X11 &&
+      (applierCmd == "builtin" ||
+       (applierCmd.empty() && haveX11Applier() && builtinReads))) {
+    logMessage(LogLevel::INFO, "Setting wallpaper with: builtin");
+    auto start = std::chrono::steady_clock::now();
+    ProcessResult result;
+    result.command = "builtin";
+    result.exitCode = setRootWallpaper(decodable) ? 0 : 1;
+    result.wallTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    if (reportResult("Applier", result) || !applierCmd.empty()) {
+      return result.exitCode == 0;
+    }
+  }
+
+  if (applierCmd.empty()) {
+    // Fallback to default appliers if none specified
+    if (*session == SessionType::Wayland) {
+      applierCmd = "swww img";
+    } else if (*session == SessionType::X11) {
+      applierCmd = "feh --bg-fill";
+    } else {
+      LOG_ERROR("No applier configured and no fallback available");
+      return false;
+    }
+  }
+
+  logMessage(LogLevel::INFO, "Setting wallpaper with: " + applierCmd);
+  ProcessExecutor executor = makeExecutor(config, 1);
+  return reportResult("Applier",
+                      executor.run({applierCmd}, absPath, true).front());
+}
+
+// Write the wallpaper's colours to WART_COLORS in pywal's colors.json
+// layout, and as shell variables to WART_COLORS_SH, for hooks to theme with.
+// On failure both are removed, so hooks never theme with the colours of a
+// previous wallpaper.
+bool updatePalette(const WallpaperStore &store, uint64_t hash,
+                   const std::string &wallpaperPath) {
+  auto fail = [] {
+    std::error_code ec;
+    fs::remove(WART_COLORS, ec);
+    fs::remove(WART_COLORS_SH, ec);
+    return false;
+  };
+
+  // Read the downloaded original, transcoded variants may not be JPEG
+  std::string source = originalImage(store, hash, wallpaperPath);
+
+  // A heavily downscaled decode is plenty for sixteen colours
+  auto start = std::chrono::steady_clock::now();
+  Image image;
+  if (sniffImageFormat(source) != "jpg" || !decodeJpeg(source, image, 64, 64)) {
+    LOG_ERROR("Cannot extract palette from " + source);
+    return fail();
+  }
+  std::vector<Color> colors = extractPalette(image, 16);
+  if (colors.empty()) {
+    return fail();
+  }
+
+  std::string absPath = fs::absolute(wallpaperPath).string();
+  auto quote = [](const std::string &value) {
+    std::string quoted = "'";
+    for (char c : value) {
+      quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+  };
+
+  json special = {{"background", colors.front().hex()},
+                  {"foreground", colors.back().hex()},
+                  {"cursor", colors.back().hex()}};
+  json named = json::object();
+  std::string shell = "wallpaper=" + quote(absPath) + "\n" +
+                      "background='" + colors.front().hex() + "'\n" +
+                      "foreground='" + colors.back().hex() + "'\n" +
+                      "cursor='" + colors.back().hex() + "'\n";
+  for (size_t i = 0; i < colors.size(); ++i) {
+    std::string name = "color" + std::to_string(i);
+    named[name] = colors[i].hex();
+    shell += name + "='" + colors[i].hex() + "'\n";
+  }
+  json palette = {{"wallpaper", absPath},
+                  {"alpha", "100"},
+                  {"special", std::move(special)},
+                  {"colors", std::move(named)}};
+
+  if (!writeFileAtomic(WART_COLORS, palette.dump(4) + "\n") ||
+      !writeFileAtomic(WART_COLORS_SH, shell)) {
+    LOG_ERROR("Failed to write palette");
+    return fail();
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  logMessage(LogLevel::INFO, "Palette extracted in " +
+                                 std::to_string(elapsed.count()) + " ms");
+  return true;
+}
+
+// Execute configured hooks, independent ones concurrently
+void executeHooks(const Config &config, const std::string &wallpaperPath) {
+  std::optional<SessionType> session = detectSession();
+  if (!session) {
+    return;
+  }
+
+  const auto &hooks = config.commandsFor(*session).hooks;
+  if (hooks.empty()) {
+    return;
+  }
+
+  std::string absPath = fs::absolute(wallpaperPath).string();
+  for (const auto &cmd : hooks) {
+    logMessage(LogLevel::INFO, "Executing hook: " + cmd);
+  }
+
+  ProcessExecutor executor =
+      makeExecutor(config, static_cast<size_t>(config.hookjobs));
+  if (config.palette && fs::exists(WART_COLORS)) {
+    executor.setEnv("WARTCOLORS", WART_COLORS);
+  }
+  for (const auto &result : executor.run(hooks, absPath)) {
+    reportResult("Hook", result);
+  }
+}
+
+// Preview wallpaper with configured previewer
+bool previewWallpaper(const Config &config) {
+  FetchClient client;
+  ProviderSet providers;
+  FetchState state;
+  WallpaperStore store;
+  providers.configure(config);
+  loadFetchState(WART_STATE, state);
+  if (store.load() && fetchWallpaper(config, client, providers, state,
+                                     store) != FetchResult::Failed) {
+    std::string wallpaperPath = WART_HOME + "wallpaper." + config.format;
+
+    std::optional<SessionType> session = detectSession();
+    if (!session) {
+      return false;
+    }
+
+    // First configured previewer for this session
+    const auto &previewers = config.commandsFor(*session).previewers;
+    std::string previewerCmd = previewers.empty() ? "" : previewers.front();
+
+    if (previewerCmd.empty()) {
+      // Fallback to default previewers if none specified
+      const char *candidates[] = {"feh", "eog"};
+      if (*session == SessionType::Wayland) {
+        candidates[0] = "imv";
+        candidates[1] = "swayimg";
+      }
+      for (const char *candidate : candidates) {
+        if (!findExecutable(candidate).empty()) {
+          previewerCmd = candidate;
+          break;
+        }
+      }
+
+      if (previewerCmd.empty()) {
+        previewerCmd = "xdg-open";
+      }
+    }
+
+    // Previewers are interactive, so no timeout
+    std::string absPath = fs::absolute(wallpaperPath).string();
+    logMessage(LogLevel::INFO, "Previewing with: " + previewerCmd);
+    ProcessExecutor executor(1, std::chrono::milliseconds::zero());
+    return reportResult("Previewer",
+                        executor.run({previewerCmd}, absPath, true).front());
+  }
+  return false;
+}
+
+// Update config parameter
+void updateConfigParameter(const std::string &paramName,
+                           const std::string &value) {
+  const Setting *setting = findSetting(paramName);
+  if (!setting || !checkSetting(*setting, value)) {
+    LOG_ERROR("Invalid " + paramName + ": " + value);
+    return;
+  }
+
+  std::vector<std::string> lines;
+  lines.reserve(20); // Reserve space to avoid reallocations
+  std::ifstream file(WART_CONFIG);
+  std::string line;
+  bool paramFound = false;
+
+  while (std::getline(file, line)) {
+    if (!line.empty() && line[0] != '#') { // Skip comments
+      std::istringstream iss(line);
+      std::string key;
+      iss >> key;
+
+      if (key == paramName) {
+        lines.push_back(paramName + " " + value);
+        paramFound = true;
+        continue;
+      }
+    }
+    lines.push_back(line);
+  }
+
+  // Add parameter if not found
+  if (!paramFound) {
+    lines.push_back(paramName + " " + value);
+  }
+
+  std::ofstream outFile(WART_CONFIG);
+  for (const auto &l : lines) {
+    outFile << l << "\n";
+  }
+
+  logMessage(LogLevel::INFO, "Updated " + paramName + " to " + value);
+}
+
+// Format a Unix time as local date and time
+static std::string formatTime(int64_t seconds) {
+  std::time_t time = static_cast<std::time_t>(seconds);
+  std::tm local{};
+  localtime_r(&time, &local);
+  char buffer[32];
+  std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &local);
+  return buffer;
+}
+
+// List applied wallpapers, most recent first, from the history index
+void showHistory() {
+  HistoryIndex history(WART_HISTORY);
+  if (!history.open()) {
+    return;
+  }
+  if (history.size() == 0) {
+    std::cout << "No wallpaper history yet." << std::endl;
+    return;
+  }
+
+  uint64_t downloaded = 0;
+  for (size_t n = 0; n < history.size(); ++n) {
+    const HistoryRecord *record = history.at(n);
+    downloaded += record->bytesDownloaded;
+
+    std::cout << std::setw(4) << n << "  " << formatTime(record->fetchedAt)
+              << "  " << std::setw(9)
+              << (std::to_string(record->width) + "x" +
+                  std::to_string(record->height))
+              << "  " << std::setw(5) << record->extView() << "  "
+              << std::setw(6) << (record->size >> 10) << " KiB  "
+              << record->copyrightView() << std::endl;
+  }
+  std::cout << history.size() << " wallpapers, " << std::fixed
+            << std::setprecision(1)
+            << static_cast<double>(downloaded) / (1 << 20)
+            << " MiB downloaded" << std::endl;
+}
+
+// Display status information
+void showStatus() {
+  Config config;
+  if (!loadConfig(WART_CONFIG, config)) {
+    LOG_ERROR("Failed to load configuration");
+    return;
+  }
+
+  std::string wallpaperPath = WART_HOME + "wallpaper." + config.format;
+
+  if (!fs::exists(wallpaperPath)) {
+    std::cout << "No wallpaper has been downloaded yet." << std::endl;
+    return;
+  }
+
+  std::cout << "Current configuration:" << std::endl;
+  std::cout << "Resolution: " << config.resolution << std::endl;
+  std::cout << "Format: " << config.format << std::endl;
+  std::cout << "Schedule: " << config.schedule << std::endl;
+  std::cout << "Interval: " << config.interval << " seconds" << std::endl;
+
+  WallpaperStore store;
+  if (store.load()) {
+    std::cout << "Store: " << store.count() << " images, " << store.bytes()
+              << " bytes" << std::endl;
+  }
+
+  // Show wallpaper file info
+  std::cout << "Current wallpaper: " << wallpaperPath << std::endl;
+  std::cout << "Size: " << fs::file_size(wallpaperPath) << " bytes"
+            << std::endl;
+  auto ftime = fs::last_write_time(wallpaperPath);
+  auto sctp = std::chrono::file_clock::to_sys(ftime);
+  auto time = std::chrono::system_clock::to_time_t(sctp);
+  std::cout << "Last updated: " << std::ctime(&time);
+
+  // What the API said about the most recent one, without opening it
+  HistoryIndex history(WART_HISTORY);
+  if (history.open() && history.size() > 0) {
+    const HistoryRecord *record = history.at(0);
+    std::cout << "Latest: " << record->copyrightView() << std::endl;
+    std::cout << "Image: " << record->width << "x" << record->height << " "
+              << record->extView() << ", shown from "
+              << record->startDateView() << " to " << record->endDateView()
+              << std::endl;
+    std::cout << "Fetch time: " << record->metadataMs << " ms metadata, "
+              << record->downloadMs << " ms download, " << record->deriveMs
+              << " ms derive" << std::endl;
+  }
+}
+
+// Event loop
+EventLoop::EventLoop() {
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+
+#ifdef __linux__
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  signalFd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+
+  for (int fd : {timerFd, signalFd}) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (fd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      LOG_ERROR("Failed to set up event loop");
+    }
+  }
+#endif
+}
+
+EventLoop::~EventLoop() {
+#ifdef __linux__
+  for (int fd : {signalFd, timerFd, epollFd}) {
+    if (fd >= 0)
+      close(fd);
+  }
+#endif
+}
+
+bool EventLoop::valid() const {
+#ifdef __linux__
+  return epollFd >= 0 && timerFd >= 0 && signalFd >= 0;
+#else
+  return true;
+#endif
+}
+
+void EventLoop::setTimerSlack(std::chrono::milliseconds slack) {
+#ifdef __linux__
+  if (slack.count() > 0) {
+    prctl(PR_SET_TIMERSLACK,
+          static_cast<unsigned long>(slack.count()) * 1000000UL);
+  }
+#else
+  (void)slack;
+#endif
+}
+
+void EventLoop::watch(int fd, std::function<void()> onReadable) {
+#ifdef __linux__
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    LOG_ERROR("Failed to watch descriptor");
+    return;
+  }
+#endif
+  watches[fd] = std::move(onReadable);
+}
+
+void EventLoop::unwatch(int fd) {
+#ifdef __linux__
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+  watches.erase(fd);
+  writers.erase(fd);
+}
+
+void EventLoop::setWriting(int fd, bool writing) {
+  if (watches.count(fd) == 0 || (writers.count(fd) != 0) == writing) {
+    return;
+  }
+#ifdef __linux__
+  epoll_event ev{};
+  ev.events = writing ? EPOLLOUT : EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+    LOG_ERROR("Failed to watch descriptor");
+    return;
+  }
+#endif
+  if (writing) {
+    writers.insert(fd);
+  } else {
+    writers.erase(fd);
+  }
+}
+
+void EventLoop::dispatch(int fd) {
+  auto it = watches.find(fd);
+  if (it != watches.end()) {
+    // Copy, the callback may unwatch itself
+    auto onReadable = it->second;
+    onReadable();
+  }
+}
+
+bool EventLoop::wait(std::chrono::milliseconds delay) {
+  // Signals are only blocked while waiting so that children started by the
+  // cycle inherit a normal mask; the handlers still cover the rest
+  sigset_t previous;
+  sigprocmask(SIG_BLOCK, &signals, &previous);
+  bool expired = running && waitBlocked(delay, previous);
+  sigprocmask(SIG_SETMASK, &previous, nullptr);
+  return expired && running;
+}
+
+#ifdef __linux__
+bool EventLoop::waitBlocked(std::chrono::milliseconds delay,
+                            const sigset_t &) {
+  // A zero it_value disarms the timer, so round up to one nanosecond
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(delay);
+  itimerspec spec{};
+  spec.it_value.tv_sec = static_cast<time_t>(ns.count() / 1000000000);
+  spec.it_value.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+  if (ns.count() <= 0) {
+    spec.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timerFd, 0, &spec, nullptr) != 0) {
+    LOG_ERROR("Failed to arm timer");
+    return false;
+  }
+
+  epoll_event events[32];
+  while (true) {
+    int n = epoll_wait(epollFd, events, 32, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG_ERROR("epoll_wait failed");
+      return false;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.fd == signalFd) {
+        signalfd_siginfo info;
+        while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+          running = false;
+        }
+        return false;
+      }
+      if (events[i].data.fd == timerFd) {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+          return true;
+        }
+        continue;
+      }
+      dispatch(events[i].data.fd);
+    }
+    if (interrupted) {
+      interrupted = false;
+      return true;
+    }
+  }
+}
+#else
+bool EventLoop::waitBlocked(std::chrono::milliseconds delay,
+                            const sigset_t &previous) {
+  // pselect atomically restores the previous mask, so a signal can only
+  // be handled while we are actually asleep
+  auto deadline = std::chrono::steady_clock::now() + delay;
+  while (running) {
+    auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0) {
+      return true;
+    }
+
+    fd_set readable;
+    fd_set writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    int maxFd = -1;
+    for (const auto &[fd, onReadable] : watches) {
+      FD_SET(fd, writers.count(fd) ? &writable : &readable);
+      maxFd = std::max(maxFd, fd);
+    }
+
+    timespec ts{};
+    ts.tv_sec = static_cast<time_t>(remaining.count() / 1000000000);
+    ts.tv_nsec = static_cast<long>(remaining.count() % 1000000000);
+    int n = pselect(maxFd + 1, &readable, &writable, nullptr, &ts, &previous);
+    if (n < 0 && errno != EINTR) {
+      LOG_ERROR("pselect failed");
+      return false;
+    }
+
+    for (int fd = 0; n > 0 && fd <= maxFd; ++fd) {
+      if (FD_ISSET(fd, &readable) || FD_ISSET(fd, &writable)) {
+        dispatch(fd);
+      }
+    }
+    if (interrupted) {
+      interrupted = false;
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+// Config watcher
+ConfigWatcher::ConfigWatcher(EventLoop &eventLoop, ConfigHandle &configHandle)
+    : loop(eventLoop), handle(configHandle) {
+#ifdef __linux__
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, WART_HOME.c_str(),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    logMessage(LogLevel::WARNING,
+               "Cannot watch config file, changes need a restart");
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    return;
+  }
+  loop.watch(fd, [this] { onReadable(); });
+#endif
+}
+
+ConfigWatcher::~ConfigWatcher() {
+  if (fd >= 0) {
+    loop.unwatch(fd);
+    close(fd);
+  }
+}
+
+void ConfigWatcher::onReadable() {
+#ifdef __linux__
+  const std::string configName = fs::path(WART_CONFIG).filename().string();
+  bool changed = false;
+
+  alignas(inotify_event) char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *ptr = buf; ptr < buf + len;) {
+      auto *event = reinterpret_cast<inotify_event *>(ptr);
+      if (event->len > 0 && configName == event->name) {
+        changed = true;
+      }
+      ptr += sizeof(inotify_event) + event->len;
+    }
+  }
+
+  if (changed) {
+    reloadConfig(handle);
+  }
+#endif
+}
+
+// Control socket
+static sockaddr_un controlAddress(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+// A whole non-negative decimal number
+static bool parseCount(std::string_view text, size_t &n) {
+  auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), n);
+  return ec == std::errc() && ptr == text.data() + text.size() &&
+         !text.empty();
+}
+
+// Bound the time a peer can stall the other side
+static void setSocketTimeout(int fd, std::chrono::milliseconds timeout) {
+  timeval tv{};
+  tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+  tv.tv_usec = static_cast<suseconds_t>((timeout.count() % 1000) * 1000);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool sendAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data.remove_prefix(static_cast<size_t>(n));
+  }
+  return true;
+}
+
+// One connection to the control socket: its request line as it arrives,
+// then the reply as it goes out
+struct ControlServer::Client {
+  int fd = -1;
+  std::string input;
+  std::string output;
+  size_t sent = 0;
+  bool waiting = false;  // For the handler's reply, unwatched meanwhile
+  bool handling = false; // Inside the handler, the reply is sent after it
+  uint64_t request = 0;
+  std::chrono::steady_clock::time_point since;
+};
+
+// Beyond this many clients the one that has waited longest without
+// finishing its request line is dropped for a new one
+constexpr size_t MAX_CONTROL_CLIENTS = 64;
+constexpr size_t MAX_CONTROL_REQUEST = 4096;
+
+ControlServer::ControlServer(EventLoop &eventLoop, Handler onRequest,
+                             std::string socketPath, bool anyUser)
+    : loop(eventLoop), handler(std::move(onRequest)),
+      path(std::move(socketPath)), shared(anyUser) {
+  sockaddr_un addr = controlAddress(path);
+  if (path.size() >= sizeof(addr.sun_path)) {
+    logMessage(LogLevel::WARNING, "Control socket path too long");
+    return;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    logMessage(LogLevel::WARNING, "Cannot create control socket");
+    return;
+  }
+
+  // Holding the lock means any socket left behind is stale
+  unlink(path.c_str());
+  mode_t mask = umask(shared ? 0 : 077);
+  bool bound =
+      bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(fd, shared ? 64 : 8) != 0) {
+    logMessage(LogLevel::WARNING,
+               "Cannot listen on " + path +
+                   ", commands will not reach the daemon");
+    close(fd);
+    fd = -1;
+    return;
+  }
+  loop.watch(fd, [this] { onAccept(); });
+}
+
+ControlServer::~ControlServer() {
+  while (!clients.empty()) {
+    closeClient(clients.begin()->first);
+  }
+  if (fd >= 0) {
+    loop.unwatch(fd);
+    close(fd);
+    unlink(path.c_str());
+  }
+}
+
+void ControlServer::onAccept() {
+  int client;
+  while ((client = accept4(fd, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+#ifdef __linux__
+    ucred peer{};
+    socklen_t length = sizeof(peer);
+    if (!shared &&
+        (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+         peer.uid != getuid())) {
+      close(client);
+      continue;
+    }
+#endif
+
+    if (clients.size() >= MAX_CONTROL_CLIENTS) {
+      auto oldest = clients.end();
+      for (auto it = clients.begin(); it != clients.end(); ++it) {
+        if (!it->second->waiting && it->second->output.empty() &&
+            (oldest == clients.end() ||
+             it->second->since < oldest->second->since)) {
+          oldest = it;
+        }
+      }
+      if (oldest == clients.end()) {
+        close(client);
+        continue;
+      }
+      closeClient(oldest->first);
+    }
+
+    auto connection = std::make_unique<Client>();
+    connection->fd = client;
+    connection->since = std::chrono::steady_clock::now();
+    clients[client] = std::move(connection);
+    loop.watch(client, [this, client] { onClient(client); });
+  }
+}
+
+void ControlServer::onClient(int client) {
+  auto it = clients.find(client);
+  if (it == clients.end()) {
+    return;
+  }
+  Client &connection = *it->second;
+  if (!connection.output.empty()) {
+    flush(connection);
+    return;
+  }
+
+  // One short line, usually all in the first read. The end of input also
+  // ends the request, as does running past its limit.
+  char buf[512];
+  bool complete = false;
+  while (!complete) {
+    ssize_t n = recv(client, buf, sizeof(buf), 0);
+    if (n > 0) {
+      connection.input.append(buf, static_cast<size_t>(n));
+      complete = connection.input.find('\n') != std::string::npos ||
+                 connection.input.size() >= MAX_CONTROL_REQUEST;
+    } else if (n == 0) {
+      complete = true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      closeClient(client);
+      return;
+    }
+  }
+  dispatch(connection);
+}
+
+void ControlServer::dispatch(Client &connection) {
+  std::string request =
+      connection.input.substr(0, connection.input.find('\n'));
+  std::vector<std::string> args;
+  std::istringstream words(request);
+  for (std::string word; words >> word;) {
+    args.push_back(word);
+  }
+
+  int client = connection.fd;
+  uint64_t id = ++requests;
+  connection.request = id;
+  connection.waiting = true;
+  connection.handling = true;
+  Reply reply = [this, client, id](ControlReply answer) {
+    auto it = clients.find(client);
+    if (it == clients.end() || it->second->request != id ||
+        !it->second->waiting) {
+      return;
+    }
+    Client &parked = *it->second;
+    parked.waiting = false;
+    parked.output = (answer.ok ? "ok\n" : "error\n") + answer.body;
+    if (!parked.handling) {
+      loop.watch(client, [this, client] { onClient(client); });
+      flush(parked);
+    }
+  };
+  if (args.empty()) {
+    reply({false, "Empty request\n"});
+  } else {
+    handler(args, std::move(reply));
+  }
+  connection.handling = false;
+
+  // Nothing more is read until the reply comes, which also keeps a
+  // half-closed socket from waking the loop over and over
+  if (connection.waiting) {
+    loop.unwatch(client);
+  } else {
+    flush(connection);
+  }
+}
+
+// Send what the socket takes, parking until it is writable for the rest
+void ControlServer::flush(Client &connection) {
+  int client = connection.fd;
+  while (connection.sent < connection.output.size()) {
+    ssize_t n = send(client, connection.output.data() + connection.sent,
+                     connection.output.size() - connection.sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      connection.sent += static_cast<size_t>(n);
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      loop.setWriting(client, true);
+      return;
+    } else if (n == 0 || errno != EINTR) {
+      break;
+    }
+  }
+  closeClient(client);
+}
+
+void ControlServer::closeClient(int client) {
+  loop.unwatch(client);
+  close(client);
+  clients.erase(client);
+}
+
+bool sendControlRequest(const std::vector<std::string> &args,
+                        ControlReply &reply, const std::string &socketPath) {
+  sockaddr_un addr = controlAddress(socketPath);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return false;
+  }
+
+  // Applying a wallpaper can take the daemon a while
+  setSocketTimeout(fd, std::chrono::milliseconds(30000));
+
+  std::string request;
+  for (const auto &arg : args) {
+    request += (request.empty() ? "" : " ") + arg;
+  }
+  request += '\n';
+
+  std::string response;
+  if (sendAll(fd, request)) {
+    shutdown(fd, SHUT_WR);
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      response.append(buf, static_cast<size_t>(n));
+    }
+  }
+  close(fd);
+
+  size_t newline = response.find('\n');
+  if (newline == std::string::npos) {
+    reply = {false, "No answer from the running wart\n", false};
+    return true;
+  }
+  reply.ok = response.compare(0, newline, "ok") == 0;
+  reply.body = response.substr(newline + 1);
+  return true;
+}
+
+// While the upstream is unavailable keep showing the stored wallpaper,
+// relinking it if the file has gone missing
+static bool useCachedWallpaper(WallpaperStore &store, const FetchState &state,
+                               const std::string &path) {
+  if (path != state.imagePath) {
+    return false; // Stored in another format
+  }
+  if (fs::exists(path)) {
+    return true;
+  }
+  const StoreEntry *entry = store.find(state.imageHash);
+  if (!entry || !store.link(entry->hash, path)) {
+    return false;
+  }
+  store.save();
+  return true;
+}
+
+// Unix time a YYYYMMDD date reaches HH:MM UTC
+static bool parsePublishTime(std::string_view date, const std::string &clock,
+                             std::time_t &when) {
+  int year = 0, month = 0, day = 0, minutes = 0;
+  if (date.size() != 8 || !parseClockTime(clock, minutes)) {
+    return false;
+  }
+  auto field = [&](size_t pos, size_t len, int &out) {
+    auto [ptr, ec] =
+        std::from_chars(date.data() + pos, date.data() + pos + len, out);
+    return ec == std::errc() && ptr == date.data() + pos + len;
+  };
+  if (!field(0, 4, year) || !field(4, 2, month) || !field(6, 2, day) ||
+      month < 1 || month > 12 || day < 1 || day > 31) {
+    return false;
+  }
+
+  std::tm utc{};
+  utc.tm_year = year - 1900;
+  utc.tm_mon = month - 1;
+  utc.tm_mday = day;
+  utc.tm_min = minutes;
+  when = timegm(&utc);
+  return when != static_cast<std::time_t>(-1);
+}
+
+// Time until the current image is replaced, from its end date. Nothing if
+// the dates are missing or make no sense for a daily image.
+static std::optional<std::chrono::seconds>
+untilPublished(const Config &config, const FetchState &state) {
+  std::time_t endsAt;
+  if (!parsePublishTime(state.endDate, config.publishtime,
+                        endsAt)) {
+    return std::nullopt;
+  }
+
+  // A fixed skew per machine, so a fleet does not fetch in the same second
+  auto skew = hostPhase(std::chrono::seconds(config.skew));
+  auto until = std::chrono::seconds(endsAt - std::time(nullptr)) + skew;
+  if (until > std::chrono::hours(48) || until < -std::chrono::hours(24)) {
+    return std::nullopt;
+  }
+
+  // The new image is late, look again soon rather than in a day
+  constexpr std::chrono::seconds LATE_RECHECK(900);
+  return until > std::chrono::seconds(0) ? until : LATE_RECHECK;
+}
+
+// Time until the next cycle. On the enddate schedule that is when the next
+// image comes out. With splay, interval cycles fall on this host's own
+// offset within the interval instead of wherever the daemon started, so a
+// fleet restarted together does not keep fetching together.
+static std::chrono::seconds untilNextCycle(const Config &config, int interval,
+                                           const FetchState &state) {
+  std::chrono::seconds period(interval);
+  if (config.schedule == "enddate") {
+    if (auto until = untilPublished(config, state)) {
+      return *until;
+    }
+    logMessage(LogLevel::INFO, "No usable end date, using the interval");
+  }
+  if (!config.splay) {
+    return period;
+  }
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  return period - (now - hostPhase(period)) % period;
+}
+
+// Main wallpaper update loop
+void wartLoop(ConfigHandle &configHandle) {
+  signal(SIGINT, [](int) { running = false; });
+  signal(SIGTERM, [](int) { running = false; });
+
+  EventLoop loop;
+  if (!loop.valid()) {
+    return;
+  }
+
+  // Picks up edits to wartrc while the loop is waiting
+  ConfigWatcher watcher(loop, configHandle);
+
+  // One client for the lifetime of the daemon so connections, DNS and TLS
+  // sessions survive across retries and intervals
+  FetchClient client;
+  if (!client.valid()) {
+    return;
+  }
+
+  // Latency stats outlive reloads for the mirrors that stay configured
+  ProviderSet providers;
+
+  FetchState state;
+  loadFetchState(WART_STATE, state);
+
+  WallpaperStore store;
+  if (!store.load()) {
+    return;
+  }
+
+  // The first cycle always applies, the desktop may have been restarted
+  bool applied = false;
+
+  // Failed fetches back off with jitter, and once the upstream keeps
+  // failing cycles stop asking it until a probe gets through
+  constexpr std::chrono::milliseconds RETRY_BASE(2000);
+  CircuitBreaker breaker(5, std::chrono::seconds(1800));
+
+  // Driven through the control socket
+  bool paused = false;
+  bool forceCycle = false;
+  std::string lastResult = "none yet";
+  std::time_t lastCycle = 0;
+  auto nextCycle = std::chrono::steady_clock::now();
+
+  auto handleCommand = [&](const std::vector<std::string> &args) {
+    const std::string &command = args[0];
+    if (command == "status") {
+      std::ostringstream out;
+      out << "Wart " << VERSION << ", pid " << getpid() << ", "
+          << (paused ? "paused" : "running") << "\n";
+      out << "Current wallpaper: " << state.imagePath << "\n";
+      if (!state.copyright.empty()) {
+        out << "Title: " << state.copyright << "\n";
+        out << "Shown from " << state.startDate << " to " << state.endDate
+            << "\n";
+      }
+      if (lastCycle != 0) {
+        auto next = std::chrono::duration_cast<std::chrono::seconds>(
+            nextCycle - std::chrono::steady_clock::now());
+        out << "Last cycle: " << formatTime(lastCycle) << ", " << lastResult
+            << "; next in " << std::max<long long>(next.count(), 0)
+            << " seconds\n";
+      }
+      if (breaker.state() == CircuitBreaker::State::Closed) {
+        out << "Upstream: healthy\n";
+      } else {
+        auto probe = std::chrono::duration_cast<std::chrono::seconds>(
+            breaker.reopensAt() - std::chrono::steady_clock::now());
+        out << "Upstream: failing, next try in at least "
+            << std::max<long long>(probe.count(), 0) << " seconds\n";
+      }
+      for (const auto &provider : providers.all()) {
+        const LatencyStats &stats = provider->stats();
+        out << "Provider " << provider->name() << ": " << stats.successes()
+            << " ok, " << stats.failures() << " failed";
+        if (auto p50 = stats.percentile(0.5)) {
+          out << ", p50 " << p50->count() << " ms, p95 "
+              << stats.percentile(0.95)->count() << " ms";
+        }
+        out << "\n";
+      }
+      out << "Store: " << store.count() << " images, " << store.bytes()
+          << " bytes\n";
+      out << "Connections: " << client.reusedConnections() << " reused, "
+          << client.freshConnections() << " new\n";
+      return ControlReply{true, out.str()};
+    }
+    if (command == "next") {
+      forceCycle = true;
+      loop.interrupt();
+      return ControlReply{true, "Fetching a new wallpaper now\n"};
+    }
+    if (command == "pause") {
+      paused = true;
+      return ControlReply{true, "Paused, the wallpaper stays as it is\n"};
+    }
+    if (command == "resume") {
+      paused = false;
+      loop.interrupt();
+      return ControlReply{true, "Resumed\n"};
+    }
+    if (command == "reload") {
+      return reloadConfig(configHandle)
+                 ? ControlReply{true, "Configuration reloaded\n"}
+                 : ControlReply{false, "Invalid config, keeping the current "
+                                       "one\n"};
+    }
+    if (command == "metrics") {
+      return ControlReply{true, Metrics::instance().render()};
+    }
+    if (command == "restore") {
+      std::shared_ptr<const Config> current = configHandle.get();
+      size_t n = 1;
+      bool restored = false;
+      if (args.size() == 3 && args[1] == "--steps" && parseCount(args[2], n)) {
+        restored = restorePreviousWallpaper(*current, store, n);
+      } else if (args.size() == 2 && parseCount(args[1], n)) {
+        restored = restoreFromHistory(*current, store, n);
+      } else if (args.size() == 1) {
+        restored = restorePreviousWallpaper(*current, store, 1);
+      } else {
+        return ControlReply{false, "Usage: restore [--steps <k> | <n>]\n"};
+      }
+      return restored ? ControlReply{true, "Wallpaper restored\n"}
+                      : ControlReply{false, "Restore failed, see " +
+                                                WART_LOG + "\n"};
+    }
+    return ControlReply{false, "Unknown command: " + command + "\n"};
+  };
+  ControlServer control(loop, [&](const std::vector<std::string> &args,
+                                  ControlServer::Reply reply) {
+    reply(handleCommand(args));
+  });
+
+  while (running) {
+    // One snapshot per cycle, a reload takes effect from the next one
+    std::shared_ptr<const Config> snapshot = configHandle.get();
+    const Config &config = *snapshot;
+    const int interval = config.interval;
+    loop.setTimerSlack(std::chrono::milliseconds(config.timerslack));
+
+    if (paused && !forceCycle) {
+      logMessage(LogLevel::INFO, "Paused, skipping this cycle");
+      auto untilNext = untilNextCycle(config, interval, state);
+      nextCycle = std::chrono::steady_clock::now() + untilNext;
+      loop.wait(untilNext);
+      continue;
+    }
+    forceCycle = false;
+
+    std::string wallpaperPath = WART_HOME + "wallpaper." + config.format;
+
+    providers.configure(config);
+
+    const int retries = config.retries;
+    const std::chrono::seconds retryMax(config.retrymax);
+    breaker.configure(retries, std::chrono::seconds(config.cooldown));
+
+    FetchResult result = FetchResult::Failed;
+    if (breaker.allow()) {
+      // A half-open circuit gets a single probe
+      int attempts =
+          breaker.state() == CircuitBreaker::State::HalfOpen ? 1 : retries;
+      Backoff backoff(RETRY_BASE, retryMax);
+      for (int attempt = 1;; ++attempt) {
+        result = fetchWallpaper(config, client, providers, state, store);
+        if (result != FetchResult::Failed) {
+          breaker.success();
+          break;
+        }
+        breaker.failure(client.retryAfter());
+        if (attempt >= attempts) {
+          break;
+        }
+
+        // Never before the circuit lets requests through again, and not
+        // at all within this cycle if that is too far off
+        auto delay = backoff.next();
+        if (breaker.state() == CircuitBreaker::State::Open) {
+          delay = std::max(delay, std::chrono::ceil<std::chrono::milliseconds>(
+                                      breaker.reopensAt() -
+                                      std::chrono::steady_clock::now()));
+        }
+        if (delay > retryMax) {
+          break;
+        }
+        logMessage(LogLevel::WARNING,
+                   "Attempt " + std::to_string(attempt) + " failed, retrying in " +
+                       std::to_string(delay.count()) + " ms");
+        if (!loop.wait(delay) || !breaker.allow()) {
+          break;
+        }
+      }
+    }
+
+    if (!running) {
+      break;
+    }
+
+    bool cached = false;
+    if (result == FetchResult::Failed &&
+        breaker.state() != CircuitBreaker::State::Closed) {
+      auto retry = std::chrono::duration_cast<std::chrono::seconds>(
+          breaker.reopensAt() - std::chrono::steady_clock::now());
+      logMessage(LogLevel::WARNING,
+                 "Upstream unavailable, not asking again for " +
+                     std::to_string(std::max<long long>(retry.count(), 0)) +
+                     " seconds");
+      if (useCachedWallpaper(store, state, wallpaperPath)) {
+        logMessage(LogLevel::INFO, "Keeping the cached wallpaper");
+        result = FetchResult::Unchanged;
+        cached = true;
+      }
+    }
+
+    cleanStore(config, store, state.imageHash);
+
+    logMessage(LogLevel::INFO,
+               "Connections: " + std::to_string(client.reusedConnections()) +
+                   " reused, " + std::to_string(client.freshConnections()) +
+                   " new");
+
+    lastCycle = std::time(nullptr);
+    lastResult = cached                            ? "cached"
+                 : result == FetchResult::Updated   ? "updated"
+                 : result == FetchResult::Unchanged ? "unchanged"
+                                                    : "failed";
+
+    Metrics &metrics = Metrics::instance();
+    metrics.add("wart_fetch_cycles_total",
+                "result=\"" + lastResult + "\"");
+    metrics.set("wart_store_images", "", static_cast<double>(store.count()));
+    metrics.set("wart_store_bytes", "", static_cast<double>(store.bytes()));
+
+    if (result == FetchResult::Unchanged && applied) {
+      logMessage(LogLevel::INFO, "Wallpaper unchanged, skipping apply");
+    } else if (result != FetchResult::Failed) {
+      if (setWallpaper(config, wallpaperPath,
+                       originalImage(store, state.imageHash, wallpaperPath))) {
+        logMessage(LogLevel::INFO, "Successfully set wallpaper");
+        if (config.palette) {
+          updatePalette(store, state.imageHash, wallpaperPath);
+        }
+        executeHooks(config, wallpaperPath);
+        applied = true;
+        metrics.set("wart_last_update_timestamp_seconds", "",
+                    static_cast<double>(std::time(nullptr)));
+      } else {
+        LOG_ERROR("Failed to set wallpaper");
+      }
+    } else {
+      LOG_ERROR("Failed to fetch wallpaper");
     }
 
-    curl_easy_cleanup(imgCurl);
+    metrics.writeTextfile(WART_METRICS);
+    if (std::string textfile = config.metricsfile; !textfile.empty()) {
+      metrics.writeTextfile(textfile);
+    }
 
-  } catch (const json::exception &e) {
-    LOG_ERROR(std::string("JSON parsing failed: ") + e.what());
-    curl_easy_cleanup(curl);
-    return false;
+    // Sleep for the configured interval, woken early by a signal or a
+    // control request
+    auto untilNext = untilNextCycle(config, interval, state);
+    logMessage(LogLevel::INFO, "Sleeping for " +
+                                   std::to_string(untilNext.count()) +
+                                   " seconds...");
+    nextCycle = std::chrono::steady_clock::now() + untilNext;
+    loop.wait(untilNext);
   }
 
-  curl_easy_cleanup(curl);
-  return true;
+  logMessage(LogLevel::INFO, "Shutting down gracefully");
 }
 
-// Set wallpaper using configured applier
-bool setWallpaper(const std::string &path) {
-  const char *sessionType = getenv("XDG_SESSION_TYPE");
-  if (!sessionType) {
-    LOG_ERROR("Could not detect session type");
-    return false;
+// Download an image into the store in one go
+static const StoreEntry *downloadToStore(FetchClient &client,
+                                         WallpaperStore &store,
+                                         const std::string &url,
+                                         const std::string &format) {
+  logMessage(LogLevel::INFO, "Downloading " + url);
+  ImageSink sink;
+  sink.path = store.directory() + "download." + format + ".part";
+  CURL *curl = client.prepare(url, 60L);
+  sink.curl = curl;
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeImageCallback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, static_cast<void *>(&sink));
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 15L);
+
+  CURLcode res = client.perform();
+  recordTransfer(curl, "image", res);
+  bool written = res == CURLE_OK && sink.finish(true);
+  std::error_code ec;
+  if (!written) {
+    LOG_ERROR("Failed to download image: " +
+              std::string(curl_easy_strerror(res)));
+    fs::remove(sink.path, ec);
+    return nullptr;
   }
 
-  std::string session(sessionType);
-  std::ifstream file(WART_CONFIG);
-  std::string line;
-  std::string applierCmd;
+  std::string ext = sniffImageFormat(sink.path);
+  const StoreEntry *entry = store.ingest(sink.path, sink.hash.value(),
+                                         ext.empty() ? format : ext, url);
+  if (!entry) {
+    fs::remove(sink.path, ec);
+  }
+  return entry;
+}
 
-  // Find appropriate applier
-  while (std::getline(file, line)) {
-    if (line.empty() || line[0] == '#')
-      continue;
+// How long a shared cache keeps an image it served, even over its budget
+constexpr std::chrono::minutes SERVED_GRACE(10);
 
-    if ((session == "x11" && line.starts_with("x11applier ")) ||
-        (session == "wayland" && line.starts_with("waylandapplier ")) ||
-        line.starts_with("applier ")) {
+// Today's image for one request to the API, as a shared cache knows it
+struct SharedImage {
+  FetchState state; // Metadata and its validators
+  std::chrono::steady_clock::time_point refreshAt;
+};
 
-      applierCmd = line.substr(line.find(' ') + 1);
-      break;
-    }
+// Pull-through cache of the providers' images behind the system daemon and
+// 'wart serve'. Metadata is asked for once per resolution, day and market
+// and kept until the next image is due, the same for every client; each
+// image is downloaded or derived once however many of them ask for it.
+class SharedCache {
+public:
+  SharedCache(const Config &cacheConfig, FetchClient &fetchClient,
+              ProviderSet &providerSet, WallpaperStore &imageStore)
+      : config(cacheConfig), client(fetchClient), providers(providerSet),
+        store(imageStore) {}
+
+  struct Image {
+    const FetchState *state = nullptr;
+    const StoreEntry *entry = nullptr;
+    bool original = true; // As downloaded, not derived here
+    std::chrono::steady_clock::time_point refreshAt; // Asks upstream again
+  };
+
+  // The image index days back in market at resolution, converted to
+  // format; with no format, the original as the provider serves it
+  bool get(const std::string &resolution, const std::string &format,
+           int index, const std::string &market, Image &image,
+           std::string &error);
+
+private:
+  const Config &config;
+  FetchClient &client;
+  ProviderSet &providers;
+  WallpaperStore &store;
+  std::unordered_map<std::string, SharedImage> images;
+};
+
+bool SharedCache::get(const std::string &resolution, const std::string &format,
+                      int index, const std::string &market, Image &image,
+                      std::string &error) {
+  Config request = config;
+  request.resolution = resolution;
+  request.format = format.empty() ? "jpg" : format;
+  if (format.empty()) {
+    request.derive = false;
+  }
+  std::string key = requestResolution(request);
+  if (index != 0 || market != "en-US") {
+    key += " " + market + " " + std::to_string(index);
   }
+  SharedImage &shared = images[key];
+  FetchState &state = shared.state;
 
-  if (applierCmd.empty()) {
-    // Fallback to default appliers if none specified
-    if (session == "wayland") {
-      applierCmd = "swww img";
-    } else if (session == "x11") {
-      applierCmd = "feh --bg-fill";
-    } else {
-      LOG_ERROR("No applier configured and no fallback available");
+  auto now = std::chrono::steady_clock::now();
+  if (state.imageUrl.empty() || now >= shared.refreshAt) {
+    auto response =
+        requestMetadata(request, client, providers, state, index, market);
+    WallpaperMetadata metadata;
+    if (response && response->responseCode != 304) {
+      if (!response->provider->parseMetadata(response->body.view(), metadata,
+                                             error) ||
+          metadata.url.empty()) {
+        LOG_ERROR("JSON parsing failed: " + (error.empty() ? "no url" : error));
+        response.reset();
+      } else {
+        state.imageUrl = std::move(metadata.url);
+        state.startDate = std::move(metadata.startDate);
+        state.endDate = std::move(metadata.endDate);
+        state.copyright = std::move(metadata.copyright);
+        state.metadataUrl = response->url;
+        state.metadataEtag = response->headers.etag;
+        state.metadataLastModified = response->headers.lastModified;
+      }
+    }
+
+    // While the providers fail, a stale image beats none
+    std::chrono::seconds ttl(60);
+    if (response) {
+      std::chrono::seconds interval(request.interval);
+      ttl = std::max(ttl, untilPublished(request, state).value_or(interval));
+    }
+    shared.refreshAt = now + ttl;
+    if (state.imageUrl.empty()) {
+      error = "No wallpaper data from any provider";
       return false;
     }
   }
 
-  // Replace $WARTPAPER with actual path
-  std::string absPath = fs::absolute(path).string();
-  size_t pos = applierCmd.find("$WARTPAPER");
-  while (pos != std::string::npos) {
-    applierCmd.replace(pos, 10, absPath);
-    pos = applierCmd.find("$WARTPAPER");
+  const StoreEntry *entry = store.findUrl(state.imageUrl);
+  if (!entry || !fs::exists(store.pathFor(*entry))) {
+    entry = downloadToStore(client, store, state.imageUrl,
+                            request.format);
+    if (!entry) {
+      error = "Failed to download " + state.imageUrl;
+      return false;
+    }
   }
 
-  if (applierCmd.find("$WARTPAPER") == std::string::npos) {
-    applierCmd += " " + absPath; // Append path if $WARTPAPER not in command
+  image.original = true;
+  std::string localResolution = deriveEnabled(request) ? resolution : "";
+  if (!format.empty() && (!localResolution.empty() ||
+                          sniffImageFormat(store.pathFor(*entry)) != format)) {
+    if (const StoreEntry *derived =
+            deriveVariant(store, *entry, localResolution, format,
+                          request.quality)) {
+      entry = derived;
+      image.original = false;
+    }
   }
+  // Whoever was just told about an image still has to fetch or ingest it,
+  // so a burst of other variants must not evict it under them
+  store.touch(entry->hash);
+  store.evict(static_cast<size_t>(config.storecount),
+              static_cast<uintmax_t>(config.storesize) << 20,
+              entry->hash, SERVED_GRACE);
+  store.save();
 
-  logMessage(LogLevel::INFO, "Setting wallpaper with: " + applierCmd);
-  return system(applierCmd.c_str()) == 0;
+  image.state = &state;
+  image.entry = entry;
+  image.refreshAt = shared.refreshAt;
+  return true;
 }
 
-// Execute configured hooks
-void executeHooks(const std::string &wallpaperPath) {
-  std::ifstream file(WART_CONFIG);
-  std::string line;
-  const char *sessionType = getenv("XDG_SESSION_TYPE");
+// One thread running blocking jobs in order, each followed by its
+// completion on the event loop's thread, which a pipe wakes up
+class BackgroundWorker {
+public:
+  explicit BackgroundWorker(EventLoop &eventLoop);
+  ~BackgroundWorker();
 
-  if (!sessionType) {
-    LOG_ERROR("Could not detect session type");
-    return;
-  }
+  BackgroundWorker(const BackgroundWorker &) = delete;
+  BackgroundWorker &operator=(const BackgroundWorker &) = delete;
 
-  std::string session(sessionType);
-  std::string absPath = fs::absolute(wallpaperPath).string();
+  bool valid() const { return wake[1] >= 0; }
 
-  while (std::getline(file, line)) {
-    if (line.empty() || line[0] == '#')
-      continue;
+  // Call work on the worker thread, then done from the loop
+  void run(std::function<void()> work, std::function<void()> done);
 
-    if ((session == "x11" && line.starts_with("x11hooks ")) ||
-        (session == "wayland" && line.starts_with("waylandhooks ")) ||
-        line.starts_with("hooks ")) {
+private:
+  struct Job {
+    std::function<void()> work;
+    std::function<void()> done;
+  };
 
-      // Extract the command part
-      std::string cmd = line.substr(line.find(' ') + 1);
+  void process();
+  void complete();
 
-      // Replace $WARTPAPER with actual path
-      size_t pos = cmd.find("$WARTPAPER");
-      while (pos != std::string::npos) {
-        cmd.replace(pos, 10, absPath);
-        pos = cmd.find("$WARTPAPER");
-      }
+  EventLoop &loop;
+  int wake[2] = {-1, -1};
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<Job> jobs;
+  std::vector<std::function<void()>> finished;
+  bool stopping = false;
+  std::thread worker;
+};
 
-      logMessage(LogLevel::INFO, "Executing hook: " + cmd);
-      if (system(cmd.c_str()) != 0) {
-        logMessage(LogLevel::ERROR, "Hook failed: " + cmd);
-      }
-    }
+BackgroundWorker::BackgroundWorker(EventLoop &eventLoop) : loop(eventLoop) {
+  if (pipe(wake) != 0) {
+    LOG_ERROR("Failed to create worker pipe");
+    wake[0] = wake[1] = -1;
+    return;
   }
+  for (int fd : wake) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  loop.watch(wake[0], [this] { complete(); });
+
+  // SIGINT and SIGTERM are for the loop's thread to take
+  sigset_t signals;
+  sigset_t previous;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  worker = std::thread(&BackgroundWorker::process, this);
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
 }
 
-// Preview wallpaper with configured previewer
-bool previewWallpaper(const Config &config) {
-  if (fetchWallpaper(config)) {
-    std::string wallpaperPath = WART_HOME + "wallpaper." + config.get("format");
+BackgroundWorker::~BackgroundWorker() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_one();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  if (wake[0] >= 0) {
+    loop.unwatch(wake[0]);
+    close(wake[0]);
+    close(wake[1]);
+  }
+}
 
-    const char *sessionType = getenv("XDG_SESSION_TYPE");
-    if (!sessionType) {
-      LOG_ERROR("Could not detect session type");
-      return false;
+void BackgroundWorker::run(std::function<void()> work,
+                           std::function<void()> done) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobs.push_back({std::move(work), std::move(done)});
+  }
+  ready.notify_one();
+}
+
+void BackgroundWorker::process() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+    if (stopping) {
+      return;
     }
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    guard.unlock();
+    job.work();
+    guard.lock();
+    finished.push_back(std::move(job.done));
 
-    std::string session(sessionType);
-    std::ifstream file(WART_CONFIG);
-    std::string line;
-    std::string previewerCmd;
+    // A full pipe already has a wakeup pending
+    char byte = 0;
+    if (write(wake[1], &byte, 1) < 0 && errno != EAGAIN) {
+      LOG_ERROR("Failed to wake the event loop");
+    }
+  }
+}
 
-    // Find appropriate previewer
-    while (std::getline(file, line)) {
-      if (line.empty() || line[0] == '#')
-        continue;
+void BackgroundWorker::complete() {
+  char buffer[64];
+  while (read(wake[0], buffer, sizeof(buffer)) > 0) {
+  }
+  std::vector<std::function<void()>> done;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done.swap(finished);
+  }
+  for (auto &callback : done) {
+    callback();
+  }
+}
 
-      if ((session == "x11" && line.starts_with("x11previewer ")) ||
-          (session == "wayland" && line.starts_with("waylandpreviewer ")) ||
-          line.starts_with("previewer ")) {
+// One SharedCache lookup as the event loop keeps it, copied out on the
+// worker thread with everything a reply needs
+struct SharedAnswer {
+  bool ok = false;
+  std::string error;
+  std::string url;
+  std::string startDate;
+  std::string endDate;
+  std::string copyright;
+  uint64_t hash = 0;
+  std::string ext;
+  bool original = true;
+  std::chrono::steady_clock::time_point refreshAt;
 
-        previewerCmd = line.substr(line.find(' ') + 1);
-        break;
-      }
-    }
+  std::string file() const { return hashToHex(hash) + "." + ext; }
+};
 
-    if (previewerCmd.empty()) {
-      // Fallback to default previewers if none specified
-      if (session == "wayland") {
-        if (system("which imv >/dev/null 2>&1") == 0) {
-          previewerCmd = "imv";
-        } else if (system("which swayimg >/dev/null 2>&1") == 0) {
-          previewerCmd = "swayimg";
-        }
-      } else {
-        if (system("which feh >/dev/null 2>&1") == 0) {
-          previewerCmd = "feh";
-        } else if (system("which eog >/dev/null 2>&1") == 0) {
-          previewerCmd = "eog";
-        }
-      }
+// Puts a SharedCache in front of an event loop. Answers that are still
+// fresh come back at once; the rest are looked up on a worker thread, one
+// trip per request however many clients wait for it, and handed back on
+// the loop. Only the worker touches the cache and its store.
+class SharedLookup {
+public:
+  using Done = std::function<void(const SharedAnswer &)>;
 
-      if (previewerCmd.empty()) {
-        previewerCmd = "xdg-open";
-      }
-    }
+  SharedLookup(EventLoop &loop, SharedCache &sharedCache,
+               WallpaperStore &imageStore)
+      : cache(sharedCache), store(imageStore), dir(imageStore.directory()),
+        worker(loop) {}
 
-    // Replace $WARTPAPER with actual path
-    std::string absPath = fs::absolute(wallpaperPath).string();
-    size_t pos = previewerCmd.find("$WARTPAPER");
-    while (pos != std::string::npos) {
-      previewerCmd.replace(pos, 10, absPath);
-      pos = previewerCmd.find("$WARTPAPER");
-    }
+  bool valid() const { return worker.valid(); }
 
-    if (previewerCmd.find("$WARTPAPER") == std::string::npos) {
-      previewerCmd += " " + absPath;
-    }
+  void get(const std::string &resolution, const std::string &format,
+           int index, const std::string &market, Done done);
 
-    logMessage(LogLevel::INFO, "Previewing with: " + previewerCmd);
-    return system(previewerCmd.c_str()) == 0;
+  // What the loop knows, for status
+  const std::unordered_map<std::string, SharedAnswer> &known() const {
+    return answers;
   }
-  return false;
-}
+  size_t served() const { return count; }
+  size_t storeImages() const { return images; }
+  uintmax_t storeBytes() const { return bytes; }
 
-// Update config parameter
-void updateConfigParameter(const std::string &paramName,
-                           const std::string &value,
-                           std::function<bool(const std::string &)> validator) {
-  if (!validator(value)) {
-    LOG_ERROR("Invalid " + paramName + ": " + value);
+private:
+  SharedCache &cache;
+  WallpaperStore &store;
+  const std::string dir;
+  BackgroundWorker worker;
+  std::unordered_map<std::string, SharedAnswer> answers;
+  std::unordered_map<std::string, std::vector<Done>> waiting;
+  size_t count = 0;
+  size_t images = 0;
+  uintmax_t bytes = 0;
+};
+
+void SharedLookup::get(const std::string &resolution,
+                       const std::string &format, int index,
+                       const std::string &market, Done done) {
+  std::string key = resolution + " " + (format.empty() ? "-" : format) + " " +
+                    market + " " + std::to_string(index);
+  auto known = answers.find(key);
+  if (known != answers.end() &&
+      std::chrono::steady_clock::now() < known->second.refreshAt &&
+      fs::exists(dir + known->second.file())) {
+    ++count;
+    return done(known->second);
+  }
+
+  auto &queue = waiting[key];
+  queue.push_back(std::move(done));
+  if (queue.size() > 1) {
     return;
   }
 
-  std::vector<std::string> lines;
-  lines.reserve(20); // Reserve space to avoid reallocations
-  std::ifstream file(WART_CONFIG);
-  std::string line;
-  bool paramFound = false;
+  struct Job {
+    SharedAnswer answer;
+    size_t images = 0;
+    uintmax_t bytes = 0;
+  };
+  auto job = std::make_shared<Job>();
+  worker.run(
+      [this, job, resolution, format, index, market] {
+        SharedCache::Image image;
+        SharedAnswer &answer = job->answer;
+        answer.ok =
+            cache.get(resolution, format, index, market, image, answer.error);
+        if (answer.ok) {
+          answer.url = image.state->imageUrl;
+          answer.startDate = image.state->startDate;
+          answer.endDate = image.state->endDate;
+          answer.copyright = image.state->copyright;
+          answer.hash = image.entry->hash;
+          answer.ext = image.entry->ext;
+          answer.original = image.original;
+          answer.refreshAt = image.refreshAt;
+        }
+        job->images = store.count();
+        job->bytes = store.bytes();
+      },
+      [this, job, key] {
+        if (job->answer.ok) {
+          answers[key] = job->answer;
+        }
+        images = job->images;
+        bytes = job->bytes;
+        auto parked = std::move(waiting[key]);
+        waiting.erase(key);
+        for (auto &pending : parked) {
+          ++count;
+          pending(job->answer);
+        }
+      });
+}
 
-  while (std::getline(file, line)) {
-    if (!line.empty() && line[0] != '#') { // Skip comments
-      std::istringstream iss(line);
-      std::string key;
-      iss >> key;
+// System-wide daemon keeping one cache for every user on the host. Their
+// own daemons, with 'shared 1', ask it for the image at their resolution
+// and format and then apply it and run their hooks in their own sessions.
+// Only this process talks to the providers.
+void wartSystem(const Config &config) {
+  signal(SIGINT, [](int) { running = false; });
+  signal(SIGTERM, [](int) { running = false; });
 
-      if (key == paramName) {
-        lines.push_back(paramName + " " + value);
-        paramFound = true;
-        continue;
-      }
-    }
-    lines.push_back(line);
+  EventLoop loop;
+  FetchClient client;
+  if (!loop.valid() || !client.valid()) {
+    return;
   }
 
-  // Add parameter if not found
-  if (!paramFound) {
-    lines.push_back(paramName + " " + value);
-  }
+  ProviderSet providers;
+  providers.configure(config);
 
-  std::ofstream outFile(WART_CONFIG);
-  for (const auto &l : lines) {
-    outFile << l << "\n";
+  WallpaperStore store(WART_SYSTEM_STORE);
+  if (!store.load()) {
+    return;
   }
-
-  logMessage(LogLevel::INFO, "Updated " + paramName + " to " + value);
-}
-
-// Display status information
-void showStatus() {
-  Config config;
-  if (!loadConfig(WART_CONFIG, config)) {
-    LOG_ERROR("Failed to load configuration");
+  SharedCache cache(config, client, providers, store);
+  SharedLookup lookup(loop, cache, store);
+  if (!lookup.valid()) {
     return;
   }
 
-  std::string wallpaperPath = WART_HOME + "wallpaper." + config.get("format");
+  auto imageReply = [&store](const SharedAnswer &answer) -> ControlReply {
+    if (!answer.ok) {
+      return {false, answer.error + "\n"};
+    }
+    std::string copyright = answer.copyright;
+    std::replace(copyright.begin(), copyright.end(), '\n', ' ');
+    std::ostringstream out;
+    out << "path " << store.directory() << answer.file() << "\n"
+        << "hash " << hashToHex(answer.hash) << "\n"
+        << "ext " << answer.ext << "\n"
+        << "url " << answer.url << "\n"
+        << "original " << (answer.original ? 1 : 0) << "\n"
+        << "startdate " << answer.startDate << "\n"
+        << "enddate " << answer.endDate << "\n"
+        << "copyright " << copyright << "\n";
+    return {true, out.str()};
+  };
 
-  if (!fs::exists(wallpaperPath)) {
-    std::cout << "No wallpaper has been downloaded yet." << std::endl;
-    return;
+  // Any local user may ask; arguments are checked before they get near a
+  // path. Images are looked up off the loop, the reply parked meanwhile.
+  ControlServer control(
+      loop,
+      [&](const std::vector<std::string> &args, ControlServer::Reply reply) {
+        if (args[0] == "image" && args.size() == 3 &&
+            validateResolution(args[1]) && validateFormat(args[2])) {
+          return lookup.get(args[1], args[2], 0, "en-US",
+                            [&imageReply, reply](const SharedAnswer &answer) {
+                              reply(imageReply(answer));
+                            });
+        }
+        if (args[0] == "status") {
+          std::ostringstream out;
+          out << "Wart " << VERSION << " system daemon, pid " << getpid()
+              << ", " << lookup.served() << " images served\n";
+          for (const auto &[key, answer] : lookup.known()) {
+            out << key << ": " << answer.url << " (" << answer.startDate
+                << " to " << answer.endDate << ")\n";
+          }
+          out << "Store: " << lookup.storeImages() << " images, "
+              << lookup.storeBytes() << " bytes\n";
+          return reply({true, out.str()});
+        }
+        reply({false, "Usage: image <resolution> <format> | status\n"});
+      },
+      WART_SYSTEM_SOCKET, true);
+
+  logMessage(LogLevel::INFO, "Serving shared images on " + WART_SYSTEM_SOCKET);
+  while (running && loop.wait(std::chrono::hours(1))) {
   }
+  logMessage(LogLevel::INFO, "Shutting down gracefully");
+}
 
-  std::cout << "Current configuration:" << std::endl;
-  std::cout << "Resolution: " << config.get("resolution") << std::endl;
-  std::cout << "Format: " << config.get("format") << std::endl;
-  std::cout << "Interval: " << config.get("interval") << " seconds"
-            << std::endl;
-  std::cout << "Clean mode: "
-            << (config.getBool("clean") ? "Enabled" : "Disabled") << std::endl;
+// Markets look like en-US
+static bool validateMarket(const std::string &value) {
+  return value.size() == 5 && value[2] == '-' &&
+         std::all_of(value.begin(), value.end(), [](unsigned char c) {
+           return std::isalpha(c) || c == '-';
+         });
+}
 
-  // Show wallpaper file info
-  std::cout << "Current wallpaper: " << wallpaperPath << std::endl;
-  std::cout << "Size: " << fs::file_size(wallpaperPath) << " bytes"
-            << std::endl;
-  auto ftime = fs::last_write_time(wallpaperPath);
-  auto sctp = std::chrono::file_clock::to_sys(ftime);
-  auto time = std::chrono::system_clock::to_time_t(sctp);
-  std::cout << "Last updated: " << std::ctime(&time);
+static const char *imageContentType(const std::string &ext) {
+  if (ext == "png")
+    return "image/png";
+  if (ext == "webp")
+    return "image/webp";
+  return "image/jpeg";
 }
 
-// Main wallpaper update loop
-void wartLoop(const Config &config) {
+// LAN mirror of the metadata API. Answers the same JSON as
+// bing.biturl.top, with image URLs pointing back here, and serves the
+// images out of its own store, so that one box fetches from the internet
+// and the others list it in their 'mirrors'. Metadata and images come
+// from a SharedLookup: requests waiting for the upstream are parked while
+// every other connection carries on, and everything after the first
+// request of the day is served from disk.
+bool wartServe(const Config &config) {
   signal(SIGINT, [](int) { running = false; });
   signal(SIGTERM, [](int) { running = false; });
+  signal(SIGPIPE, SIG_IGN);
 
-  while (running) {
-    if (config.getBool("clean")) {
-      cleanOldWallpapers(config.get("format"));
-    }
+  EventLoop loop;
+  FetchClient client;
+  if (!loop.valid() || !client.valid()) {
+    return false;
+  }
+
+  ProviderSet providers;
+  providers.configure(config);
+
+  WallpaperStore store(WART_MIRROR);
+  if (!store.load()) {
+    return false;
+  }
+  SharedCache cache(config, client, providers, store);
+  SharedLookup lookup(loop, cache, store);
+  if (!lookup.valid()) {
+    return false;
+  }
+  const std::string listen = config.listen;
+  const std::string imageDir = store.directory();
 
-    std::string wallpaperPath = WART_HOME + "wallpaper." + config.get("format");
+  auto textResponse = [](int status, const std::string &message) {
+    HttpResponse response;
+    response.status = status;
+    response.contentType = "text/plain";
+    response.body = message + "\n";
+    return response;
+  };
 
-    // Backup current wallpaper before fetching new one
-    if (fs::exists(wallpaperPath)) {
-      backupWallpaper(wallpaperPath);
+  // Clients fetch the image from whichever name they reached us by
+  auto metadataResponse = [&](const SharedAnswer &answer,
+                              const std::string &host) {
+    if (!answer.ok) {
+      HttpResponse response = textResponse(502, answer.error);
+      response.headers.emplace_back("Retry-After", "60");
+      return response;
     }
+    json body = {{"start_date", answer.startDate},
+                 {"end_date", answer.endDate},
+                 {"url", "http://" + (host.empty() ? listen : host) +
+                             "/images/" + answer.file()},
+                 {"copyright", answer.copyright}};
 
-    bool success = false;
-    for (int attempt = 1; attempt <= 3 && !success; ++attempt) {
-      if (attempt > 1) {
-        logMessage(LogLevel::WARNING,
-                   "Retry attempt " + std::to_string(attempt) + "...");
-        std::this_thread::sleep_for(std::chrono::seconds(5));
-      }
+    HttpResponse response;
+    response.body = body.dump();
+    ContentHash hash;
+    hash.update(response.body.data(), response.body.size());
+    response.etag = "\"" + hashToHex(hash.value()) + "\"";
+    response.headers.emplace_back("Cache-Control", "no-cache");
+    return response;
+  };
 
-      success = fetchWallpaper(config);
+  auto metadata = [&](const HttpRequest &request, HttpServer::Reply reply) {
+    std::string resolution =
+        request.param("resolution", config.resolution);
+    std::string market = request.param("mkt", "en-US");
+    int index = -1;
+    std::string day = request.param("index", "0");
+    std::from_chars(day.data(), day.data() + day.size(), index);
+    if (!validateResolution(resolution)) {
+      return reply(textResponse(400, "Unknown resolution"));
+    }
+    if (request.param("format", "json") != "json") {
+      return reply(textResponse(400, "Only format=json is served"));
+    }
+    if (index < 0 || index > 7) {
+      return reply(textResponse(400, "index must be 0 to 7"));
+    }
+    if (!validateMarket(market)) {
+      return reply(textResponse(400, "Unknown market"));
     }
 
-    if (success) {
-      if (setWallpaper(wallpaperPath)) {
-        logMessage(LogLevel::INFO, "Successfully set wallpaper");
-        executeHooks(wallpaperPath);
-      } else {
-        LOG_ERROR("Failed to set wallpaper");
-      }
-    } else {
-      LOG_ERROR("Failed to fetch wallpaper after multiple attempts");
+    std::string host = request.header("host");
+    lookup.get(resolution, "", index, market,
+               [&metadataResponse, host, reply](const SharedAnswer &answer) {
+                 reply(metadataResponse(answer, host));
+               });
+  };
+
+  // /images/<hash>.<ext>, named by content so never stale. The store
+  // belongs to the worker, so the file is looked up by name alone; one
+  // evicted meanwhile is a 404.
+  auto imageFile = [&](const HttpRequest &request) -> HttpResponse {
+    std::string name = request.path.substr(8);
+    size_t dot = name.find('.');
+    uint64_t hash = 0;
+    std::string ext = dot != std::string::npos ? name.substr(dot + 1) : "";
+    if (dot == std::string::npos || !hexToHash(name.substr(0, dot), hash) ||
+        (ext != "jpg" && ext != "png" && ext != "webp")) {
+      return textResponse(404, "Not Found");
     }
+    HttpResponse response;
+    response.file = imageDir + hashToHex(hash) + "." + ext;
+    response.contentType = imageContentType(ext);
+    response.etag = "\"" + hashToHex(hash) + "\"";
+    response.headers.emplace_back("Cache-Control",
+                                  "public, max-age=31536000, immutable");
+    return response;
+  };
 
-    // Sleep for the configured interval, checking running flag every second
-    logMessage(LogLevel::INFO,
-               "Sleeping for " + config.get("interval") + " seconds...");
-    for (int i = 0; i < config.getInt("interval") && running; ++i) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+  HttpServer server(loop, [&](const HttpRequest &request,
+                              HttpServer::Reply reply) {
+    if (request.path == "/") {
+      return metadata(request, std::move(reply));
+    }
+    if (request.path.starts_with("/images/")) {
+      return reply(imageFile(request));
     }
+    reply(textResponse(404, "Not Found"));
+  });
+  if (!server.listen(listen)) {
+    return false;
   }
 
+  logMessage(LogLevel::INFO, "Serving the metadata API on " + listen);
+  while (running && loop.wait(std::chrono::seconds(30))) {
+    server.closeIdle(std::chrono::seconds(60));
+  }
   logMessage(LogLevel::INFO, "Shutting down gracefully");
+  return true;
 }
 
 // Daemonize the process
 bool daemonize() {
+  // The writer thread would not survive into the child
+  Logger::instance().stop();
+
   pid_t pid = fork();
   if (pid < 0) {
     LOG_ERROR("Failed to fork");
@@ -667,6 +4526,7 @@ bool daemonize() {
     return false;
   }
 
+  daemonized = true;
   return true;
 }
 
@@ -683,14 +4543,38 @@ void showHelp() {
       << "  interval <sec>    Set update interval in seconds\n"
       << "  status           Show current configuration and wallpaper status\n"
       << "  preview          Download and preview next wallpaper\n"
+      << "  prefetch         Download several days at once into the store\n"
+      << "    --days <n>       Days back from today, 1-8 (default 8)\n"
+      << "    --markets <list> Comma separated markets (default en-US)\n"
+      << "    --jobs <n>       Concurrent transfers (default 4)\n"
       << "  destroy          Remove all wart files and configurations\n"
       << "  daemon, -d       Run in daemon mode\n"
+      << "  system           Run the shared cache for all users of the host\n"
+      << "  system status    Show what the shared cache is serving\n"
+      << "  serve            Serve the metadata API and images to the LAN\n"
+      << "    --listen <addr>  [host:]port (default from 'listen', 8080)\n"
       << "  help, -h         Show this help message\n"
-      << "  restore          Restore previous wallpaper\n\n"
+      << "  restore          Restore previous wallpaper\n"
+      << "  restore --steps <k> Go back k replaced wallpapers\n"
+      << "  restore <n>      Restore wallpaper n from the history\n"
+      << "  history          List applied wallpapers, most recent first\n"
+      << "  metrics          Print the metrics of the last update cycle\n"
+      << "  next             Make the running daemon fetch now\n"
+      << "  pause, resume    Stop or restart the daemon's updates\n"
+      << "  reload           Make the running daemon reread the config\n\n"
+      << "Settings (" << WART_CONFIG << "):\n";
+  for (const auto &setting : SETTINGS) {
+    std::cout << "  " << std::left << std::setw(13) << setting.key << " "
+              << setting.doc << " (default "
+              << (setting.fallback.empty() ? "none" : setting.fallback)
+              << ")\n";
+  }
+  std::cout << "\n"
       << "Example:\n"
       << "  wart resolution UHD\n"
       << "  wart format webp\n"
       << "  wart preview\n"
+      << "  wart prefetch --days 8 --markets en-US,ja-JP,de-DE\n"
       << "  wart -d\n";
 }
 
@@ -714,9 +4598,80 @@ void wartDestroy() {
   }
 }
 
+// 'wart system', configured by WART_SYSTEM_CONFIG if there is one
+static bool runSystemDaemon() {
+  Config config;
+  if (fs::exists(WART_SYSTEM_CONFIG) ? !loadConfig(WART_SYSTEM_CONFIG, config)
+                                     : !validateConfig(config)) {
+    return false;
+  }
+
+  // Everything in the cache is there for every user to read
+  umask(022);
+  std::error_code ec;
+  fs::create_directories(WART_SYSTEM_STORE, ec);
+  if (ec) {
+    LOG_ERROR("Failed to create " + WART_SYSTEM_STORE + ": " + ec.message());
+    return false;
+  }
+  if (!createLockFile(WART_SYSTEM_LOCK)) {
+    return false;
+  }
+  configureLogging(config, false);
+
+  try {
+    wartSystem(config);
+  } catch (const std::exception &e) {
+    logMessage(LogLevel::ERROR,
+               std::string("Exception in system daemon: ") + e.what());
+    removeLockFile();
+    return false;
+  }
+  removeLockFile();
+  return true;
+}
+
+// 'wart serve', with the user's config and a store of its own so that it
+// can run next to the user's daemon
+static bool runMirror(const std::string &listen) {
+  Config config;
+  if (fs::exists(WART_CONFIG) ? !loadConfig(WART_CONFIG, config)
+                              : !validateConfig(config)) {
+    return false;
+  }
+  if (!listen.empty()) {
+    if (!validateListen(listen)) {
+      LOG_ERROR("'listen' must be [host:]port");
+      return false;
+    }
+    config.listen = listen;
+  }
+
+  std::error_code ec;
+  fs::create_directories(WART_MIRROR, ec);
+  if (ec) {
+    LOG_ERROR("Failed to create " + WART_MIRROR + ": " + ec.message());
+    return false;
+  }
+  if (!createLockFile(WART_MIRROR + "wart.lock")) {
+    return false;
+  }
+  configureLogging(config, false);
+
+  bool ok = false;
+  try {
+    ok = wartServe(config);
+  } catch (const std::exception &e) {
+    logMessage(LogLevel::ERROR, std::string("Exception in mirror: ") + e.what());
+  }
+  removeLockFile();
+  return ok;
+}
+
 // Main function
 int main(int argc, char *argv[]) {
   printVersion();
+  curl_global_init(CURL_GLOBAL_DEFAULT);
 
   bool daemon = false;
   Config config;
@@ -725,22 +4680,56 @@ int main(int argc, char *argv[]) {
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
 
+    // The running daemon answers these from its own state; without one,
+    // the commands that make sense offline run locally
+    bool daemonOnly = arg == "next" || arg == "pause" || arg == "resume" ||
+                      arg == "reload";
+    if (daemonOnly || arg == "status" || arg == "metrics" ||
+        arg == "restore") {
+      ControlReply reply;
+      if (sendControlRequest({argv + i, argv + argc}, reply)) {
+        (reply.ok ? std::cout : std::cerr) << reply.body << std::flush;
+        return reply.ok ? 0 : 1;
+      }
+      if (daemonOnly) {
+        LOG_ERROR("Wart is not running");
+        return 1;
+      }
+    }
+
     if (arg == "init") {
       return initializeWart() ? 0 : 1;
     } else if (arg == "destroy") {
       wartDestroy();
       return 0;
     } else if (arg == "resolution" && i + 1 < argc) {
-      updateConfigParameter("resolution", argv[++i], validateResolution);
+      updateConfigParameter("resolution", argv[++i]);
       return 0;
     } else if (arg == "format" && i + 1 < argc) {
-      updateConfigParameter("format", argv[++i], validateFormat);
+      updateConfigParameter("format", argv[++i]);
       return 0;
     } else if (arg == "interval" && i + 1 < argc) {
-      updateConfigParameter("interval", argv[++i], validateInterval);
+      updateConfigParameter("interval", argv[++i]);
       return 0;
     } else if (arg == "daemon" || arg == "-d") {
       daemon = true;
+    } else if (arg == "system" && i + 1 < argc &&
+               std::string_view(argv[i + 1]) == "status") {
+      ControlReply reply;
+      if (!sendControlRequest({"status"}, reply, WART_SYSTEM_SOCKET)) {
+        LOG_ERROR("The system daemon is not running");
+        return 1;
+      }
+      (reply.ok ? std::cout : std::cerr) << reply.body << std::flush;
+      return reply.ok ? 0 : 1;
+    } else if (arg == "system") {
+      return runSystemDaemon() ? 0 : 1;
+    } else if (arg == "serve") {
+      std::string listen;
+      if (i + 2 < argc && std::string_view(argv[i + 1]) == "--listen") {
+        listen = argv[i + 2];
+      }
+      return runMirror(listen) ? 0 : 1;
     } else if (arg == "help" || arg == "-h" || arg == "--help") {
       showHelp();
       return 0;
@@ -752,8 +4741,84 @@ int main(int argc, char *argv[]) {
         return 0;
       }
       return 1;
+    } else if (arg == "prefetch") {
+      int days = 8;
+      std::vector<std::string> markets;
+      size_t jobs = 4;
+
+      for (++i; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--days" && i + 1 < argc) {
+          days = std::clamp(std::atoi(argv[++i]), 1, 8);
+        } else if (opt == "--markets" && i + 1 < argc) {
+          std::istringstream list(argv[++i]);
+          std::string market;
+          while (std::getline(list, market, ',')) {
+            if (!market.empty()) {
+              markets.push_back(market);
+            }
+          }
+        } else if (opt == "--jobs" && i + 1 < argc) {
+          jobs = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else {
+          LOG_ERROR("Unknown prefetch option: " + opt);
+          return 1;
+        }
+      }
+      if (markets.empty()) {
+        markets.push_back("en-US");
+      }
+
+      FetchClient client;
+      WallpaperStore store;
+      if (loadConfig(WART_CONFIG, config) && store.load() &&
+          prefetchWallpapers(config, client, store, days, markets, jobs)) {
+        return 0;
+      }
+      return 1;
+    } else if (arg == "metrics") {
+      std::ifstream metrics(WART_METRICS);
+      if (!metrics) {
+        LOG_ERROR("No metrics yet, the update loop writes them every cycle");
+        return 1;
+      }
+      std::cout << metrics.rdbuf();
+      return 0;
+    } else if (arg == "history") {
+      showHistory();
+      return 0;
+    } else if (arg == "restore" && i + 2 < argc &&
+               std::string_view(argv[i + 1]) == "--steps") {
+      size_t steps = 0;
+      if (!parseCount(argv[i + 2], steps) || steps < 1) {
+        LOG_ERROR("Invalid number of steps: " + std::string(argv[i + 2]));
+        return 1;
+      }
+      WallpaperStore store;
+      if (loadConfig(WART_CONFIG, config) && store.load() &&
+          restorePreviousWallpaper(config, store, steps)) {
+        std::cout << "Wallpaper from " << steps << " steps back restored"
+                  << std::endl;
+        return 0;
+      }
+      return 1;
+    } else if (arg == "restore" && i + 1 < argc) {
+      size_t n = 0;
+      if (!parseCount(argv[++i], n)) {
+        LOG_ERROR("Invalid history position: " + std::string(argv[i]));
+        return 1;
+      }
+      WallpaperStore store;
+      if (loadConfig(WART_CONFIG, config) && store.load() &&
+          restoreFromHistory(config, store, n)) {
+        std::cout << "Wallpaper " << n << " restored successfully" << std::endl;
+        return 0;
+      }
+      return 1;
     } else if (arg == "restore") {
-      if (loadConfig(WART_CONFIG, config) && restorePreviousWallpaper(config)) {
+      WallpaperStore store;
+      if (loadConfig(WART_CONFIG, config) && store.load() &&
+          restorePreviousWallpaper(config, store, 1)) {
         std::cout << "Previous wallpaper restored successfully" << std::endl;
         return 0;
       }
@@ -781,10 +4846,12 @@ int main(int argc, char *argv[]) {
     removeLockFile();
     return 1;
   }
+  configureLogging(config, true);
 
   try {
     // Run main loop
-    wartLoop(config);
+    ConfigHandle configHandle(std::make_shared<const Config>(std::move(config)));
+    wartLoop(configHandle);
   } catch (const std::exception &e) {
     logMessage(LogLevel::ERROR,
                std::string("Exception in main loop: ") + e.what());
@@ -797,6 +4864,3 @@ int main(int argc, char *argv[]) {
 }
 
 } // namespace wart
-
-// Entry point outside namespace
-int main(int argc, char *argv[]) { return wart::main(argc, argv); }
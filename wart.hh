@@ -1,24 +1,58 @@
 #pragma once
 
+#include "log.hh"
+
 // Standard Library
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 
 // System headers
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
 
 // External libraries
 #include <curl/curl.h>
@@ -38,50 +72,157 @@ inline std::string getWartHome() {
 inline const std::string WART_HOME = getWartHome();
 inline const std::string WART_CONFIG = WART_HOME + "wartrc";
 inline const std::string WART_LOCK = WART_HOME + "wart.lock";
+inline const std::string WART_STATE = WART_HOME + "state.json";
+inline const std::string WART_STORE = WART_HOME + "store/";
+inline const std::string WART_COLORS = WART_HOME + "colors.json";
+inline const std::string WART_COLORS_SH = WART_HOME + "colors.sh";
+inline const std::string WART_HISTORY = WART_HOME + "history.idx";
+inline const std::string WART_PREVIOUS = WART_HOME + "previous/";
+inline const std::string WART_LOG = WART_HOME + "wart.log";
+inline const std::string WART_METRICS = WART_HOME + "metrics.prom";
+inline const std::string WART_SOCKET = WART_HOME + "wart.sock";
+inline const std::string WART_MIRROR = WART_HOME + "mirror/"; // 'wart serve'
+
+// The system-wide daemon ('wart system') keeps one cache of images for all
+// users on the host; their daemons take images from it with 'shared 1'
+inline const std::string WART_SYSTEM_HOME = "/var/cache/wart/";
+inline const std::string WART_SYSTEM_CONFIG = "/etc/wartrc";
+inline const std::string WART_SYSTEM_STORE = WART_SYSTEM_HOME + "store/";
+inline const std::string WART_SYSTEM_LOCK = WART_SYSTEM_HOME + "wart.lock";
+inline const std::string WART_SYSTEM_SOCKET = WART_SYSTEM_HOME + "wart.sock";
 
 // Error handling macro
 #ifdef DEBUG
 #define LOG_ERROR(msg)                                                         \
-  std::cerr << "Error: " << msg << " at " << __FILE__ << ":" << __LINE__       \
-            << std::endl
+  ::wart::logMessage(::wart::LogLevel::ERROR,                                  \
+                     std::string(msg) + " at " + __FILE__ + ":" +              \
+                         std::to_string(__LINE__))
 #else
-#define LOG_ERROR(msg) std::cerr << "Error: " << msg << std::endl
+#define LOG_ERROR(msg) ::wart::logMessage(::wart::LogLevel::ERROR, msg)
 #endif
 
-// Logging levels
-enum class LogLevel { DEBUG, INFO, WARNING, ERROR };
+// Session types that commands can be restricted to
+enum class SessionType { Other, X11, Wayland };
+
+// Commands configured for one session type, in config file order. Generic
+// directives (applier, hooks, previewer) are included for every session.
+struct SessionCommands {
+  std::vector<std::string> appliers;
+  std::vector<std::string> hooks;
+  std::vector<std::string> previewers;
+};
+
+// Every scalar wartrc key, in the order a new wartrc lists them:
+//   X(key, type, default, validator, what a valid value is, initial, doc)
+// The Config fields, loading and validation, the default wartrc and the
+// help text are all generated from this list. initial is what a new wartrc
+// sets the key to: empty for the default, a value, or "# value" for a
+// commented out example. doc is its comment there and its line in 'wart
+// help'.
+#define WART_SETTINGS(X)                                                       \
+  X(schedule, std::string, "interval", validateSchedule,                       \
+    "interval or enddate", "enddate",                                          \
+    "interval: every interval seconds; enddate: once per image")              \
+  X(publishtime, std::string, "08:00", validatePublishTime, "HH:MM (UTC)", "", \
+    "When the API publishes the next image, UTC")                              \
+  X(skew, int, 600, validateCount, "an integer >= 0 (seconds)", "",            \
+    "Up to this many seconds after publishtime, different per machine")       \
+  X(interval, int, 3600, validateInterval, "an integer > 0 (seconds)", "",     \
+    "Seconds between updates, or after an image without dates")               \
+  X(resolution, std::string, "1920x1080", validateResolution,                  \
+    "a valid resolution", "", "Image size, e.g. UHD or 1920x1080")             \
+  X(format, std::string, "jpg", validateFormat, "jpg, webp, or png", "",       \
+    "Wallpaper file format, converted locally when needed")                   \
+  X(quality, int, 90, validateQuality, "an integer from 1 to 100", "",         \
+    "Encoder quality when converting to jpg or webp")                         \
+  X(timerslack, int, 0, validateCount, "an integer >= 0 (milliseconds)",       \
+    "# 50", "Lets the kernel batch the daemon's wakeups by this many ms")      \
+  X(storecount, int, 16, validateCount, "an integer >= 0", "",                 \
+    "Images kept in the store, 0 is unlimited")                               \
+  X(storesize, int, 0, validateCount, "an integer >= 0 (MiB)", "",             \
+    "Store size limit in MiB, 0 is unlimited")                                \
+  X(shared, bool, 0, validateBoolean, "0 or 1", "# 1",                         \
+    "Take images from the host's shared cache ('wart system') when it runs")  \
+  X(mirrors, std::string, "https://bing.biturl.top/", validateMirrors,         \
+    "comma separated http:// or https:// URLs",                                \
+    "# https://bing.biturl.top/,http://localhost:8080/",                      \
+    "Metadata API and its mirrors, in order of preference")                   \
+  X(hedge, bool, 1, validateBoolean, "0 or 1", "# 0",                          \
+    "Also ask the next mirror when one is slower than usual")                 \
+  X(listen, std::string, "8080", validateListen, "[host:]port",                \
+    "# 0.0.0.0:8080", "Where 'wart serve' answers as a mirror for the LAN")    \
+  X(retries, int, 5, validateInterval, "an integer > 0", "",                   \
+    "Attempts per update, with randomized growing delays between them")       \
+  X(retrymax, int, 300, validateInterval, "an integer > 0 (seconds)", "",      \
+    "Longest delay between two attempts")                                     \
+  X(cooldown, int, 1800, validateCount, "an integer >= 0 (seconds)", "",       \
+    "Seconds to leave a server alone after retries failures in a row")        \
+  X(splay, bool, 1, validateBoolean, "0 or 1", "",                             \
+    "Update at an offset within the interval that differs per machine")       \
+  X(historydepth, int, 8, validateCount, "an integer >= 0", "",                \
+    "Replaced wallpapers kept for 'wart restore --steps n'")                  \
+  X(loglevel, std::string, "info", validateLogLevel,                           \
+    "debug, info, warning or error", "", "Least severe messages logged")       \
+  X(logformat, std::string, "text", validateLogFormat, "text or json", "",     \
+    "json writes one object per line")                                        \
+  X(logsize, int, 1, validateCount, "an integer >= 0 (MiB)", "",               \
+    "wart.log is rotated at this many MiB, 0 for no file")                    \
+  X(metricsfile, std::string, "", validateText, "a path",                      \
+    "# /var/lib/node_exporter/textfile/wart.prom",                             \
+    "Also write the metrics here, e.g. for node_exporter")                    \
+  X(derive, bool, 0, validateBoolean, "0 or 1", "# 1",                         \
+    "Download the UHD original once and scale it to resolution locally")      \
+  X(hookjobs, int, 4, validateInterval, "an integer > 0", "",                  \
+    "Hooks run in parallel up to this many, 1 keeps their order")             \
+  X(hooktimeout, int, 60, validateCount,                                       \
+    "an integer >= 0 (seconds, 0 is none)", "",                                \
+    "Seconds a hook may take before it is killed, 0 for no limit")            \
+  X(palette, bool, 0, validateBoolean, "0 or 1", "1",                          \
+    "Write the colours to colors.json and colors.sh ($WARTCOLORS)")
 
-// Configuration interface
+// Configuration interface. Settings are plain fields, parsed and validated
+// once when the file is loaded.
 struct Config {
-  std::unordered_map<std::string, std::string> values;
+#define WART_SETTING_FIELD(key, type, fallback, ...) type key = fallback;
+  WART_SETTINGS(WART_SETTING_FIELD)
+#undef WART_SETTING_FIELD
 
-  std::string get(const std::string &key,
-                  const std::string &defaultValue = "") const {
-    auto it = values.find(key);
-    return (it != values.end()) ? it->second : defaultValue;
+  std::array<SessionCommands, 3> commands;
+
+  const SessionCommands &commandsFor(SessionType session) const {
+    return commands[static_cast<size_t>(session)];
   }
+};
 
-  int getInt(const std::string &key, int defaultValue = 0) const {
-    try {
-      return std::stoi(get(key, std::to_string(defaultValue)));
-    } catch (...) {
-      return defaultValue;
-    }
+// Current configuration of the daemon. Readers take a snapshot that stays
+// valid for as long as they hold it; a reload swaps in a new one atomically.
+class ConfigHandle {
+public:
+  explicit ConfigHandle(std::shared_ptr<const Config> initial)
+      : current(std::move(initial)) {}
+
+  std::shared_ptr<const Config> get() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current;
   }
 
-  bool getBool(const std::string &key, bool defaultValue = false) const {
-    std::string val = get(key, defaultValue ? "1" : "0");
-    return val == "1" || val == "true" || val == "yes";
+  void set(std::shared_ptr<const Config> config) {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = std::move(config);
   }
+
+private:
+  mutable std::mutex mutex;
+  std::shared_ptr<const Config> current;
 };
 
-// Memory buffer for curl operations
+// Memory buffer for curl operations. Capacity doubles as it fills, so a
+// body arriving in many callbacks is copied a constant number of times per
+// byte, and reserve() sizes it up front when Content-Length is known. The
+// contents are kept NUL terminated.
 class MemoryBuffer {
 public:
-  MemoryBuffer() : memory(static_cast<char *>(malloc(1))), size(0) {
-    if (memory)
-      memory[0] = '\0';
-  }
+  MemoryBuffer() = default;
 
   ~MemoryBuffer() { free(memory); }
 
@@ -91,9 +232,10 @@ public:
 
   // Allow moving
   MemoryBuffer(MemoryBuffer &&other) noexcept
-      : memory(other.memory), size(other.size) {
+      : memory(other.memory), size(other.size), capacity(other.capacity) {
     other.memory = nullptr;
     other.size = 0;
+    other.capacity = 0;
   }
 
   MemoryBuffer &operator=(MemoryBuffer &&other) noexcept {
@@ -101,40 +243,412 @@ public:
       free(memory);
       memory = other.memory;
       size = other.size;
+      capacity = other.capacity;
       other.memory = nullptr;
       other.size = 0;
+      other.capacity = 0;
     }
     return *this;
   }
 
+  // Make room for at least bytes of content without further allocation
+  bool reserve(size_t bytes) {
+    return bytes < capacity || resize(bytes + 1);
+  }
+
   // Append data to the buffer
   bool append(const void *data, size_t dataSize) {
-    char *newMem = static_cast<char *>(realloc(memory, size + dataSize + 1));
-    if (!newMem) {
+    size_t needed = size + dataSize + 1;
+    if (needed > capacity &&
+        !resize(std::max(needed, capacity ? capacity * 2 : size_t{256}))) {
       return false;
     }
 
-    memory = newMem;
     memcpy(memory + size, data, dataSize);
     size += dataSize;
     memory[size] = '\0';
     return true;
   }
 
-  const char *data() const { return memory; }
+  void clear() {
+    size = 0;
+    if (memory)
+      memory[0] = '\0';
+  }
+
+  const char *data() const { return memory ? memory : ""; }
   size_t length() const { return size; }
+  std::string_view view() const { return {data(), size}; }
 
 private:
-  char *memory;
-  size_t size;
+  bool resize(size_t newCapacity) {
+    char *newMem = static_cast<char *>(realloc(memory, newCapacity));
+    if (!newMem) {
+      return false;
+    }
+
+    memory = newMem;
+    capacity = newCapacity;
+    memory[size] = '\0';
+    return true;
+  }
+
+  char *memory = nullptr;
+  size_t size = 0;
+  size_t capacity = 0;
+};
+
+// Incremental 64-bit FNV-1a hash used to identify image contents
+class ContentHash {
+public:
+  void update(const void *data, size_t dataSize) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < dataSize; ++i) {
+      state = (state ^ bytes[i]) * 0x100000001b3ULL;
+    }
+  }
+
+  uint64_t value() const { return state; }
+
+private:
+  uint64_t state = 0xcbf29ce484222325ULL;
+};
+
+// One image in the wallpaper store
+struct StoreEntry {
+  uint64_t hash = 0;
+  std::string ext;
+  uintmax_t size = 0;
+  int64_t lastUsed = 0; // Unix time of the last link or ingest
+  std::string url;
+  uint64_t source = 0;  // Image this one was derived from, if any
+  std::string variant;  // Derivation, e.g. the resolution it was scaled to
+};
+
+// Content-addressed wallpaper store. Images are kept as <hash>.<ext> under
+// WART_STORE and tracked by a manifest in least-recently-used order, so
+// lookups, dedupe and eviction never have to scan the directory.
+class WallpaperStore {
+public:
+  explicit WallpaperStore(std::string directory = WART_STORE)
+      : dir(std::move(directory)) {}
+
+  // Read the manifest, creating the store directory if needed
+  bool load();
+  bool save() const;
+
+  std::string pathFor(const StoreEntry &entry) const;
+  const StoreEntry *find(uint64_t hash) const;
+  const StoreEntry *findUrl(const std::string &url) const;
+  const StoreEntry *findVariant(uint64_t source,
+                                const std::string &variant) const;
+
+  // Add a finished file under its hash. The file is moved or copied into
+  // place, or dropped when the store already holds the same image.
+  const StoreEntry *ingest(const std::string &file, uint64_t hash,
+                           const std::string &ext, const std::string &url,
+                           bool move = true);
+
+  // Add an image derived locally from a stored one, so that the next
+  // request for the same variant is served without redoing the work
+  const StoreEntry *ingestVariant(const std::string &file, uint64_t hash,
+                                  const std::string &ext, uint64_t source,
+                                  const std::string &variant);
+
+  // Atomically point dest at the stored image and mark it used
+  bool link(uint64_t hash, const std::string &dest);
+
+  // Mark the stored image used now
+  void touch(uint64_t hash);
+
+  // Drop least recently used images until within the budget, a limit of 0
+  // means unlimited. The pinned image is never evicted, nor are images used
+  // within keepRecent, which may leave the store over budget for a while.
+  void evict(size_t maxCount, uintmax_t maxBytes, uint64_t pinned,
+             std::chrono::seconds keepRecent = std::chrono::seconds(0));
+
+  size_t count() const { return entries.size(); }
+  uintmax_t bytes() const { return totalBytes; }
+  const std::string &directory() const { return dir; }
+
+private:
+  using Iterator = std::list<StoreEntry>::iterator;
+
+  void erase(Iterator it);
+  static std::string variantKey(uint64_t source, const std::string &variant);
+
+  std::string dir;
+  std::list<StoreEntry> entries; // Most recently used first
+  std::unordered_map<uint64_t, Iterator> byHash;
+  std::unordered_map<std::string, uint64_t> byUrl;
+  std::unordered_map<std::string, uint64_t> byVariant;
+  uintmax_t totalBytes = 0;
 };
 
+// The fields wart uses from a metadata API response
+struct WallpaperMetadata {
+  std::string url;
+  std::string startDate; // YYYYMMDD
+  std::string endDate;
+  std::string copyright;
+};
+
+// Outcome of a fetch cycle
+enum class FetchResult { Updated, Unchanged, Failed };
+
+// Cache validators and identity of the last fetch, persisted in WART_STATE
+// so that an unchanged wallpaper is neither downloaded nor applied again
+struct FetchState {
+  std::string metadataUrl;
+  std::string metadataEtag;
+  std::string metadataLastModified;
+  std::string imageUrl;
+  std::string imagePath;
+  uint64_t imageHash = 0;
+  std::string startDate; // What the API said about the image
+  std::string endDate;
+  std::string copyright;
+  std::string partialUrl; // Image left half-downloaded in the store
+  std::string partialEtag;
+  std::string partialLastModified;
+};
+
+// Long-lived libcurl client. Owns a share handle (DNS cache, connection
+// pool, TLS sessions) and a reusable easy handle so that the metadata and
+// image requests of every cycle and retry go over warm connections.
+class FetchClient {
+public:
+  FetchClient();
+  ~FetchClient();
+
+  FetchClient(const FetchClient &) = delete;
+  FetchClient &operator=(const FetchClient &) = delete;
+
+  bool valid() const { return share != nullptr && easy != nullptr; }
+
+  // Reset the reusable handle and apply the options common to every
+  // transfer. The returned handle stays owned by the client.
+  CURL *prepare(const std::string &url, long timeoutSeconds);
+
+  // Perform the transfer prepared last and account for connection reuse.
+  CURLcode perform();
+
+  // Create an extra handle on the same caches for concurrent transfers,
+  // owned by the caller. Call account() once it has finished.
+  CURL *createHandle(const std::string &url, long timeoutSeconds);
+  void account(CURL *handle, CURLcode res);
+
+  size_t reusedConnections() const { return reused; }
+  size_t freshConnections() const { return fresh; }
+
+  // Retry-After of the last accounted transfer, zero if it sent none
+  std::chrono::seconds retryAfter() const { return lastRetryAfter; }
+
+private:
+  void configure(CURL *handle, const std::string &url, long timeoutSeconds);
+
+  CURLSH *share;
+  CURL *easy;
+  size_t reused = 0;
+  size_t fresh = 0;
+  std::chrono::seconds lastRetryAfter{0};
+};
+
+// Blocking wait used by the daemon between cycles. On Linux it is a single
+// epoll_wait over a timerfd and a signalfd, elsewhere a pselect, so the
+// process only wakes when the delay expires or a signal arrives.
+class EventLoop {
+public:
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  bool valid() const;
+
+  // Let the kernel defer this thread's timed waits by up to slack so that
+  // wakeups can be coalesced. Linux only, no-op elsewhere.
+  void setTimerSlack(std::chrono::milliseconds slack);
+
+  // Call onReadable from wait() whenever fd has data
+  void watch(int fd, std::function<void()> onReadable);
+  void unwatch(int fd);
+
+  // Call a watched fd's callback when it can be written to instead of
+  // when it has data, or back. Lets a server park a connection whose
+  // socket buffer is full without spinning on its pending input.
+  void setWriting(int fd, bool writing);
+
+  // Sleep for delay, dispatching watched descriptors meanwhile. Returns
+  // false as soon as SIGINT or SIGTERM arrives.
+  bool wait(std::chrono::milliseconds delay);
+
+  // From a watch callback: end the current wait() early, as if the delay
+  // had expired
+  void interrupt() { interrupted = true; }
+
+private:
+  bool waitBlocked(std::chrono::milliseconds delay, const sigset_t &previous);
+  void dispatch(int fd);
+
+  sigset_t signals;
+  bool interrupted = false;
+  std::unordered_map<int, std::function<void()>> watches;
+  std::unordered_set<int> writers;
+#ifdef __linux__
+  int epollFd = -1;
+  int timerFd = -1;
+  int signalFd = -1;
+#endif
+};
+
+// Reloads WART_CONFIG into a ConfigHandle whenever the file is rewritten.
+// The directory is watched rather than the file so that editors replacing
+// it by rename are noticed too. Linux only.
+class ConfigWatcher {
+public:
+  ConfigWatcher(EventLoop &loop, ConfigHandle &handle);
+  ~ConfigWatcher();
+
+  ConfigWatcher(const ConfigWatcher &) = delete;
+  ConfigWatcher &operator=(const ConfigWatcher &) = delete;
+
+private:
+  void onReadable();
+
+  EventLoop &loop;
+  ConfigHandle &handle;
+  int fd = -1;
+};
+
+// Answer to a control request
+struct ControlReply {
+  bool ok = true;
+  std::string body;
+  bool answered = true; // False when the daemon hung up or timed out first
+};
+
+// Unix-domain socket at WART_SOCKET through which CLI commands reach the
+// running daemon. A request is one line of space separated words, the
+// reply a status line ("ok" or "error") followed by the body. Requests
+// are served from the event loop, only for the daemon's own user unless
+// anyUser is set. Clients are non-blocking and read as their bytes
+// arrive, so one that connects and sends nothing holds up nobody.
+class ControlServer {
+public:
+  // A handler answers through reply, at once or later from the loop's
+  // thread; a reply for a client that has gone away is dropped
+  using Reply = std::function<void(ControlReply)>;
+  using Handler =
+      std::function<void(const std::vector<std::string> &args, Reply reply)>;
+
+  ControlServer(EventLoop &loop, Handler handler,
+                std::string socketPath = WART_SOCKET, bool anyUser = false);
+  ~ControlServer();
+
+  ControlServer(const ControlServer &) = delete;
+  ControlServer &operator=(const ControlServer &) = delete;
+
+private:
+  struct Client;
+
+  void onAccept();
+  void onClient(int client);
+  void dispatch(Client &client);
+  void flush(Client &client);
+  void closeClient(int client);
+
+  EventLoop &loop;
+  Handler handler;
+  std::string path;
+  bool shared;
+  int fd = -1;
+  std::unordered_map<int, std::unique_ptr<Client>> clients;
+  uint64_t requests = 0; // Ids matching late replies to their request
+};
+
+// Send a request to the running daemon. False when none is listening.
+bool sendControlRequest(const std::vector<std::string> &args,
+                        ControlReply &reply,
+                        const std::string &socketPath = WART_SOCKET);
+
+// Outcome of one command run by the ProcessExecutor
+struct ProcessResult {
+  std::string command;
+  int exitCode = -1; // -1 if it could not start or was killed by a signal
+  bool timedOut = false;
+  std::chrono::milliseconds wallTime{0};
+};
+
+// A command line split into arguments
+struct CommandLine {
+  std::vector<std::string> args;
+  bool needsShell = false; // Uses syntax only /bin/sh can interpret
+};
+
+// Runs appliers, hooks and previewers with posix_spawn instead of system().
+// Commands are split into arguments here; only lines using shell syntax
+// (pipes, redirections, variables other than $WARTPAPER, ...) go through
+// /bin/sh. Up to jobs commands run at once, each stopped after timeout
+// (zero for none), and children are reaped through pidfds where available.
+class ProcessExecutor {
+public:
+  ProcessExecutor(size_t maxJobs, std::chrono::milliseconds limit)
+      : jobs(std::max<size_t>(maxJobs, 1)), timeout(limit) {}
+
+  // Exported to every child, e.g. WARTPAPER
+  void setEnv(const std::string &name, const std::string &value);
+
+  // Run commands with $WARTPAPER replaced by wallpaperPath, which is added
+  // as the last argument when appendPath is set and the command lacks it.
+  // Results are in the order of commands.
+  std::vector<ProcessResult> run(const std::vector<std::string> &commands,
+                                 const std::string &wallpaperPath,
+                                 bool appendPath = false);
+
+private:
+  size_t jobs;
+  std::chrono::milliseconds timeout;
+  std::vector<std::pair<std::string, std::string>> env;
+};
+
+class ProviderSet;
+
 // Forward declarations of key functions
-void logMessage(LogLevel level, const std::string &message);
+void logMessage(LogLevel level, std::string message);
+void configureLogging(const Config &config, bool withFile);
 bool loadConfig(const std::string &path, Config &config);
 bool validateConfig(const Config &config);
-bool fetchWallpaper(const Config &config);
-bool setWallpaper(const std::string &path);
-void executeHooks(const std::string &wallpaperPath);
+bool loadFetchState(const std::string &path, FetchState &state);
+bool saveFetchState(const std::string &path, const FetchState &state);
+FetchResult fetchWallpaper(const Config &config, FetchClient &client,
+                           ProviderSet &providers, FetchState &state,
+                           WallpaperStore &store);
+bool prefetchWallpapers(const Config &config, FetchClient &client,
+                        WallpaperStore &store, int days,
+                        const std::vector<std::string> &markets, size_t jobs);
+bool reloadConfig(ConfigHandle &handle);
+void wartSystem(const Config &config);
+bool wartServe(const Config &config);
+std::optional<SessionType> detectSession();
+bool setWallpaper(const Config &config, const std::string &path,
+                  const std::string &original = "");
+std::string originalImage(const WallpaperStore &store, uint64_t hash,
+                          const std::string &fallback);
+bool updatePalette(const WallpaperStore &store, uint64_t hash,
+                   const std::string &wallpaperPath);
+void executeHooks(const Config &config, const std::string &wallpaperPath);
+size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
+                           void *userp);
+bool parseMetadata(std::string_view body, WallpaperMetadata &metadata,
+                   std::string &error);
+std::string hashToHex(uint64_t hash);
+bool hexToHash(const std::string &hex, uint64_t &hash);
+bool writeFileAtomic(const std::string &path, const std::string &contents);
+bool cloneFile(const std::string &src, const std::string &dest);
+CommandLine tokenizeCommand(const std::string &command);
+bool substituteWartpaper(std::string &arg, const std::string &path);
+int main(int argc, char *argv[]);
 
 } // namespace wart
@@ -0,0 +1,162 @@
+#include "x11.hh"
+#include "image.hh"
+#include "wart.hh"
+
+#ifdef WART_HAVE_X11
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#endif
+
+namespace wart {
+
+#ifdef WART_HAVE_X11
+bool haveX11Applier() { return haveJpeg(); }
+
+namespace {
+
+// Position of the lowest set bit of a visual's channel mask
+int maskShift(unsigned long mask) {
+  return mask ? __builtin_ctzl(mask) : 0;
+}
+
+// Pixmap id stored in a root window property, 0 if there is none
+Pixmap rootPixmap(Display *display, Window root, Atom property) {
+  Atom type = 0;
+  int format = 0;
+  unsigned long items = 0, after = 0;
+  unsigned char *data = nullptr;
+  Pixmap pixmap = 0;
+
+  if (XGetWindowProperty(display, root, property, 0, 1, False, AnyPropertyType,
+                         &type, &format, &items, &after, &data) == Success &&
+      type == XA_PIXMAP && items == 1 && data) {
+    pixmap = *reinterpret_cast<Pixmap *>(data);
+  }
+  if (data) {
+    XFree(data);
+  }
+  return pixmap;
+}
+
+} // namespace
+
+bool setRootWallpaper(const std::string &path) {
+  std::string format = sniffImageFormat(path);
+  if (format != "jpg") {
+    LOG_ERROR("Built-in applier only reads JPEG, " + path + " is " +
+              (format.empty() ? "not an image" : format));
+    return false;
+  }
+
+  Display *display = XOpenDisplay(nullptr);
+  if (!display) {
+    LOG_ERROR("Cannot open X display");
+    return false;
+  }
+
+  int screen = DefaultScreen(display);
+  Window root = RootWindow(display, screen);
+  Visual *visual = DefaultVisual(display, screen);
+  int depth = DefaultDepth(display, screen);
+  int width = DisplayWidth(display, screen);
+  int height = DisplayHeight(display, screen);
+
+  if (depth < 24 || visual->c_class != TrueColor) {
+    LOG_ERROR("Built-in applier needs a 24 or 32 bit TrueColor visual");
+    XCloseDisplay(display);
+    return false;
+  }
+
+  // Decode straight to about the screen size, then fill it exactly
+  Image image;
+  if (!decodeJpeg(path, image, width, height)) {
+    XCloseDisplay(display);
+    return false;
+  }
+  if (image.width != width || image.height != height) {
+    image = resizeToFill(image, width, height);
+  }
+
+  // Pack into the server's 32 bit pixel layout; XDestroyImage frees it
+  auto *data = static_cast<uint32_t *>(
+      malloc(static_cast<size_t>(width) * static_cast<size_t>(height) * 4));
+  if (!data) {
+    LOG_ERROR("Out of memory for root pixmap");
+    XCloseDisplay(display);
+    return false;
+  }
+  int redShift = maskShift(visual->red_mask);
+  int greenShift = maskShift(visual->green_mask);
+  int blueShift = maskShift(visual->blue_mask);
+  for (int y = 0; y < height; ++y) {
+    const uint8_t *in = image.row(y);
+    uint32_t *out = data + static_cast<size_t>(y) * static_cast<size_t>(width);
+    for (int x = 0; x < width; ++x, in += 3) {
+      out[x] = static_cast<uint32_t>(in[0]) << redShift |
+               static_cast<uint32_t>(in[1]) << greenShift |
+               static_cast<uint32_t>(in[2]) << blueShift;
+    }
+  }
+  image = Image{};
+
+  XImage *ximage =
+      XCreateImage(display, visual, static_cast<unsigned>(depth), ZPixmap, 0,
+                   reinterpret_cast<char *>(data), static_cast<unsigned>(width),
+                   static_cast<unsigned>(height), 32, 0);
+  if (!ximage || ximage->bits_per_pixel != 32) {
+    LOG_ERROR("Cannot create root image");
+    if (ximage) {
+      XDestroyImage(ximage);
+    } else {
+      free(data);
+    }
+    XCloseDisplay(display);
+    return false;
+  }
+
+  Pixmap pixmap = XCreatePixmap(display, root, static_cast<unsigned>(width),
+                                static_cast<unsigned>(height),
+                                static_cast<unsigned>(depth));
+  GC gc = XCreateGC(display, pixmap, 0, nullptr);
+  XPutImage(display, pixmap, gc, ximage, 0, 0, 0, 0,
+            static_cast<unsigned>(width), static_cast<unsigned>(height));
+  XFreeGC(display, gc);
+  XDestroyImage(ximage);
+
+  Atom rootAtom = XInternAtom(display, "_XROOTPMAP_ID", False);
+  Atom esetrootAtom = XInternAtom(display, "ESETROOT_PMAP_ID", False);
+
+  // Swap the properties atomically for other clients. A previous setter
+  // that left its pixmap behind, as we are about to, owns both ids; killing
+  // that client frees the old pixmap.
+  XGrabServer(display);
+  Pixmap oldRoot = rootPixmap(display, root, rootAtom);
+  Pixmap oldEsetroot = rootPixmap(display, root, esetrootAtom);
+  if (oldRoot && oldRoot == oldEsetroot) {
+    XKillClient(display, oldRoot);
+  }
+
+  XChangeProperty(display, root, rootAtom, XA_PIXMAP, 32, PropModeReplace,
+                  reinterpret_cast<unsigned char *>(&pixmap), 1);
+  XChangeProperty(display, root, esetrootAtom, XA_PIXMAP, 32, PropModeReplace,
+                  reinterpret_cast<unsigned char *>(&pixmap), 1);
+  XSetWindowBackgroundPixmap(display, root, pixmap);
+  XClearWindow(display, root);
+  XUngrabServer(display);
+
+  // Keep the pixmap alive after we disconnect
+  XSetCloseDownMode(display, RetainPermanent);
+  XCloseDisplay(display);
+  return true;
+}
+#else
+bool haveX11Applier() { return false; }
+
+bool setRootWallpaper(const std::string &) {
+  LOG_ERROR("Built without the X11 applier");
+  return false;
+}
+#endif
+
+} // namespace wart
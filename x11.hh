@@ -0,0 +1,17 @@
+#pragma once
+
+// Standard Library
+#include <string>
+
+namespace wart {
+
+// Whether the built-in root window applier is available
+bool haveX11Applier();
+
+// Decode the wallpaper once, scale it to fill the root window and publish
+// it through _XROOTPMAP_ID/ESETROOT_PMAP_ID, like feh --bg-fill does but
+// without a helper process. The pixmap left by the previous setter is
+// freed. Only JPEG is decoded.
+bool setRootWallpaper(const std::string &path);
+
+} // namespace wart